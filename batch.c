@@ -0,0 +1,373 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "bfplusplus.h"
+
+/*
+ * Batch runs (--batch in main.c): one loaded program run over many input
+ * files, each on its own VM, writing one output file per input.
+ *
+ * The program is loaded and prepared once by program_load_file() and shared
+ * read-only by a pool of worker threads, one per core by default, each with a
+ * VM that it resets for every input (see libbfpp.c). The inputs are dealt out
+ * to the workers as equal ranges of indices, from which each worker takes its
+ * next input; once out, a worker steals half of the remaining range of
+ * another, so that the workers stay busy however uneven the inputs are.
+ */
+
+typedef struct _BatchQueue BatchQueue;
+typedef struct _Batch Batch;
+typedef struct _BatchWorker BatchWorker;
+typedef struct _BatchBuffer BatchBuffer;
+
+/*
+ * The inputs [head, tail) not yet taken from a worker's range, taken from the
+ * tail by the worker itself and stolen from the head by others
+ */
+struct _BatchQueue {
+  pthread_mutex_t lock;
+  size_t head;
+  size_t tail;
+};
+
+struct _Batch {
+  const BFProgram* program;
+  char** inputs;
+  const char* out_dir;
+  uint8_t* clashes;
+
+  BatchQueue* queues;
+  size_t workers;
+};
+
+/*
+ * A growable byte buffer, holding the input or output of a run
+ */
+struct _BatchBuffer {
+  uint8_t* bytes;
+  size_t length;
+  size_t capacity;
+  size_t pos;
+};
+
+struct _BatchWorker {
+  Batch* batch;
+  size_t id;
+  pthread_t thread;
+
+  BatchBuffer in;
+  BatchBuffer out;
+  size_t failed;
+};
+
+/* Grows a buffer to fit at least 'length' bytes, returning 0 without memory */
+static int buffer_reserve(BatchBuffer* buf, size_t length) {
+  if (length > buf->capacity) {
+    size_t capacity = (buf->capacity == 0) ? 65536 : buf->capacity;
+    while (capacity < length) { capacity *= 2; }
+
+    uint8_t* bytes = (uint8_t*) realloc(buf->bytes, capacity);
+    if (bytes == NULL) { return 0; }
+    buf->bytes = bytes;
+    buf->capacity = capacity;
+  }
+  return 1;
+}
+
+/* I/O callbacks reading the input and writing the output of a worker's run */
+static int batch_get(void* ctx) {
+  BatchWorker* worker = (BatchWorker*) ctx;
+  if (worker->in.pos == worker->in.length) { return EOF; }
+  return worker->in.bytes[worker->in.pos++];
+}
+
+static void batch_put(void* ctx, uint8_t c) {
+  BatchWorker* worker = (BatchWorker*) ctx;
+  if (worker->out.length == worker->out.capacity && !buffer_reserve(&worker->out, worker->out.length + 1)) {
+    throw_fault("not enough memory for output");
+  }
+  worker->out.bytes[worker->out.length++] = c;
+}
+
+/* Reads a whole file into a buffer, returning 0 if it cannot be read */
+static int read_file(const char* fpath, BatchBuffer* buf) {
+  FILE* f = fopen(fpath, "rb");
+  if (f == NULL) { return 0; }
+
+  buf->length = 0;
+  buf->pos = 0;
+  size_t n;
+  do {
+    if (!buffer_reserve(buf, buf->length + 1)) {
+      fclose(f);
+      return 0;
+    }
+    n = fread(buf->bytes + buf->length, 1, buf->capacity - buf->length, f);
+    buf->length += n;
+  } while (n > 0);
+
+  fclose(f);
+  return 1;
+}
+
+/*
+ * Path of the output file of an input: the input's name with .out appended,
+ * in the output directory if there is one, otherwise beside the input
+ */
+static char* output_path(const char* input, const char* out_dir) {
+  const char* name = input;
+  if (out_dir != NULL) {
+    for (const char* c = input; *c != '\0'; c++) {
+      if (*c == '/' || *c == '\\') { name = c + 1; }
+    }
+  }
+
+  size_t dir_length = (out_dir != NULL) ? strlen(out_dir) + 1 : 0;
+  char* out = (char*) malloc(dir_length + strlen(name) + 5);
+  if (out == NULL) { return NULL; }
+
+  if (out_dir != NULL) {
+    sprintf(out, "%s/%s.out", out_dir, name);
+  }
+  else {
+    sprintf(out, "%s.out", name);
+  }
+  return out;
+}
+
+/* An input's output path, for finding those that clash */
+typedef struct {
+  char* path;
+  size_t input;
+} BatchOutput;
+
+static int output_compare(const void* a, const void* b) {
+  const BatchOutput* x = (const BatchOutput*) a;
+  const BatchOutput* y = (const BatchOutput*) b;
+  int order = strcmp(x->path, y->path);
+  if (order != 0) { return order; }
+  return (x->input < y->input) ? -1 : (x->input > y->input);
+}
+
+/*
+ * Finds the inputs whose output path is the same as that of an earlier input,
+ * e.g. a/x and b/x with an output directory, which keeps only their names:
+ * each is flagged in the array returned, to fail rather than overwrite the
+ * output of the first. Returns NULL without memory.
+ */
+static uint8_t* output_clashes(char** inputs, size_t count, const char* out_dir) {
+  uint8_t* clashes = (uint8_t*) calloc(count + 1, 1);
+  BatchOutput* outputs = (BatchOutput*) malloc(sizeof(BatchOutput) * (count + 1));
+  if (clashes == NULL || outputs == NULL) {
+    free(clashes);
+    free(outputs);
+    return NULL;
+  }
+
+  size_t length = 0;
+  for (size_t i=0; i<count; i++) {
+    outputs[length].path = output_path(inputs[i], out_dir);
+    outputs[length].input = i;
+    if (outputs[length].path != NULL) { length++; }
+  }
+
+  /* Sorted by path then input, so that each input clashes with the one before */
+  qsort(outputs, length, sizeof(BatchOutput), output_compare);
+  for (size_t i=0; i<length; i++) {
+    if (i > 0 && strcmp(outputs[i].path, outputs[i-1].path) == 0) {
+      clashes[outputs[i].input] = 1;
+    }
+  }
+
+  for (size_t i=0; i<length; i++) {
+    free(outputs[i].path);
+  }
+  free(outputs);
+  return clashes;
+}
+
+/*
+ * Takes the next input for a worker from its own range, or failing that steals
+ * half the range of the first other worker with any left. Returns 0 once
+ * every range is empty.
+ */
+static int batch_take(BatchWorker* worker, size_t* input) {
+  Batch* batch = worker->batch;
+  BatchQueue* own = &batch->queues[worker->id];
+
+  pthread_mutex_lock(&own->lock);
+  if (own->head < own->tail) {
+    *input = --own->tail;
+    pthread_mutex_unlock(&own->lock);
+    return 1;
+  }
+  pthread_mutex_unlock(&own->lock);
+
+  for (size_t i=1; i<batch->workers; i++) {
+    BatchQueue* victim = &batch->queues[(worker->id + i) % batch->workers];
+
+    pthread_mutex_lock(&victim->lock);
+    size_t left = victim->tail - victim->head;
+    if (left == 0) {
+      pthread_mutex_unlock(&victim->lock);
+      continue;
+    }
+    size_t head = victim->head;
+    size_t stolen = (left + 1) / 2;
+    victim->head += stolen;
+    pthread_mutex_unlock(&victim->lock);
+
+    /* Run the first input stolen now, and keep the rest to be taken or stolen */
+    *input = head;
+    pthread_mutex_lock(&own->lock);
+    own->head = head + 1;
+    own->tail = head + stolen;
+    pthread_mutex_unlock(&own->lock);
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Runs the program over the input at an index, writing its output file. Faults
+ * are reported along with the input, the output so far still being written.
+ * An input whose output would overwrite that of an earlier input is not run.
+ * Returns 0 if the input failed.
+ */
+static int batch_run_input(BatchWorker* worker, BFVM* vm, size_t index) {
+  Batch* batch = worker->batch;
+  const char* input = batch->inputs[index];
+  BFIO io = { batch_get, batch_put, worker };
+  const char* error = NULL;
+
+  if (batch->clashes[index]) {
+    char* path = output_path(input, batch->out_dir);
+    fprintf(stderr, "%s: output %s is also that of an earlier input\n", input, (path != NULL) ? path : "");
+    free(path);
+    return 0;
+  }
+  if (!read_file(input, &worker->in)) {
+    fprintf(stderr, "%s: input not found\n", input);
+    return 0;
+  }
+  worker->out.length = 0;
+
+  BFStatus status = program_run(batch->program, vm, &io, &error);
+
+  char* path = output_path(input, batch->out_dir);
+  FILE* f = (path != NULL) ? fopen(path, "wb") : NULL;
+  if (f == NULL) {
+    fprintf(stderr, "%s: could not write output %s\n", input, (path != NULL) ? path : "");
+    free(path);
+    return 0;
+  }
+  fwrite(worker->out.bytes, 1, worker->out.length, f);
+  fclose(f);
+  free(path);
+
+  if (status != BF_OK) {
+    fprintf(stderr, "%s: %s\n", input, error);
+    return 0;
+  }
+  return 1;
+}
+
+static void* batch_worker(void* arg) {
+  BatchWorker* worker = (BatchWorker*) arg;
+  Batch* batch = worker->batch;
+  size_t input;
+
+  BFVM* vm = program_create_vm(batch->program);
+  if (vm == NULL) {
+    fprintf(stderr, "not enough memory for VM\n");
+    return NULL;
+  }
+
+  while (batch_take(worker, &input)) {
+    if (!batch_run_input(worker, vm, input)) {
+      worker->failed++;
+    }
+  }
+
+  vm_destroy(vm);
+  return NULL;
+}
+
+/* Number of cores to run on */
+static size_t core_count() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  long cores = (long) info.dwNumberOfProcessors;
+#else
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  return (cores > 0) ? (size_t) cores : 1;
+}
+
+/*
+ * Runs a program over each of 'count' input files, with 'jobs' worker threads
+ * (or one per core if 0), writing the output of each to a file named after it
+ * (see output_path()).
+ *
+ * Returns the number of inputs that failed: that could not be read or written,
+ * whose output path clashed with an earlier input's, or whose run faulted.
+ */
+int batch_run(const BFProgram* program, char** inputs, size_t count, const char* out_dir, size_t jobs) {
+  Batch batch;
+  batch.program = program;
+  batch.inputs = inputs;
+  batch.out_dir = out_dir;
+  batch.clashes = output_clashes(inputs, count, out_dir);
+  batch.workers = (jobs > 0) ? jobs : core_count();
+  if (batch.workers > count) {
+    batch.workers = (count > 0) ? count : 1;
+  }
+
+  batch.queues = (BatchQueue*) malloc(sizeof(BatchQueue) * batch.workers);
+  BatchWorker* workers = (BatchWorker*) calloc(batch.workers, sizeof(BatchWorker));
+  if (batch.queues == NULL || workers == NULL || batch.clashes == NULL) { throw_fault("not enough memory for batch"); }
+
+  for (size_t w=0; w<batch.workers; w++) {
+    pthread_mutex_init(&batch.queues[w].lock, NULL);
+    batch.queues[w].head = count * w / batch.workers;
+    batch.queues[w].tail = count * (w + 1) / batch.workers;
+
+    workers[w].batch = &batch;
+    workers[w].id = w;
+  }
+
+  for (size_t w=0; w<batch.workers; w++) {
+    if (pthread_create(&workers[w].thread, NULL, batch_worker, &workers[w]) != 0) {
+      throw_fault("could not start batch worker");
+    }
+  }
+
+  for (size_t w=0; w<batch.workers; w++) {
+    pthread_join(workers[w].thread, NULL);
+  }
+
+  /* Only once all have finished, as any may still steal from the others */
+  size_t failed = 0;
+  for (size_t w=0; w<batch.workers; w++) {
+    failed += workers[w].failed;
+    free(workers[w].in.bytes);
+    free(workers[w].out.bytes);
+    pthread_mutex_destroy(&batch.queues[w].lock);
+  }
+
+  free(workers);
+  free(batch.queues);
+  free(batch.clashes);
+  return (int) failed;
+}
@@ -0,0 +1,22 @@
+/*
+ * Counting of the allocations made by the interpreter, for the benchmarks
+ * (bench.c). With BF_BENCH_ALLOCS defined, bfplusplus.h includes this file, so
+ * that every malloc(), calloc() and realloc() in the interpreter's source goes
+ * through the counter in bench.c instead.
+ */
+#ifndef BF_BENCH_ALLOCS_H
+#define BF_BENCH_ALLOCS_H
+
+#include <stdlib.h>
+
+extern size_t bench_allocs;
+
+void* bench_malloc(size_t size);
+void* bench_calloc(size_t count, size_t size);
+void* bench_realloc(void* ptr, size_t size);
+
+#define malloc(size) bench_malloc(size)
+#define calloc(count, size) bench_calloc(count, size)
+#define realloc(ptr, size) bench_realloc(ptr, size)
+
+#endif /* BF_BENCH_ALLOCS_H */
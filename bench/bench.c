@@ -0,0 +1,442 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "../bfplusplus.h"
+
+/*
+ * Benchmarks of the interpreter over the workloads in this directory, each
+ * run with its recorded input and checked against its recorded output.
+ *
+ * Built from the repository root along with the library sources (see the
+ * README), with BF_BENCH_ALLOCS defined so that allocations are counted:
+ *   cc -O2 -DBF_BENCH_ALLOCS -o bfbench bench/bench.c bfplusplus.c bfruntime.c bfvm.c utils.c lexer.c lower.c bfjit.c emitc.c cache.c batch.c profile.c memo.c checkpoint.c stats.c libbfpp.c -pthread
+ *
+ * Each workload is measured in child processes of its own, so that their
+ * peak RSS is theirs alone: one counts the instructions and calls run, with
+ * the profiling core, and another loads the program through libbfpp and runs
+ * it several times with the chosen engine, keeping the best wall time. The
+ * allocations are those of loading the program and its first run.
+ *
+ * Results can be saved as a baseline, and compared against one by later runs.
+ * POSIX only, for fork() and getrusage().
+ */
+
+/* The counter of allocations (allocs.h), and the real allocation functions */
+#undef malloc
+#undef calloc
+#undef realloc
+
+size_t bench_allocs = 0;
+
+void* bench_malloc(size_t size) {
+  bench_allocs++;
+  return malloc(size);
+}
+
+void* bench_calloc(size_t count, size_t size) {
+  bench_allocs++;
+  return calloc(count, size);
+}
+
+void* bench_realloc(void* ptr, size_t size) {
+  bench_allocs++;
+  return realloc(ptr, size);
+}
+
+/*
+ * A workload: its source and recorded input (or NULL) and output, which are
+ * named after it, and the cell width it is run with
+ */
+typedef struct {
+  const char* name;
+  int has_input;
+  size_t cell_size;
+} BenchWorkload;
+
+static const BenchWorkload workloads[] = {
+  /* Classic Brainfuck */
+  { "loops", 0, 2 },
+  { "sort", 1, 1 },
+  { "squares", 0, 1 },
+
+  /* BF++ functions and recursion */
+  { "fib", 1, 4 },
+  { "selfpass", 1, 2 },
+  { "grow", 1, 2 },
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+/*
+ * The measurements of a workload, as written to and read from baselines
+ */
+typedef struct {
+  char name[32];
+  uint64_t wall_ns;
+  uint64_t instructions;
+  uint64_t calls;
+  uint64_t rss_kib;
+  uint64_t allocs;
+} BenchResult;
+
+/*
+ * A file read into memory, and the output of a run
+ */
+typedef struct {
+  char* data;
+  size_t length;
+  size_t pos;
+  size_t capacity;
+} BenchBuffer;
+
+static int bench_read_file(const char* path, BenchBuffer* buffer) {
+  FILE* f = fopen(path, "rb");
+  memset(buffer, 0, sizeof(BenchBuffer));
+  if (f == NULL) { return -1; }
+
+  size_t n;
+  do {
+    if (buffer->length == buffer->capacity) {
+      buffer->capacity = (buffer->capacity == 0) ? 4096 : buffer->capacity * 2;
+      buffer->data = (char*) realloc(buffer->data, buffer->capacity);
+      if (buffer->data == NULL) { fclose(f); return -1; }
+    }
+    n = fread(buffer->data + buffer->length, 1, buffer->capacity - buffer->length, f);
+    buffer->length += n;
+  } while (n > 0);
+
+  fclose(f);
+  return 0;
+}
+
+/* BFIO callbacks: input from the recorded input, output into a buffer */
+static int bench_get(void* ctx) {
+  BenchBuffer* in = ((BenchBuffer**) ctx)[0];
+  return (in->pos < in->length) ? (uint8_t) in->data[in->pos++] : EOF;
+}
+
+static void bench_put(void* ctx, uint8_t c) {
+  BenchBuffer* out = ((BenchBuffer**) ctx)[1];
+  if (out->length == out->capacity) {
+    out->capacity = (out->capacity == 0) ? 4096 : out->capacity * 2;
+    out->data = (char*) realloc(out->data, out->capacity);
+    if (out->data == NULL) { exit(1); }
+  }
+  out->data[out->length++] = (char) c;
+}
+
+static uint64_t bench_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/* Calls made along a call path of a profile and all those below it */
+static uint64_t bench_calls(const BFProfileNode* node) {
+  uint64_t calls = 0;
+  for (const BFProfileNode* child = node->children; child != NULL; child = child->sibling) {
+    calls += child->calls + bench_calls(child);
+  }
+  return calls;
+}
+
+/*
+ * Counts the instructions and calls of a run of a workload, into 'result'
+ */
+static int bench_count(const char* path, const BFTapeConfig* config, BenchBuffer* input, BenchResult* result) {
+  BenchBuffer output;
+  memset(&output, 0, sizeof(BenchBuffer));
+  BenchBuffer* buffers[2] = { input, &output };
+  BFIO io = { bench_get, bench_put, buffers };
+
+  BFVM* vm = vm_create(config);
+  if (profile_load(path, &vm->code) == -1) { return -1; }
+  vm->ip = vm->code.ops;
+  vm->io = &io;
+
+  BFProfile* profile = profile_create(&vm->code);
+  vm->profile = profile;
+  vm_run(vm);
+
+  for (size_t i=0; i<profile->length; i++) {
+    result->instructions += profile->counts[i] * profile->weights[i];
+  }
+  result->calls = bench_calls(&profile->root);
+
+  profile_free(profile);
+  vm_destroy(vm);
+  free(output.data);
+  return 0;
+}
+
+/*
+ * Times the best of 'runs' runs of a workload, checking the output of each
+ * against 'expected', into 'result'
+ */
+static int bench_time(const char* path, const BFTapeConfig* config, BFEngine engine, size_t runs,
+  BenchBuffer* input, const BenchBuffer* expected, BenchResult* result) {
+  BenchBuffer output;
+  memset(&output, 0, sizeof(BenchBuffer));
+  BenchBuffer* buffers[2] = { input, &output };
+  BFIO io = { bench_get, bench_put, buffers };
+
+  BFProgram* program;
+  const char* error;
+  bench_allocs = 0;
+  if (program_load_file(path, config, engine, &program, &error) != BF_OK) {
+    fprintf(stderr, "%s: %s\n", path, error);
+    return -1;
+  }
+  BFVM* vm = program_create_vm(program);
+
+  for (size_t r=0; r<runs; r++) {
+    input->pos = 0;
+    output.length = 0;
+
+    uint64_t start = bench_now_ns();
+    if (program_run(program, vm, &io, &error) != BF_OK) {
+      fprintf(stderr, "%s: %s\n", path, error);
+      return -1;
+    }
+    uint64_t wall = bench_now_ns() - start;
+
+    if (r == 0) {
+      result->allocs = bench_allocs;
+      result->wall_ns = wall;
+    }
+    else if (wall < result->wall_ns) {
+      result->wall_ns = wall;
+    }
+
+    if (output.length != expected->length || memcmp(output.data, expected->data, output.length) != 0) {
+      fprintf(stderr, "%s: output differs from the recorded output\n", path);
+      return -1;
+    }
+  }
+
+  vm_destroy(vm);
+  program_free(program);
+  jit_free();
+  free(output.data);
+  return 0;
+}
+
+/*
+ * Measures a workload, each pass in a child process writing its results back
+ * through a pipe. Returns -1 if either pass fails.
+ */
+static int bench_workload(const char* dir, const BenchWorkload* workload, BFEngine engine, size_t runs, BenchResult* result) {
+  char path[1024];
+  BenchBuffer input;
+  BenchBuffer expected;
+
+  memset(result, 0, sizeof(BenchResult));
+  snprintf(result->name, sizeof(result->name), "%s", workload->name);
+
+  memset(&input, 0, sizeof(BenchBuffer));
+  if (workload->has_input) {
+    snprintf(path, sizeof(path), "%s/%s.in", dir, workload->name);
+    if (bench_read_file(path, &input) == -1) {
+      fprintf(stderr, "%s: recorded input not found\n", path);
+      return -1;
+    }
+  }
+  snprintf(path, sizeof(path), "%s/%s.out", dir, workload->name);
+  if (bench_read_file(path, &expected) == -1) {
+    fprintf(stderr, "%s: recorded output not found\n", path);
+    free(input.data);
+    return -1;
+  }
+  snprintf(path, sizeof(path), "%s/%s.bpp", dir, workload->name);
+
+  BFTapeConfig config = { workload->cell_size, TAPE_MAX_LENGTH, TAPE_INITIAL_LENGTH, TAPE_GROW_RATE, FRAME_MAX_DEPTH };
+  int failed = 0;
+
+  for (int pass=0; pass<2 && !failed; pass++) {
+    int fds[2];
+    if (pipe(fds) != 0) { failed = 1; break; }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      BenchResult out = *result;
+      close(fds[0]);
+      int res = (pass == 0)
+        ? bench_count(path, &config, &input, &out)
+        : bench_time(path, &config, engine, runs, &input, &expected, &out);
+      if (res == 0 && write(fds[1], &out, sizeof(BenchResult)) != (ssize_t) sizeof(BenchResult)) { res = -1; }
+      _exit(res == 0 ? 0 : 1);
+    }
+    close(fds[1]);
+
+    BenchResult out;
+    ssize_t n = (pid > 0) ? read(fds[0], &out, sizeof(BenchResult)) : -1;
+    close(fds[0]);
+
+    int status = 1;
+    struct rusage usage;
+    if (pid > 0 && wait4(pid, &status, 0, &usage) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0
+      && n == (ssize_t) sizeof(BenchResult)) {
+      if (pass == 0) {
+        result->instructions = out.instructions;
+        result->calls = out.calls;
+      }
+      else {
+        result->wall_ns = out.wall_ns;
+        result->allocs = out.allocs;
+        result->rss_kib = (uint64_t) usage.ru_maxrss;
+      }
+    }
+    else {
+      failed = 1;
+    }
+  }
+
+  free(input.data);
+  free(expected.data);
+  return failed ? -1 : 0;
+}
+
+/*
+ * Baselines are text, a line of the measurements of each workload
+ */
+static int bench_save(const char* path, const BenchResult* results, size_t count) {
+  FILE* f = fopen(path, "w");
+  if (f == NULL) { return -1; }
+
+  fprintf(f, "# workload wall_ns instructions calls rss_kib allocs\n");
+  for (size_t i=0; i<count; i++) {
+    fprintf(f, "%s %llu %llu %llu %llu %llu\n", results[i].name,
+      (unsigned long long) results[i].wall_ns, (unsigned long long) results[i].instructions,
+      (unsigned long long) results[i].calls, (unsigned long long) results[i].rss_kib,
+      (unsigned long long) results[i].allocs);
+  }
+  return (fclose(f) == 0) ? 0 : -1;
+}
+
+static size_t bench_load(const char* path, BenchResult* results, size_t capacity) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) { return 0; }
+
+  char line[256];
+  size_t count = 0;
+  while (count < capacity && fgets(line, sizeof(line), f) != NULL) {
+    unsigned long long wall, instructions, calls, rss, allocs;
+    BenchResult* r = &results[count];
+    if (line[0] == '#') { continue; }
+    if (sscanf(line, "%31s %llu %llu %llu %llu %llu", r->name, &wall, &instructions, &calls, &rss, &allocs) == 6) {
+      r->wall_ns = wall;
+      r->instructions = instructions;
+      r->calls = calls;
+      r->rss_kib = rss;
+      r->allocs = allocs;
+      count++;
+    }
+  }
+  fclose(f);
+  return count;
+}
+
+/* Change from a baseline value, as a percentage */
+static double bench_change(uint64_t now, uint64_t then) {
+  return (then == 0) ? 0.0 : 100.0 * ((double) now - (double) then) / (double) then;
+}
+
+static void print_usage(const char* prog) {
+  printf("Usage: %s [options] [workload]...\n", prog);
+  printf("Options:\n");
+  printf("  --engine=E       threaded (default), switch or jit\n");
+  printf("  --runs=N         timed runs of each workload, keeping the best (default 5)\n");
+  printf("  --dir=DIR        directory of the workloads (default bench)\n");
+  printf("  --baseline=FILE  compare against a baseline saved by --save\n");
+  printf("  --save=FILE      save the results as a baseline\n");
+}
+
+int main(int argc, char** argv) {
+  BFEngine engine = ENGINE_THREADED;
+  size_t runs = 5;
+  const char* dir = "bench";
+  const char* baseline_path = NULL;
+  const char* save_path = NULL;
+  const char* only[WORKLOAD_COUNT];
+  size_t only_count = 0;
+
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "--engine=threaded") == 0) { engine = ENGINE_THREADED; }
+    else if (strcmp(argv[i], "--engine=switch") == 0) { engine = ENGINE_SWITCH; }
+    else if (strcmp(argv[i], "--engine=jit") == 0) { engine = ENGINE_JIT; }
+    else if (strncmp(argv[i], "--runs=", 7) == 0 && atoi(argv[i] + 7) > 0) { runs = (size_t) atoi(argv[i] + 7); }
+    else if (strncmp(argv[i], "--dir=", 6) == 0) { dir = argv[i] + 6; }
+    else if (strncmp(argv[i], "--baseline=", 11) == 0) { baseline_path = argv[i] + 11; }
+    else if (strncmp(argv[i], "--save=", 7) == 0) { save_path = argv[i] + 7; }
+    else if (strncmp(argv[i], "--", 2) != 0 && only_count < WORKLOAD_COUNT) { only[only_count++] = argv[i]; }
+    else {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  BenchResult baseline[WORKLOAD_COUNT * 2];
+  size_t baseline_count = 0;
+  if (baseline_path != NULL) {
+    baseline_count = bench_load(baseline_path, baseline, WORKLOAD_COUNT * 2);
+    if (baseline_count == 0) {
+      fprintf(stderr, "No baseline found in %s\n", baseline_path);
+      return 1;
+    }
+  }
+
+  BenchResult results[WORKLOAD_COUNT];
+  size_t count = 0;
+  int failed = 0;
+
+  printf("%-10s %10s %12s %12s %10s %10s", "workload", "wall ms", "Minstr/s", "Mcalls/s", "RSS KiB", "allocs");
+  if (baseline_count > 0) { printf(" %9s %9s %9s", "wall", "RSS", "allocs"); }
+  printf("\n");
+  fflush(stdout);
+
+  for (size_t w=0; w<WORKLOAD_COUNT; w++) {
+    int selected = (only_count == 0);
+    for (size_t o=0; o<only_count; o++) {
+      if (strcmp(only[o], workloads[w].name) == 0) { selected = 1; }
+    }
+    if (!selected) { continue; }
+
+    BenchResult* r = &results[count];
+    if (bench_workload(dir, &workloads[w], engine, runs, r) != 0) {
+      printf("%-10s FAILED\n", workloads[w].name);
+      failed = 1;
+      continue;
+    }
+    count++;
+
+    double seconds = (double) r->wall_ns / 1e9;
+    printf("%-10s %10.2f %12.2f %12.3f %10llu %10llu", r->name, seconds * 1e3,
+      (double) r->instructions / seconds / 1e6, (double) r->calls / seconds / 1e6,
+      (unsigned long long) r->rss_kib, (unsigned long long) r->allocs);
+
+    for (size_t b=0; b<baseline_count; b++) {
+      if (strcmp(baseline[b].name, r->name) != 0) { continue; }
+      printf(" %+8.1f%% %+8.1f%% %+8.1f%%", bench_change(r->wall_ns, baseline[b].wall_ns),
+        bench_change(r->rss_kib, baseline[b].rss_kib), bench_change(r->allocs, baseline[b].allocs));
+      if (baseline[b].instructions != r->instructions || baseline[b].calls != r->calls) {
+        printf("  (runs different instructions or calls)");
+      }
+    }
+    printf("\n");
+  }
+
+  if (save_path != NULL && bench_save(save_path, results, count) != 0) {
+    fprintf(stderr, "Could not save baseline to %s\n", save_path);
+    failed = 1;
+  }
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,432 @@
+/*
+ * The core of the VM, from which each dispatch engine's run function is
+ * generated. There is no include guard, as bfplusplus.c includes this file
+ * once per engine and cell width, having defined:
+ *
+ *   VM_ENGINE    name of the run function to define, e.g. vm_run_switch_16
+ *   VM_CELL      type of the cells of the tape: uint8_t, uint16_t or uint32_t,
+ *                so that each width has its own core with no width checks
+ *   VM_THREADED  0 for a portable loop with a switch over the opcodes and a
+ *                bounds check of the instruction pointer before every op;
+ *                1 for direct-threaded dispatch using GCC/Clang labels as
+ *                values, jumping straight from the end of each handler to the
+ *                next through a table of pre-resolved handler addresses
+ *   VM_PROFILE   1 (with VM_THREADED 0) to count each op run and each call
+ *                into the VM's profile for --profile (profile.c); 0 for the
+ *                usual cores, which then have no trace of it
+ *   VM_CHECKPOINT 1 to count each ] and call towards the VM's next checkpoint
+ *                for --checkpoint, taking it at that op (checkpoint.c), and to
+ *                carry on a run resumed from one; 0 for the usual cores
+ *   VM_STATS     1 to count the ops run by opcode, loops, calls and call depth
+ *                into the VM's stats for --stats (stats.c), reporting them
+ *                when SIGUSR1 asks; 0 for the usual cores, which then have no
+ *                trace of it
+ *
+ * Each handler ends with NEXT, which moves on to the following op; handlers
+ * that jump first adjust IP to the op before their target.
+ *
+ * Calls are run in the same loop rather than recursively: a call carries on
+ * in the VM of its new frame (vm_call_enter()), or of the frame it reuses for
+ * a tail call (vm_call_tail()), and the end of the code of a call returns to
+ * its parent (vm_call_return()), carrying on after the call. Only the end of
+ * the code of the VM the run started in ends the run, so however deep the
+ * calls, they use no more of the C stack.
+ */
+
+void VM_ENGINE(BFVM* vm) {
+
+  /* The VM the run started in, 'vm' being that of the call running */
+  BFVM* const entry = vm;
+
+#if VM_CHECKPOINT
+  /*
+   * A run resumed from a checkpoint carries on in the call that was running,
+   * from the op the checkpoint was taken at
+   */
+  BFCheckpoint* const checkpoint = vm->checkpoint;
+  if (checkpoint->resume != NULL) {
+    vm = checkpoint->resume;
+    checkpoint->resume = NULL;
+  }
+
+/* Count a step towards the next checkpoint, taking it before the op if due */
+#define CHECKPOINT_POLL \
+  if (--checkpoint->countdown == 0 || checkpoint->requested) { checkpoint_take(vm); }
+#else
+#define CHECKPOINT_POLL
+#endif
+
+#if VM_STATS
+  BFStats* const stats = vm->stats;
+
+/* Count an op run, at the start of its handler */
+#define STATS_OP(opcode) stats->ops[opcode]++;
+
+/* Report the counts so far if SIGUSR1 asked for them, before the op */
+#define STATS_POLL \
+  if (stats->requested) { stats->requested = 0; io_flush(); stats_report(stats, stderr); }
+#else
+#define STATS_OP(opcode)
+#define STATS_POLL
+#endif
+
+/* Instruction pointer */
+#define IP (vm->ip)
+
+/* Is the instruction pointer within bounds? */
+#define VALIDIP \
+  (IP < vm->code.ops + vm->code.length \
+    && IP >= vm->code.ops)
+
+/* Current opcode */
+#define INST (IP->code)
+
+/* Argument of the current op */
+#define ARG (IP->as.arg)
+
+/* Tape pointer */
+#define TP ((VM_CELL*) vm->ptr)
+
+/* Move the tape pointer by a number of cells */
+#define MOVE_TP(n) (vm->ptr += (ptrdiff_t) (n) * (ptrdiff_t) sizeof(VM_CELL))
+
+/* Index of the tape pointer */
+#define TP_INDEX ((size_t) (TP - (VM_CELL*) vm->tape))
+
+/* Does vm_grow_tape need to be called? */
+#define NEED_GROWTH \
+  (TP_INDEX >= vm->tape_length)
+
+/* Value of the current cell */
+#define CELL (*TP)
+
+/* Is the current cell a value? */
+#define ISVALUE (!VM_IS_FN(vm, TP_INDEX))
+
+/* Is the current cell 0? */
+#define ISZERO (CELL == 0 && ISVALUE)
+
+#if VM_PROFILE
+  /* The call path being run, which every op run is counted under */
+  BFProfile* profile = vm->profile;
+  BFProfileNode* node = profile_enter(profile, vm->fn);
+#endif
+
+#if VM_THREADED
+
+  /*
+   * Handler for each opcode. The } of a function body is only ever reached as
+   * the op after the end of the body (see vm_define_fn()), so it ends the
+   * call, as does the entry after the end of the main program.
+   */
+  static const void* const handlers[] = {
+    [OP_ADD] = &&L_OP_ADD,
+    [OP_MOVE] = &&L_OP_MOVE,
+    [OP_OPEN_LOOP] = &&L_OP_OPEN_LOOP,
+    [OP_CLOSE_LOOP] = &&L_OP_CLOSE_LOOP,
+    [OP_OPEN_FN] = &&L_OP_OPEN_FN,
+    [OP_CLOSE_FN] = &&L_END,
+    [OP_CALL] = &&L_OP_CALL,
+    [OP_TAIL_CALL] = &&L_OP_TAIL_CALL,
+    [OP_GET_CHAR] = &&L_OP_GET_CHAR,
+    [OP_PUT_CHAR] = &&L_OP_PUT_CHAR,
+    [OP_CLEAR] = &&L_OP_CLEAR,
+    [OP_MUL_LOOP] = &&L_OP_MUL_LOOP,
+    [OP_MUL_TERM] = &&L_OP_MUL_TERM,
+    [OP_INLINE] = &&L_OP_INLINE,
+    [OP_INLINE_END] = &&L_OP_INLINE_END,
+    [OP_RANGE] = &&L_OP_RANGE,
+    [OP_MOVE_UNCHECKED] = &&L_OP_MOVE_UNCHECKED,
+  };
+
+  /*
+   * Resolve the handler of every op once, with one more entry after the last
+   * op to end the run, so that no bounds check is needed between ops
+   */
+  if (vm->code.threads == NULL) {
+    vm->code.threads = (const void**) malloc(sizeof(void*) * (vm->code.length + 1));
+    if (vm->code.threads == NULL) { throw_fault("not enough memory to resolve handlers"); }
+#if VM_STATS
+    stats->allocs++;
+#endif
+    for (size_t i=0; i<vm->code.length; i++) {
+      vm->code.threads[i] = handlers[vm->code.ops[i].code];
+    }
+    vm->code.threads[vm->code.length] = &&L_END;
+  }
+  const void** threads = vm->code.threads;
+
+#define OP(opcode) L_##opcode: STATS_OP(opcode)
+#define DISPATCH goto *threads[IP - vm->code.ops]
+#define NEXT IP++; DISPATCH
+
+/* Carry on in the VM of another call, from its instruction pointer */
+#define SWITCH_VM(to) vm = (to); threads = vm->code.threads; DISPATCH
+
+  DISPATCH;
+
+#else
+
+#define OP(opcode) case opcode: STATS_OP(opcode)
+#define NEXT IP++; continue
+#define SWITCH_VM(to) vm = (to); continue
+
+  for (;;) {
+
+  while (VALIDIP) {
+
+#if VM_PROFILE
+    profile->counts[IP - profile->ops]++;
+    node->self += profile->weights[IP - profile->ops];
+#endif
+
+    switch (INST) {
+
+#endif
+
+      OP(OP_ADD)
+        if (!ISVALUE) {
+          throw_fault(ARG > 0 ? "+ operation not valid on function" : "- operation not valid on function");
+        }
+        CELL += (VM_CELL) ARG;
+        NEXT;
+
+      OP(OP_MOVE)
+        if (ARG < 0) {
+          if (TP_INDEX < (size_t) -(int64_t) ARG) { throw_fault("< operator took pointer beyond valid region"); }
+          MOVE_TP(ARG);
+        }
+        else if ((size_t) ARG < vm->tape_length - TP_INDEX) {
+          /* Within the tape's current length, and so its maximum: one check for the common case */
+          MOVE_TP(ARG);
+        }
+        else {
+          if (vm->config.max_length - TP_INDEX <= (size_t) ARG) { throw_fault("> operator took pointer beyond valid region"); }
+          MOVE_TP(ARG);
+          while (NEED_GROWTH) {
+            vm_grow_tape(vm);
+          }
+        }
+        NEXT;
+
+      OP(OP_OPEN_LOOP)
+        if (ISZERO) {
+          /* If zero, skip over loop body to the matching ] */
+          IP += ARG;
+        }
+#if VM_STATS
+        else {
+          stats->loops++;
+          stats->iterations++;
+        }
+#endif
+        NEXT;
+
+      OP(OP_CLOSE_LOOP)
+        CHECKPOINT_POLL;
+        STATS_POLL;
+        if (!ISZERO) {
+          /* If not zero, go back to loop start; the [ itself is skipped */
+          IP += ARG;
+#if VM_STATS
+          stats->iterations++;
+#endif
+        }
+        NEXT;
+
+      OP(OP_CLEAR)
+        if (ISVALUE) {
+          CELL = 0;
+          IP += IP->as.loop.skip;
+        }
+        /* Otherwise fall into the original loop, which faults as before */
+        NEXT;
+
+      OP(OP_MUL_LOOP)
+        if (vm_mul_loop(vm, IP)) {
+          IP += IP->as.loop.skip;
+        }
+        /* Otherwise fall into the original loop, which faults as before */
+        NEXT;
+
+      OP(OP_MUL_TERM)
+        /* Only read by OP_MUL_LOOP; nothing to do when falling back */
+        NEXT;
+
+      OP(OP_INLINE)
+#if VM_PROFILE
+        /* Always make the call, for the profile to count it and its ops */
+        IP += IP->as.inlined.skip;
+#else
+        if (!vm_inline_enter(vm, IP)) {
+          /* Skip the copy of the function body to make the call as usual */
+          IP += IP->as.inlined.skip;
+        }
+#if VM_STATS
+        else {
+          stats->inlined++;
+        }
+#endif
+#endif
+        NEXT;
+
+      OP(OP_INLINE_END)
+        /* The copy has run in place of the call after this op, so skip it */
+        vm_inline_leave(vm, IP);
+        IP++;
+        NEXT;
+
+      OP(OP_RANGE)
+#if VM_PROFILE
+        /* Always run the original loop, for the profile to count its ops */
+        IP += IP->as.loop.skip;
+#else
+        if (TP_INDEX < (size_t) -(int64_t) IP->as.loop.min || vm->tape_length - TP_INDEX <= (size_t) IP->as.loop.max) {
+          /* Some move may leave the tape, so run the original loop, which checks each */
+          IP += IP->as.loop.skip;
+        }
+#endif
+        NEXT;
+
+      OP(OP_MOVE_UNCHECKED)
+        /* Checked for the whole loop by the OP_RANGE before it */
+        MOVE_TP(ARG);
+        NEXT;
+
+      OP(OP_OPEN_FN) {
+        /*
+         * Define the function at the current position, its code being the
+         * slice of body ops here, along with their handlers if resolved
+         */
+        BFCode body = { IP + 1, (size_t) ARG - 1, NULL, NULL, NULL, IP->as.def.flags };
+        if (vm->code.threads != NULL) {
+          body.threads = vm->code.threads + (body.ops - vm->code.ops);
+        }
+        vm_define_fn(vm, &body);
+
+        IP += ARG;
+        NEXT;
+      }
+
+      OP(OP_CALL) {
+        /* Carry on in the new frame of the call, from the start of its code */
+        CHECKPOINT_POLL;
+        STATS_POLL;
+        BFFn* fn = vm_call_target(vm, &IP->as.call);
+        BFVM* callvm = VM_MEMOISES(vm, fn) ? memo_call(vm, fn, &IP->as.call) : vm_call_enter(vm, fn, &IP->as.call);
+        if (callvm == NULL) {
+          /* Answered from the memo table, with the results already in place */
+          NEXT;
+        }
+#if VM_STATS
+        stats->calls++;
+        if (callvm->depth > stats->max_depth) { stats->max_depth = callvm->depth; }
+#endif
+#if VM_PROFILE
+        node = profile_enter(profile, callvm->fn);
+#endif
+        SWITCH_VM(callvm);
+      }
+
+      OP(OP_TAIL_CALL) {
+        /* As for OP_CALL, though the call may reuse this frame */
+        CHECKPOINT_POLL;
+        STATS_POLL;
+        BFFn* fn = vm_call_target(vm, &IP->as.call);
+        BFVM* callvm = VM_MEMOISES(vm, fn) ? memo_call(vm, fn, &IP->as.call) : vm_call_tail(vm, fn, &IP->as.call);
+        if (callvm == NULL) {
+          NEXT;
+        }
+#if VM_STATS
+        stats->calls++;
+        if (callvm == vm) { stats->frames_reused++; }
+        if (callvm->depth > stats->max_depth) { stats->max_depth = callvm->depth; }
+#endif
+#if VM_PROFILE
+        /* A reused frame is no longer on the call path of the call it ended */
+        if (callvm == vm) {
+          profile_leave(profile);
+        }
+        node = profile_enter(profile, callvm->fn);
+#endif
+        SWITCH_VM(callvm);
+      }
+
+      OP(OP_GET_CHAR)
+        if (!ISVALUE) { throw_fault(", operation not valid on function"); }
+        for (int32_t i=0; i<ARG; i++) {
+          CELL = b_getchar(vm);
+        }
+        NEXT;
+
+      OP(OP_PUT_CHAR)
+        if (!ISVALUE) { throw_fault(". operation not valid on function"); }
+        for (int32_t i=0; i<ARG; i++) {
+          b_putchar(vm, CELL);
+        }
+        NEXT;
+
+#if VM_THREADED
+
+  L_END:
+    /* The end of the code of a call returns to its parent, after the call */
+    if (vm == entry) {
+      return;
+    }
+    vm = VM_MEMO_PENDING(vm) ? memo_return(vm) : vm_call_return(vm);
+    threads = vm->code.threads;
+    NEXT;
+
+#else
+
+      OP(OP_CLOSE_FN)
+        /* Close ops are always jumped over by the matching open ops */
+        throw_fault("mismatched function/call end");
+        NEXT;
+
+    }
+
+  }
+
+  /* The end of the code of a call returns to its parent, after the call */
+  if (vm == entry) {
+    break;
+  }
+#if VM_PROFILE
+  node = profile_leave(profile);
+#endif
+  vm = VM_MEMO_PENDING(vm) ? memo_return(vm) : vm_call_return(vm);
+  IP++;
+
+  }
+
+#if VM_PROFILE
+  /* Back to the call path of the caller */
+  if (node->parent != NULL) {
+    profile->current = node->parent;
+  }
+#endif
+
+#endif
+
+#undef IP
+#undef VALIDIP
+#undef INST
+#undef ARG
+#undef TP
+#undef MOVE_TP
+#undef TP_INDEX
+#undef NEED_GROWTH
+#undef CELL
+#undef ISVALUE
+#undef ISZERO
+#undef OP
+#undef NEXT
+#undef SWITCH_VM
+#undef CHECKPOINT_POLL
+#undef STATS_OP
+#undef STATS_POLL
+#ifdef DISPATCH
+#undef DISPATCH
+#endif
+}
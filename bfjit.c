@@ -0,0 +1,873 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "bfplusplus.h"
+
+#ifdef BF_JIT
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+/*
+ * A small JIT compiling BF++ ops to x86-64 machine code, without any external
+ * library: the bytes of each instruction are emitted directly.
+ *
+ * Each piece of code compiles to a native function taking the BFVM, keeping
+ * the VM, tape pointer and tape bounds in callee-saved registers. Adding,
+ * moving and loops are compiled inline, along with the common cases of the
+ * idiom ops, while calls, definitions, I/O, tape growth and faults call back
+ * into the same C code used by the interpreter, so behaviour is identical.
+ *
+ * The main program is compiled the first time it runs, along with every
+ * function body nested within it; each { ... } definition passes its body's
+ * native entry point on to the BFFn it creates, so calls run natively too.
+ *
+ * Native calls recurse on the C stack, so calls nested deeper than
+ * JIT_NATIVE_DEPTH run with the switch interpreter instead, which runs any
+ * calls below them in a loop (bfcore.h) up to the maximum depth of the run.
+ * Tail calls that reuse their frame return from the native code of the call
+ * they end first, for vm_run_jit() to run the new code in the same frame.
+ */
+#define JIT_NATIVE_DEPTH 2048
+
+/* x86-64 register numbers */
+enum {
+  RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+/* Argument registers and stack shadow space of the platform calling convention */
+#ifdef _WIN32
+#define ARG0 RCX
+#define ARG1 RDX
+#define ARG2 R8
+#define SHADOW_SPACE 32
+#else
+#define ARG0 RDI
+#define ARG1 RSI
+#define ARG2 RDX
+#define SHADOW_SPACE 0
+#endif
+
+/*
+ * Registers kept by compiled code, all callee-saved in both conventions:
+ * the VM, the tape pointer, the start of the tape, the end of its current
+ * length and the tape's bitmap of function cells. The tape registers are
+ * reloaded after anything that may grow the tape or move the pointer.
+ */
+#define R_VM R12
+#define R_TP RBX
+#define R_TAPE R13
+#define R_TAPE_END R14
+#define R_FN_BITS R15
+
+/* Condition codes for jcc */
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+
+/* Offsets of the fields accessed by compiled code */
+#define VM_TAPE_OFF ((int32_t) offsetof(BFVM, tape))
+#define VM_FN_BITS_OFF ((int32_t) offsetof(BFVM, fn_bits))
+#define VM_LENGTH_OFF ((int32_t) offsetof(BFVM, tape_length))
+#define VM_PTR_OFF ((int32_t) offsetof(BFVM, ptr))
+
+typedef struct _JitBuf JitBuf;
+typedef struct _JitFixup JitFixup;
+typedef struct _JitRegion JitRegion;
+
+/*
+ * Growable buffer of machine code being emitted, for tapes of the given cell
+ * size and maximum length
+ */
+struct _JitBuf {
+  uint8_t* bytes;
+  size_t length;
+  size_t capacity;
+
+  size_t cell_size;
+  size_t max_length;
+};
+
+/*
+ * A rel32 jump at 'at' to be patched to the code of the op 'target' once all
+ * the ops of the function have been emitted
+ */
+struct _JitFixup {
+  size_t at;
+  size_t target;
+};
+
+/*
+ * Executable memory holding compiled code, kept in a list until jit_free() or
+ * jit_release()
+ */
+struct _JitRegion {
+  void* mem;
+  size_t size;
+  JitRegion* next;
+};
+
+static JitRegion* regions = NULL;
+
+/* ---- */
+
+/*
+ * Emitting bytes and instructions
+ */
+static void emit8(JitBuf* b, uint8_t byte) {
+  if (b->length == b->capacity) {
+    b->capacity = (b->capacity == 0) ? 4096 : b->capacity * 2;
+    b->bytes = (uint8_t*) realloc(b->bytes, b->capacity);
+    if (b->bytes == NULL) { throw_fault("not enough memory to compile program"); }
+  }
+  b->bytes[b->length++] = byte;
+}
+static void emit16(JitBuf* b, uint16_t v) {
+  emit8(b, v & 0xFF);
+  emit8(b, v >> 8);
+}
+static void emit32(JitBuf* b, uint32_t v) {
+  emit16(b, v & 0xFFFF);
+  emit16(b, v >> 16);
+}
+static void emit64(JitBuf* b, uint64_t v) {
+  emit32(b, v & 0xFFFFFFFF);
+  emit32(b, v >> 32);
+}
+static void patch32(JitBuf* b, size_t at, uint32_t v) {
+  b->bytes[at] = v & 0xFF;
+  b->bytes[at+1] = (v >> 8) & 0xFF;
+  b->bytes[at+2] = (v >> 16) & 0xFF;
+  b->bytes[at+3] = v >> 24;
+}
+
+/* REX prefix, omitted when not needed */
+static void emit_rex(JitBuf* b, int w, int reg, int base) {
+  uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+  if (rex != 0x40) {
+    emit8(b, rex);
+  }
+}
+
+/* ModRM (and SIB/displacement) for [base + disp] */
+static void emit_modrm_mem(JitBuf* b, int reg, int base, int32_t disp) {
+  int mod = (disp == 0 && (base & 7) != RBP) ? 0 : (disp >= -128 && disp <= 127) ? 1 : 2;
+  emit8(b, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) {
+    emit8(b, 0x24);
+  }
+  if (mod == 1) { emit8(b, (uint8_t) disp); }
+  else if (mod == 2) { emit32(b, (uint32_t) disp); }
+}
+
+/* ModRM for a register operand */
+static void emit_modrm_reg(JitBuf* b, int reg, int rm) {
+  emit8(b, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void emit_push(JitBuf* b, int reg) {
+  emit_rex(b, 0, 0, reg);
+  emit8(b, 0x50 + (reg & 7));
+}
+static void emit_pop(JitBuf* b, int reg) {
+  emit_rex(b, 0, 0, reg);
+  emit8(b, 0x58 + (reg & 7));
+}
+
+/* mov dst, src */
+static void emit_mov_rr(JitBuf* b, int dst, int src) {
+  emit_rex(b, 1, src, dst);
+  emit8(b, 0x89);
+  emit_modrm_reg(b, src, dst);
+}
+
+/* mov reg, imm64 */
+static void emit_mov_imm64(JitBuf* b, int reg, uint64_t imm) {
+  emit_rex(b, 1, 0, reg);
+  emit8(b, 0xB8 + (reg & 7));
+  emit64(b, imm);
+}
+
+/* mov reg32, imm32 (zero extended) */
+static void emit_mov_imm32(JitBuf* b, int reg, uint32_t imm) {
+  emit_rex(b, 0, 0, reg);
+  emit8(b, 0xB8 + (reg & 7));
+  emit32(b, imm);
+}
+
+/* mov reg, [base + disp] */
+static void emit_load64(JitBuf* b, int reg, int base, int32_t disp) {
+  emit_rex(b, 1, reg, base);
+  emit8(b, 0x8B);
+  emit_modrm_mem(b, reg, base, disp);
+}
+
+/* mov [base + disp], reg */
+static void emit_store64(JitBuf* b, int base, int32_t disp, int reg) {
+  emit_rex(b, 1, reg, base);
+  emit8(b, 0x89);
+  emit_modrm_mem(b, reg, base, disp);
+}
+
+/* Zero-extending load of an unsigned field of the given size into reg */
+static void emit_load_unsigned(JitBuf* b, int reg, int base, int32_t disp, size_t size) {
+  if (size == 1 || size == 2) {
+    emit_rex(b, 0, reg, base);
+    emit8(b, 0x0F);
+    emit8(b, (size == 1) ? 0xB6 : 0xB7);
+  }
+  else if (size == 4) {
+    emit_rex(b, 0, reg, base);
+    emit8(b, 0x8B);
+  }
+  else {
+    emit_rex(b, 1, reg, base);
+    emit8(b, 0x8B);
+  }
+  emit_modrm_mem(b, reg, base, disp);
+}
+
+/* add/sub reg, imm32 */
+static void emit_add_imm(JitBuf* b, int reg, int32_t imm) {
+  emit_rex(b, 1, 0, reg);
+  emit8(b, 0x81);
+  emit_modrm_reg(b, (imm < 0) ? 5 : 0, reg);
+  emit32(b, (uint32_t) ((imm < 0) ? -(int64_t) imm : imm));
+}
+
+/* add dst, src */
+static void emit_add_rr(JitBuf* b, int dst, int src) {
+  emit_rex(b, 1, src, dst);
+  emit8(b, 0x01);
+  emit_modrm_reg(b, src, dst);
+}
+
+/* sub dst, src */
+static void emit_sub_rr(JitBuf* b, int dst, int src) {
+  emit_rex(b, 1, src, dst);
+  emit8(b, 0x29);
+  emit_modrm_reg(b, src, dst);
+}
+
+/* shl/shr reg, imm8 */
+static void emit_shift(JitBuf* b, int ext, int reg, uint8_t n) {
+  emit_rex(b, 1, 0, reg);
+  emit8(b, 0xC1);
+  emit_modrm_reg(b, ext, reg);
+  emit8(b, n);
+}
+#define emit_shl(b, reg, n) emit_shift(b, 4, reg, n)
+#define emit_shr(b, reg, n) emit_shift(b, 5, reg, n)
+
+/* bt [base], reg: set CF to bit 'reg' of the bit string at base */
+static void emit_bt_mem(JitBuf* b, int base, int reg) {
+  emit_rex(b, 1, reg, base);
+  emit8(b, 0x0F);
+  emit8(b, 0xA3);
+  emit_modrm_mem(b, reg, base, 0);
+}
+
+/* cmp a, b */
+static void emit_cmp_rr(JitBuf* b, int a, int bb) {
+  emit_rex(b, 1, bb, a);
+  emit8(b, 0x39);
+  emit_modrm_reg(b, bb, a);
+}
+
+/* test eax, eax */
+static void emit_test_eax(JitBuf* b) {
+  emit8(b, 0x85);
+  emit8(b, 0xC0);
+}
+
+/*
+ * Operations on a field of a cell at [TP + disp], of the given size: the type
+ * tag or the value
+ */
+static void emit_size_prefix(JitBuf* b, size_t size, int base) {
+  if (size == 2) { emit8(b, 0x66); }
+  emit_rex(b, size == 8, 0, base);
+}
+
+/* cmp [base + disp], imm8 */
+static void emit_cmp_mem_imm8(JitBuf* b, int base, int32_t disp, size_t size, int8_t imm) {
+  emit_size_prefix(b, size, base);
+  emit8(b, (size == 1) ? 0x80 : 0x83);
+  emit_modrm_mem(b, 7, base, disp);
+  emit8(b, (uint8_t) imm);
+}
+
+/* add [base + disp], imm / mov [base + disp], imm, with imm of the field size */
+static void emit_op_mem_imm(JitBuf* b, uint8_t opcode8, uint8_t opcode, int ext, int base, int32_t disp, size_t size, uint32_t imm) {
+  emit_size_prefix(b, size, base);
+  emit8(b, (size == 1) ? opcode8 : opcode);
+  emit_modrm_mem(b, ext, base, disp);
+  if (size == 1) { emit8(b, (uint8_t) imm); }
+  else if (size == 2) { emit16(b, (uint16_t) imm); }
+  else { emit32(b, imm); }
+}
+#define emit_add_mem_imm(b, base, disp, size, imm) emit_op_mem_imm(b, 0x80, 0x81, 0, base, disp, size, imm)
+#define emit_mov_mem_imm(b, base, disp, size, imm) emit_op_mem_imm(b, 0xC6, 0xC7, 0, base, disp, size, imm)
+
+/*
+ * Jumps: emit_jcc()/emit_jmp() return the position of the rel32 to be patched
+ */
+static size_t emit_jcc(JitBuf* b, int cc) {
+  emit8(b, 0x0F);
+  emit8(b, 0x80 + cc);
+  emit32(b, 0);
+  return b->length - 4;
+}
+static size_t emit_jmp(JitBuf* b) {
+  emit8(b, 0xE9);
+  emit32(b, 0);
+  return b->length - 4;
+}
+static void patch_jump(JitBuf* b, size_t at, size_t target) {
+  patch32(b, at, (uint32_t) (int32_t) ((int64_t) target - (int64_t) (at + 4)));
+}
+
+/* Call an absolute address, through rax */
+static void emit_call(JitBuf* b, uint64_t fn) {
+  emit_mov_imm64(b, RAX, fn);
+  emit8(b, 0xFF);
+  emit8(b, 0xD0);
+}
+#define FN_ADDR(fn) ((uint64_t) (uintptr_t) (fn))
+
+/* lea reg, [rip + (target - end of instruction)] */
+static void emit_lea_rip(JitBuf* b, int reg, size_t target) {
+  emit_rex(b, 1, reg, 0);
+  emit8(b, 0x8D);
+  emit8(b, ((reg & 7) << 3) | 5);
+  emit32(b, (uint32_t) (int32_t) ((int64_t) target - (int64_t) (b->length + 4)));
+}
+
+/* ---- */
+
+/*
+ * Building blocks of compiled code
+ */
+
+/* log2 of the cell size, for scaling between tape indices and bytes */
+static uint8_t cell_shift(JitBuf* b) {
+  uint8_t shift = 0;
+  while (((size_t) 1 << shift) < b->cell_size) {
+    shift++;
+  }
+  return shift;
+}
+
+/* Store the tape pointer back to the VM, before calling C that uses it */
+static void emit_sync_ptr(JitBuf* b) {
+  emit_store64(b, R_VM, VM_PTR_OFF, R_TP);
+}
+
+/*
+ * Reload the tape pointer and tape bounds, after calling C that may move them.
+ * This leaves rax alone, so that the result of the call can be checked after.
+ */
+static void emit_reload_tape(JitBuf* b) {
+  emit_load64(b, R_TP, R_VM, VM_PTR_OFF);
+  emit_load64(b, R_TAPE, R_VM, VM_TAPE_OFF);
+  emit_load64(b, R_FN_BITS, R_VM, VM_FN_BITS_OFF);
+  emit_load_unsigned(b, RCX, R_VM, VM_LENGTH_OFF, sizeof(((BFVM*) 0)->tape_length));
+  emit_shl(b, RCX, cell_shift(b));
+  emit_mov_rr(b, R_TAPE_END, R_TAPE);
+  emit_add_rr(b, R_TAPE_END, RCX);
+}
+
+/* Raise a fault with the given message */
+static void emit_fault(JitBuf* b, const char* msg) {
+  emit_mov_imm64(b, ARG0, FN_ADDR(msg));
+  emit_call(b, FN_ADDR(throw_fault));
+}
+
+/* Raise a fault unless the flags satisfy the condition code */
+static void emit_fault_unless(JitBuf* b, int cc, const char* msg) {
+  size_t over = emit_jcc(b, cc);
+  emit_fault(b, msg);
+  patch_jump(b, over, b->length);
+}
+
+/*
+ * Test the bit of the current cell in the bitmap of function cells, setting CF
+ * if it holds a function (so CC_B) and clearing it for a value (CC_AE)
+ */
+static void emit_test_fn(JitBuf* b) {
+  emit_mov_rr(b, RAX, R_TP);
+  emit_sub_rr(b, RAX, R_TAPE);
+  emit_shr(b, RAX, cell_shift(b));
+  emit_bt_mem(b, R_FN_BITS, RAX);
+}
+
+/* Compare the value of the current cell with 0 */
+static void emit_cmp_value_zero(JitBuf* b) {
+  emit_cmp_mem_imm8(b, R_TP, 0, b->cell_size, 0);
+}
+
+/* ---- */
+
+/*
+ * Callbacks from compiled code into C for the less common paths
+ */
+
+/* A > moved the pointer beyond the tape's current length */
+static void jit_move_right(BFVM* vm) {
+  if (VM_INDEX(vm) >= vm->config.max_length) {
+    throw_fault("> operator took pointer beyond valid region");
+  }
+  while (VM_INDEX(vm) >= vm->tape_length) {
+    vm_grow_tape(vm);
+  }
+}
+
+/*
+ * Runs the frame of a call natively, or with the switch interpreter beyond the
+ * native depth or if its function was defined by the interpreter, so has no
+ * native code
+ */
+static void jit_run_call(BFVM* vm) {
+  if (vm->depth > JIT_NATIVE_DEPTH || vm->code.native == NULL) {
+    vm->engine = ENGINE_SWITCH;
+  }
+  vm_run(vm);
+}
+
+/* Ends a call run by jit_call() or jit_tail_call() */
+static void jit_call_return(BFVM* callvm) {
+  if (VM_MEMO_PENDING(callvm)) { memo_return(callvm); }
+  else { vm_call_return(callvm); }
+}
+
+/* A call, run as run_function_call() does, unless answered from the memo table */
+static void jit_call(BFVM* vm, const BFCallSite* site) {
+  BFFn* fn = vm_call_target(vm, site);
+  BFVM* callvm = VM_MEMOISES(vm, fn) ? memo_call(vm, fn, site) : vm_call_enter(vm, fn, site);
+  if (callvm == NULL) { return; }
+
+  jit_run_call(callvm);
+  jit_call_return(callvm);
+}
+
+/* A tail call, returning straight away if it reused the frame */
+static void jit_tail_call(BFVM* vm, const BFCallSite* site) {
+  BFFn* fn = vm_call_target(vm, site);
+  BFVM* callvm = VM_MEMOISES(vm, fn) ? memo_call(vm, fn, site) : vm_call_tail(vm, fn, site);
+  if (callvm == NULL || callvm == vm) { return; }
+
+  jit_run_call(callvm);
+  jit_call_return(callvm);
+}
+
+/* A { ... } definition, whose body has already been compiled to 'native' */
+static void jit_define_fn(BFVM* vm, const BFOp* op, void* native) {
+  BFCode body = { (BFOp*) op + 1, (size_t) op->as.arg - 1, NULL, native, NULL, op->as.def.flags };
+  vm_define_fn(vm, &body);
+}
+
+static void jit_get_char(BFVM* vm, int32_t n) {
+  size_t index = VM_INDEX(vm);
+  if (VM_IS_FN(vm, index)) { throw_fault(", operation not valid on function"); }
+  for (int32_t i=0; i<n; i++) {
+    vm_set_value(vm, index, b_getchar(vm));
+  }
+}
+
+static void jit_put_char(BFVM* vm, int32_t n) {
+  size_t index = VM_INDEX(vm);
+  if (VM_IS_FN(vm, index)) { throw_fault(". operation not valid on function"); }
+  for (int32_t i=0; i<n; i++) {
+    b_putchar(vm, vm_get_value(vm, index));
+  }
+}
+
+/* ---- */
+
+/*
+ * State for compiling a program: the buffer, and the entry point of each
+ * function body compiled so far, by the index of its { op in the program
+ */
+typedef struct {
+  JitBuf buf;
+  const BFOp* ops;
+  size_t* entries;
+} JitUnit;
+
+/*
+ * Compiles the ops [start, start + length) of the program to a native
+ * function, after first compiling each function body defined within them.
+ *
+ * Returns the offset of the function's entry point in the buffer.
+ */
+static size_t compile_function(JitUnit* unit, size_t start, size_t length) {
+  JitBuf* b = &unit->buf;
+  const BFOp* ops = unit->ops;
+
+  JitFixup* fixups = NULL;
+  size_t fixup_count = 0;
+  size_t fixup_capacity = 0;
+
+/* Jump to the code of op 'target', local to this function, once it is known */
+#define FIXUP(at_pos, target_op) \
+  do { \
+    if (fixup_count == fixup_capacity) { \
+      fixup_capacity = (fixup_capacity == 0) ? 16 : fixup_capacity * 2; \
+      fixups = (JitFixup*) realloc(fixups, sizeof(JitFixup) * fixup_capacity); \
+      if (fixups == NULL) { throw_fault("not enough memory to compile program"); } \
+    } \
+    fixups[fixup_count].at = (at_pos); \
+    fixups[fixup_count].target = (target_op); \
+    fixup_count++; \
+  } while (0)
+
+  /* Nested function bodies first, so that their entry points are known */
+  for (size_t i=start; i<start+length; i++) {
+    if (ops[i].code == OP_OPEN_FN) {
+      unit->entries[i] = compile_function(unit, i + 1, (size_t) ops[i].as.arg - 1);
+      i += ops[i].as.arg;
+    }
+  }
+
+  size_t* offsets = (size_t*) malloc(sizeof(size_t) * (length + 1));
+  if (offsets == NULL) { throw_fault("not enough memory to compile program"); }
+
+  /* Prologue: save registers (keeping the stack aligned) and load the tape */
+  size_t entry = b->length;
+  emit_push(b, RBX);
+  emit_push(b, R12);
+  emit_push(b, R13);
+  emit_push(b, R14);
+  emit_push(b, R15);
+  if (SHADOW_SPACE > 0) { emit_add_imm(b, RSP, -SHADOW_SPACE); }
+  emit_mov_rr(b, R_VM, ARG0);
+  emit_reload_tape(b);
+
+  for (size_t i=start; i<start+length; i++) {
+    const BFOp* op = &ops[i];
+    size_t k = i - start;
+    offsets[k] = b->length;
+
+    switch (op->code) {
+
+      case OP_ADD:
+        emit_test_fn(b);
+        emit_fault_unless(b, CC_AE, op->as.arg > 0 ? "+ operation not valid on function" : "- operation not valid on function");
+        emit_add_mem_imm(b, R_TP, 0, b->cell_size, (uint32_t) op->as.arg);
+        break;
+
+      case OP_MOVE:
+        if (op->as.arg > 0) {
+          if ((size_t) op->as.arg >= b->max_length) {
+            emit_fault(b, "> operator took pointer beyond valid region");
+            break;
+          }
+          /* Within the current length is the common case; otherwise check and grow */
+          emit_add_imm(b, R_TP, op->as.arg * (int32_t) b->cell_size);
+          emit_cmp_rr(b, R_TP, R_TAPE_END);
+          size_t inside = emit_jcc(b, CC_B);
+          emit_sync_ptr(b);
+          emit_mov_rr(b, ARG0, R_VM);
+          emit_call(b, FN_ADDR(jit_move_right));
+          emit_reload_tape(b);
+          patch_jump(b, inside, b->length);
+        }
+        else {
+          if ((size_t) -(int64_t) op->as.arg > b->max_length) {
+            emit_fault(b, "< operator took pointer beyond valid region");
+            break;
+          }
+          emit_add_imm(b, R_TP, op->as.arg * (int32_t) b->cell_size);
+          emit_cmp_rr(b, R_TP, R_TAPE);
+          emit_fault_unless(b, CC_AE, "< operator took pointer beyond valid region");
+        }
+        break;
+
+      case OP_OPEN_LOOP: {
+        /* A function cell is never zero, so only check the bit of a 0 value */
+        emit_cmp_value_zero(b);
+        size_t not_zero = emit_jcc(b, CC_NE);
+        emit_test_fn(b);
+        FIXUP(emit_jcc(b, CC_AE), k + op->as.arg + 1);
+        patch_jump(b, not_zero, b->length);
+      } break;
+
+      case OP_CLOSE_LOOP:
+        emit_cmp_value_zero(b);
+        FIXUP(emit_jcc(b, CC_NE), k + op->as.arg + 1);
+        emit_test_fn(b);
+        FIXUP(emit_jcc(b, CC_B), k + op->as.arg + 1);
+        break;
+
+      case OP_CLEAR: {
+        /* Otherwise fall into the original loop, which faults as before */
+        emit_test_fn(b);
+        size_t is_fn = emit_jcc(b, CC_B);
+        emit_mov_mem_imm(b, R_TP, 0, b->cell_size, 0);
+        FIXUP(emit_jmp(b), k + op->as.loop.skip + 1);
+        patch_jump(b, is_fn, b->length);
+      } break;
+
+      case OP_MUL_LOOP:
+        emit_sync_ptr(b);
+        emit_mov_rr(b, ARG0, R_VM);
+        emit_mov_imm64(b, ARG1, FN_ADDR(op));
+        emit_call(b, FN_ADDR(vm_mul_loop));
+        emit_reload_tape(b);
+        emit_test_eax(b);
+        FIXUP(emit_jcc(b, CC_NE), k + op->as.loop.skip + 1);
+        break;
+
+      case OP_MUL_TERM:
+        /* Only read by vm_mul_loop() */
+        break;
+
+      case OP_INLINE:
+        /* Otherwise skip the copy of the function body to make the call */
+        emit_sync_ptr(b);
+        emit_mov_rr(b, ARG0, R_VM);
+        emit_mov_imm64(b, ARG1, FN_ADDR(op));
+        emit_call(b, FN_ADDR(vm_inline_enter));
+        emit_reload_tape(b);
+        emit_test_eax(b);
+        FIXUP(emit_jcc(b, CC_E), k + op->as.inlined.skip + 1);
+        break;
+
+      case OP_INLINE_END:
+        /* The copy has run in place of the call after this op, so skip it */
+        emit_sync_ptr(b);
+        emit_mov_rr(b, ARG0, R_VM);
+        emit_mov_imm64(b, ARG1, FN_ADDR(op));
+        emit_call(b, FN_ADDR(vm_inline_leave));
+        emit_reload_tape(b);
+        FIXUP(emit_jmp(b), k + 2);
+        break;
+
+      case OP_RANGE: {
+        /* Unless every cell the loop reaches is on the tape, skip the copy for the original loop */
+        int32_t cell_size = (int32_t) b->cell_size;
+        emit_mov_rr(b, RAX, R_TP);
+        emit_add_imm(b, RAX, op->as.loop.min * cell_size);
+        emit_cmp_rr(b, RAX, R_TAPE);
+        FIXUP(emit_jcc(b, CC_B), k + op->as.loop.skip + 1);
+        emit_mov_rr(b, RAX, R_TP);
+        emit_add_imm(b, RAX, op->as.loop.max * cell_size);
+        emit_cmp_rr(b, RAX, R_TAPE_END);
+        FIXUP(emit_jcc(b, CC_AE), k + op->as.loop.skip + 1);
+      } break;
+
+      case OP_MOVE_UNCHECKED:
+        /* Checked for the whole loop by the OP_RANGE before it */
+        emit_add_imm(b, R_TP, op->as.arg * (int32_t) b->cell_size);
+        break;
+
+      case OP_OPEN_FN:
+        emit_sync_ptr(b);
+        emit_mov_rr(b, ARG0, R_VM);
+        emit_mov_imm64(b, ARG1, FN_ADDR(op));
+        emit_lea_rip(b, ARG2, unit->entries[i]);
+        emit_call(b, FN_ADDR(jit_define_fn));
+
+        /* The body was compiled separately; carry on after its } */
+        i += op->as.arg;
+        break;
+
+      case OP_CALL:
+      case OP_TAIL_CALL:
+        /* A tail call is always followed by the epilogue, so returns either way */
+        emit_sync_ptr(b);
+        emit_mov_rr(b, ARG0, R_VM);
+        emit_mov_imm64(b, ARG1, FN_ADDR(&op->as.call));
+        emit_call(b, (op->code == OP_TAIL_CALL) ? FN_ADDR(jit_tail_call) : FN_ADDR(jit_call));
+        emit_reload_tape(b);
+        break;
+
+      case OP_GET_CHAR:
+      case OP_PUT_CHAR:
+        emit_sync_ptr(b);
+        emit_mov_rr(b, ARG0, R_VM);
+        emit_mov_imm32(b, ARG1, (uint32_t) op->as.arg);
+        emit_call(b, (op->code == OP_GET_CHAR) ? FN_ADDR(jit_get_char) : FN_ADDR(jit_put_char));
+        break;
+
+      case OP_CLOSE_FN:
+        /* Close ops are always jumped over by the matching open ops */
+        emit_fault(b, "mismatched function/call end");
+        break;
+
+    }
+  }
+
+  /* Epilogue: leave the tape pointer in the VM and restore registers */
+  offsets[length] = b->length;
+  emit_sync_ptr(b);
+  if (SHADOW_SPACE > 0) { emit_add_imm(b, RSP, SHADOW_SPACE); }
+  emit_pop(b, R15);
+  emit_pop(b, R14);
+  emit_pop(b, R13);
+  emit_pop(b, R12);
+  emit_pop(b, RBX);
+  emit8(b, 0xC3);
+
+  for (size_t f=0; f<fixup_count; f++) {
+    patch_jump(b, fixups[f].at, offsets[fixups[f].target]);
+  }
+
+  free(fixups);
+  free(offsets);
+  return entry;
+
+#undef FIXUP
+}
+
+/*
+ * Copies compiled code into a new region of executable memory, which is kept
+ * until jit_free() or jit_release()
+ */
+static void* make_executable(JitBuf* b) {
+  JitRegion* region = (JitRegion*) malloc(sizeof(JitRegion));
+  if (region == NULL) { throw_fault("not enough memory to compile program"); }
+  region->size = b->length;
+
+#ifdef _WIN32
+  region->mem = VirtualAlloc(NULL, region->size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (region->mem == NULL) { throw_fault("not enough memory to compile program"); }
+  memcpy(region->mem, b->bytes, b->length);
+  DWORD old_protect;
+  if (!VirtualProtect(region->mem, region->size, PAGE_EXECUTE_READ, &old_protect)) {
+    throw_fault("could not make compiled program executable");
+  }
+#else
+  region->mem = mmap(NULL, region->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region->mem == MAP_FAILED) { throw_fault("not enough memory to compile program"); }
+  memcpy(region->mem, b->bytes, b->length);
+  if (mprotect(region->mem, region->size, PROT_READ | PROT_EXEC) != 0) {
+    throw_fault("could not make compiled program executable");
+  }
+#endif
+
+  region->next = regions;
+  regions = region;
+  return region->mem;
+}
+
+/*
+ * Compiles a VM's code, setting the native entry point of the code itself.
+ * The code is specialised for the VM's tape config, shared by all the VMs of
+ * the run.
+ *
+ * The compiled code refers to the ops it was compiled from (for call sites,
+ * idioms and definitions), so these must last as long as it is run: this is
+ * the case for the main program, from which all function bodies are compiled.
+ */
+static void jit_compile(BFCode* code, const BFTapeConfig* config) {
+  JitUnit unit;
+  unit.buf.bytes = NULL;
+  unit.buf.length = 0;
+  unit.buf.capacity = 0;
+  unit.buf.cell_size = config->cell_size;
+  unit.buf.max_length = config->max_length;
+  unit.ops = code->ops;
+  unit.entries = (size_t*) calloc(code->length + 1, sizeof(size_t));
+  if (unit.entries == NULL) { throw_fault("not enough memory to compile program"); }
+
+  size_t entry = compile_function(&unit, 0, code->length);
+  uint8_t* mem = (uint8_t*) make_executable(&unit.buf);
+  code->native = mem + entry;
+
+  free(unit.entries);
+  free(unit.buf.bytes);
+}
+
+/*
+ * Runs a VM with native code, compiling it first if it has not been already.
+ *
+ * A tail call that reuses the frame (jit_tail_call()) leaves the VM's ip at the
+ * start of the new code, which is otherwise NULL, so that it is run in turn.
+ */
+void vm_run_jit(BFVM* vm) {
+  if (vm->code.native == NULL) {
+    jit_compile(&vm->code, &vm->config);
+  }
+
+  for (;;) {
+    void (*entry)(BFVM*) = (void (*)(BFVM*)) vm->code.native;
+    vm->ip = NULL;
+    entry(vm);
+
+    if (vm->ip == NULL) { return; }
+    if (vm->code.native == NULL) {
+      vm->engine = ENGINE_SWITCH;
+      vm_run(vm);
+      return;
+    }
+  }
+}
+
+/*
+ * Compiles code ahead of running it, if it has not been already, so that it is
+ * not written to when run (see code_prepare())
+ */
+void jit_prepare(BFCode* code, const BFTapeConfig* config) {
+  if (code->native == NULL) {
+    jit_compile(code, config);
+  }
+}
+
+/* Unmaps a region of executable memory */
+static void region_free(JitRegion* region) {
+#ifdef _WIN32
+  VirtualFree(region->mem, 0, MEM_RELEASE);
+#else
+  munmap(region->mem, region->size);
+#endif
+  free(region);
+}
+
+/*
+ * Frees the executable memory holding the code compiled from a program, given
+ * the native entry point of its main code, once it will no longer be run
+ */
+void jit_release(void* native) {
+  for (JitRegion** link = &regions; *link != NULL; link = &(*link)->next) {
+    JitRegion* region = *link;
+    if ((uint8_t*) native >= (uint8_t*) region->mem && (uint8_t*) native < (uint8_t*) region->mem + region->size) {
+      *link = region->next;
+      region_free(region);
+      return;
+    }
+  }
+}
+
+/*
+ * Frees all executable memory holding compiled code
+ */
+void jit_free() {
+  while (regions != NULL) {
+    JitRegion* next = regions->next;
+    region_free(regions);
+    regions = next;
+  }
+}
+
+#else
+
+/*
+ * Without the JIT, there is never any compiled code to free
+ */
+void jit_release(void* native) {
+  (void) native;
+}
+
+void jit_free() {
+}
+
+#endif /* BF_JIT */
@@ -2,392 +2,245 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "bfplusplus.h"
 
 /*
- * Grows the VM's tape based on TAPE_GROW_RATE, making sure to preserve the
- * tape pointer in correct position in case realloc returns a different start.
+ * The engines that vm_run() can choose between, each generated from bfcore.h
+ * for each cell width: vm_run_switch_*() are portable, while
+ * vm_run_threaded_*() need the labels as values extension of GCC/Clang.
+ * vm_run_profile_*() are the switch engine counting into a profile, only run
+ * for --profile, and vm_run_checkpoint_*() the threaded engine (or the switch
+ * engine, without threaded dispatch) taking checkpoints, only run for
+ * --checkpoint; vm_run_stats_*() are the same engine counting into stats,
+ * only run for --stats, and only built with BF_STATS.
  *
- * If the growth puts the VM beyond the TAPE_MAX_LENGTH, the length will be set
- * to TAPE_MAX_LENGTH, which the caller may need to check for.
- *
- * Throws a fault if realloc returns NULL.
+ * All the VMs of a run have the same width, so the handlers resolved into a
+ * program's code by one threaded engine are never used by another.
  */
-void vm_grow_tape(BFVM* vm) {
-  size_bf old_len = vm->tape_length;
-  size_bf new_len = (size_bf) old_len * TAPE_GROW_RATE;
-  if (new_len > TAPE_MAX_LENGTH) {
-    new_len = TAPE_MAX_LENGTH;
-  }
-
-  size_bf tp_offset = vm->ptr - vm->tape;
-
-  vm->tape_length = new_len;
-  vm->tape = (BFCell*) realloc(vm->tape, sizeof(BFCell) * vm->tape_length);
-  if (vm->tape == NULL) {
-    throw_fault("not enough memory for cell access");
-  }
-
-  for (BFCell* local = vm->tape + old_len; local<vm->tape + vm->tape_length; local++) {
-    local->type = TYPE_VALUE;
-    local->as.VALUE = 0;
-  }
-
-  vm->ptr = vm->tape + tp_offset;
-}
+#define VM_THREADED 0
+#define VM_PROFILE 0
+#define VM_CHECKPOINT 0
+#define VM_STATS 0
+
+#define VM_ENGINE vm_run_switch_8
+#define VM_CELL uint8_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+
+#define VM_ENGINE vm_run_switch_16
+#define VM_CELL uint16_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+
+#define VM_ENGINE vm_run_switch_32
+#define VM_CELL uint32_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+
+#undef VM_PROFILE
+#define VM_PROFILE 1
+
+#define VM_ENGINE vm_run_profile_8
+#define VM_CELL uint8_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+
+#define VM_ENGINE vm_run_profile_16
+#define VM_CELL uint16_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+
+#define VM_ENGINE vm_run_profile_32
+#define VM_CELL uint32_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+
+#undef VM_PROFILE
+#define VM_PROFILE 0
+#undef VM_THREADED
+
+#ifdef BF_THREADED_DISPATCH
+#define VM_THREADED 1
+
+#define VM_ENGINE vm_run_threaded_8
+#define VM_CELL uint8_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+
+#define VM_ENGINE vm_run_threaded_16
+#define VM_CELL uint16_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+
+#define VM_ENGINE vm_run_threaded_32
+#define VM_CELL uint32_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+
+#undef VM_THREADED
+#endif
+
+#undef VM_CHECKPOINT
+#define VM_CHECKPOINT 1
+#ifdef BF_THREADED_DISPATCH
+#define VM_THREADED 1
+#else
+#define VM_THREADED 0
+#endif
+
+#define VM_ENGINE vm_run_checkpoint_8
+#define VM_CELL uint8_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+
+#define VM_ENGINE vm_run_checkpoint_16
+#define VM_CELL uint16_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+
+#define VM_ENGINE vm_run_checkpoint_32
+#define VM_CELL uint32_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+
+#undef VM_CHECKPOINT
+#define VM_CHECKPOINT 0
+
+#ifdef BF_STATS
+#undef VM_STATS
+#define VM_STATS 1
+
+#define VM_ENGINE vm_run_stats_8
+#define VM_CELL uint8_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+
+#define VM_ENGINE vm_run_stats_16
+#define VM_CELL uint16_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+
+#define VM_ENGINE vm_run_stats_32
+#define VM_CELL uint32_t
+#include "bfcore.h"
+#undef VM_ENGINE
+#undef VM_CELL
+#endif
+
+#undef VM_THREADED
+#undef VM_CHECKPOINT
+#undef VM_PROFILE
+#undef VM_STATS
 
 /*
- * Runs a function call in a new VM based on the values in the referenced BFCall
- * struct, essentially recursively because this calls vm_run() on the new VM.
+ * Runs a VM, executing the ops, calling other functions etc.
+ * The main function of the interpreter.
+ *
+ * Runs with the VM's chosen engine and the core for its cell width, falling
+ * back to the threaded engine where the JIT was not compiled in, and to the
+ * switch engine where threaded dispatch was not either. The interpreters are
+ * quite simple, iterating through the lowered ops with the code for each
+ * opcode. Brackets have already been matched up by the lowering, so loops and
+ * function definitions jump straight to their matching op using the distance
+ * in its arg, and each call has been decoded into a single OP_CALL. Simple
+ * loops are run in one go by their idiom ops.
  *
- * Sets the results in call->results to copied versions of the cells, so that
- * the call VM can be destroyed before returning
+ * A VM with a profile always runs with the profiling core, one with a
+ * checkpoint with the checkpointing core, and one with stats with the
+ * counting core.
  */
-void run_function_call(BFVM* vm, BFCall* call) {
-
-  BFVM* callvm = vm_create();
-  callvm->parent = vm;
-
-  callvm->instructions.length = call->fn->length;
-  callvm->instructions.insts = (BFInst*) malloc(sizeof(BFInst) * callvm->instructions.length);
-  memcpy(callvm->instructions.insts, call->fn->insts, sizeof(BFInst) * callvm->instructions.length);
-
-  callvm->ip = callvm->instructions.insts;
-
-  for (int i=0; i<call->arg_count; i++) {
-    *(callvm->ptr) = call->arguments[i];
-    callvm->ptr++;
-    if (callvm->ptr >= callvm->tape + callvm->tape_length) {
-      vm_grow_tape(callvm);
+void vm_run(BFVM* vm) {
+  if (vm->profile != NULL) {
+    switch (vm->config.cell_size) {
+      case 1: vm_run_profile_8(vm); return;
+      case 2: vm_run_profile_16(vm); return;
+      default: vm_run_profile_32(vm); return;
     }
   }
-
-  vm_run(callvm);
-
-  for (int i=0; i<call->res_count; i++) {
-    call->results[i] = cell_copy(*(callvm->ptr));
-
-    callvm->ptr++;
-    if (callvm->ptr >= callvm->tape + callvm->tape_length) {
-      vm_grow_tape(callvm);
+  if (vm->checkpoint != NULL) {
+    switch (vm->config.cell_size) {
+      case 1: vm_run_checkpoint_8(vm); return;
+      case 2: vm_run_checkpoint_16(vm); return;
+      default: vm_run_checkpoint_32(vm); return;
     }
   }
-
-  vm_destroy(callvm);
-
+#ifdef BF_STATS
+  if (vm->stats != NULL) {
+    switch (vm->config.cell_size) {
+      case 1: vm_run_stats_8(vm); return;
+      case 2: vm_run_stats_16(vm); return;
+      default: vm_run_stats_32(vm); return;
+    }
+  }
+#endif
+#ifdef BF_JIT
+  if (vm->engine == ENGINE_JIT) {
+    vm_run_jit(vm);
+    return;
+  }
+#endif
+#ifdef BF_THREADED_DISPATCH
+  if (vm->engine != ENGINE_SWITCH) {
+    switch (vm->config.cell_size) {
+      case 1: vm_run_threaded_8(vm); return;
+      case 2: vm_run_threaded_16(vm); return;
+      default: vm_run_threaded_32(vm); return;
+    }
+  }
+#endif
+  switch (vm->config.cell_size) {
+    case 1: vm_run_switch_8(vm); return;
+    case 2: vm_run_switch_16(vm); return;
+    default: vm_run_switch_32(vm); return;
+  }
 }
 
 /*
- * Runs a VM, executing the instructions, calling other functions etc.
- * The main function of the interpreter.
+ * Resolves everything an engine would otherwise fill in on the first run of
+ * some code: the handlers of the threaded engine, or the JIT's native code.
+ * The code can then be shared by VMs running at once, as running it no longer
+ * writes to it.
  *
- * Quite a simple yet slow implementation, iterating through the instructions
- * and switch based on different instructions. Maintains a loop_stack of return
- * addresses for loop ends which is manipulated by the PUSH_LS, READ_LS and
- * SHRINK_LS macros.
+ * The handlers are resolved by running a VM from the end of the code, which
+ * resolves them all and then stops before doing anything.
  */
-void vm_run(BFVM* vm) {
-
-/* Instruction pointer */
-#define IP (vm->ip)
-
-/* Is the instruction pointer within bounds? */
-#define VALIDIP \
-  (IP < vm->instructions.insts + vm->instructions.length \
-    && IP >= vm->instructions.insts)
-
-/* Current instruction */
-#define INST (*IP)
-
-/* Tape pointer */
-#define TP (vm->ptr)
-
-/* Is the tape pointer within bounds? */
-#define VALIDTP \
-  (TP < vm->tape + TAPE_MAX_LENGTH && TP >= vm->tape)
-
-/* Does vm_grow_tape need to be called? */
-#define NEED_GROWTH \
-  (TP >= vm->tape + vm->tape_length)
-
-/* Current cell */
-#define CELL (*TP)
-
-/* Is the current cell a value? */
-#define ISVALUE (CELL.type == TYPE_VALUE)
-
-/* Is the current cell 0? */
-#define ISZERO (ISVALUE && CELL.as.VALUE == 0)
-
-  BFInst** loop_stack = NULL;
-  size_t loop_stack_length = 0;
-
-/* Add a return instruction address for loop to the loop stack */
-#define PUSH_LS(iptr) \
-  do { \
-    loop_stack_length++; \
-    loop_stack = (BFInst**) realloc(loop_stack, sizeof(BFInst*) * loop_stack_length); \
-    if (loop_stack == NULL) { throw_fault("maximum possible loop depth exceeded"); } \
-    loop_stack[loop_stack_length-1] = iptr; \
-  } while (0)
-
-/* Get top of loop stack without removing it */
-#define READ_LS (loop_stack[loop_stack_length-1])
-
-/* Remove the top value of the loop stack, shrinking it */
-#define SHRINK_LS \
-  do { \
-    loop_stack_length--; \
-    if (loop_stack_length > 0) { \
-      loop_stack = (BFInst**) realloc(loop_stack, sizeof(BFInst*) * loop_stack_length); \
-    } \
-    else { \
-      free(loop_stack); \
-      loop_stack = NULL; \
-    } \
-  } while (0)
-
-  while (VALIDIP) {
-
-    switch (INST) {
-
-      case INST_PLUS:
-        if (!ISVALUE) { throw_fault("+ operation not valid on function"); }
-        CELL.as.VALUE++;
-        break;
-
-      case INST_MINUS:
-        if (!ISVALUE) { throw_fault("- operation not valid on function"); }
-        CELL.as.VALUE--;
-        break;
-
-      case INST_MOVE_LEFT:
-        TP--;
-        if (!VALIDTP) { throw_fault("< operator took pointer beyond valid region"); }
-        break;
-
-      case INST_MOVE_RIGHT:
-        TP++;
-        if (!VALIDTP) { throw_fault("> operator took pointer beyond valid region"); }
-        if (NEED_GROWTH) {
-          vm_grow_tape(vm);
-        }
-        break;
-
-      case INST_OPEN_LOOP: {
-        if (!ISZERO) {
-          /* If not zero, run loop body as normal but push return address */
-          PUSH_LS(IP);
-        }
-        else {
-          /* If zero, skip over loop body */
-          IP++;
-          size_t loop_depth = 0;
-          while (!(INST == INST_CLOSE_LOOP && loop_depth == 0)) {
-            if (INST == INST_OPEN_LOOP) { loop_depth++; }
-            else if (INST == INST_CLOSE_LOOP) { loop_depth--; }
-            IP++;
-            if (!VALIDIP) { throw_fault("mismatched loop brackets"); }
-          }
-        }
-      } break;
-
-      case INST_CLOSE_LOOP: {
-
-        if (!ISZERO) {
-          /* If not zero, go back to loop start */
-          if (loop_stack_length == 0) { throw_fault("mismatched loop brackets"); }
-          IP = READ_LS;
-        }
-        else {
-          /* If zero, loop is finished; forget loop from stack */
-          SHRINK_LS;
-        }
-      } break;
-
-      case INST_OPEN_FN: {
-        if (CELL.type == TYPE_FN) {
-          /*
-           * We can overwrite both functions and values with fn definitions
-           * but fn definitions need to be freed/destroyed
-           */
-          fn_destroy(CELL.as.FN);
-        }
-
-        BFFn* fn = fn_create();
-
-        /* Add loop body instructions to Fn structure at current position */
-        IP++;
-        size_t fn_depth = 0;
-        while (!(INST == INST_CLOSE_FN && fn_depth == 0)) {
-          if (INST == INST_OPEN_FN) { fn_depth++; }
-          else if (INST == INST_CLOSE_FN) { fn_depth--; }
-
-          fn->length++;
-          fn->insts = (BFInst*) realloc(fn->insts, fn->length * sizeof(BFInst));
-          fn->insts[fn->length-1] = INST;
-
-          IP++;
-          if (!VALIDIP) { throw_fault("mismatched function def brackets"); }
-        }
-        CELL.type = TYPE_FN;
-        CELL.as.FN = fn;
-      } break;
-
-      case INST_OPEN_CALL: {
-        BFCall call;
-
-        /* Current cell should be value with function address index */
-        if (CELL.type != TYPE_VALUE) { throw_fault("tried to call function with invalid address"); }
-        size_bf fn_addr = CELL.as.VALUE;
-
-        IP++;
-
-        /*
-         * Read through the instructions between the call brackets and discern
-         * argument count, return count and scope decorator situation
-         */
-        size_t fn_sc = 0;
-        int fn_sc_global = 0;
-        call.arg_count = 0;
-        call.res_count = 0;
-        while (INST != INST_CLOSE_CALL) {
-          switch (INST) {
-            case INST_MINUS: /* - indicates number of spaces back to start pulling arguments from */
-              call.arg_count++;
-              break;
-
-            case INST_PLUS: /* + indicates number of spaces forward to push results to */
-              call.res_count++;
-              break;
-
-            case INST_SCOPE_UP: /* ' indicates number of scopes up to take the function from */
-              fn_sc++;
-              break;
-
-            case INST_SCOPE_GLOBAL: /* @ indicates to take the function from the global scope */
-              fn_sc_global = 1;
-              break;
-
-            default:
-              /* Ignore other characters within call brackets */
-              break;
-          }
-          IP++;
-          if (!VALIDIP) { throw_fault("mismatched function call brackets"); }
-        }
-
-        /* Based on the scope decorators, get VM from which to find function */
-        BFVM* fnvm = vm;
-        if (fn_sc_global == 1) {
-          while (fnvm->parent != NULL) {
-            fnvm = fnvm->parent;
-          }
-        }
-        else {
-          for (int i=0; i<fn_sc; i++) {
-            fnvm = vm->parent;
-            if (fnvm == NULL) {
-              throw_fault("invalid scope up configuration, nonexistent scope");
-            }
-          }
-        }
-        /* Set call structure function to function structure from address */
-        if (fnvm->tape[fn_addr].type != TYPE_FN) { throw_fault("value at address for function call is not function"); }
-        call.fn = fnvm->tape[fn_addr].as.FN;
-
-        /* Push arguments */
-        if (call.arg_count == 0) {
-          call.arguments = NULL;
-        }
-        else {
-          call.arguments = (BFCell*) malloc(sizeof(BFCell) * call.arg_count);
-        }
-        TP -= call.arg_count;
-        if (!VALIDTP) { throw_fault("tried to push invalid number of arguments"); }
-        for (int i=0; i<call.arg_count; i++) {
-          call.arguments[i] = cell_copy(CELL);
-          TP++;
-        }
-
-        /* Allocate result positions ready (arguably should be done in run_function_call) */
-        if (call.res_count == 0) {
-          call.results = NULL;
-        }
-        else {
-          call.results = (BFCell*) malloc(sizeof(BFCell) * call.res_count);
-        }
-
-        /* Run the function */
-        run_function_call(vm, &call);
-
-        /* Pull the results */
-        for (int i=0; i<call.res_count; i++) {
-          TP++;
-          if (!VALIDTP) { throw_fault("tried to pull invalid number of args"); }
-          if (NEED_GROWTH) { vm_grow_tape(vm); }
-          CELL = cell_copy(call.results[i]);
-        }
-        TP -= call.res_count;
-
-        /* Free memory allocated for call args/return etc. */
-        for (int i=0; i<call.arg_count; i++) {
-          cell_destroy(call.arguments[i]);
-        }
-        free(call.arguments);
-
-        for (int i=0; i<call.res_count; i++) {
-          cell_destroy(call.results[i]);
-        }
-        free(call.results);
-
-      } break;
-
-      case INST_GET_CHAR:
-        if (!ISVALUE) { throw_fault(", operation not valid on function"); }
-        CELL.as.VALUE = b_getchar();
-        break;
-
-      case INST_PUT_CHAR:
-        if (!ISVALUE) { throw_fault(". operation not valid on function"); }
-        b_putchar(CELL.as.VALUE);
-        break;
-
-      case INST_SCOPE_UP:
-      case INST_SCOPE_GLOBAL:
-        /*
-         * Do nothing, but no error: ' and @ characters allowed with no effect
-         * outside call brackets
-         */
-        break;
-
-      case INST_CLOSE_CALL:
-      case INST_CLOSE_FN:
-        /* Close instructions would always be handled by the open instructions */
-        throw_fault("mismatched function/call end");
-        break;
-
-    }
-    IP++;
-
+void code_prepare(BFCode* code, const BFTapeConfig* config, BFEngine engine) {
+#ifdef BF_JIT
+  if (engine == ENGINE_JIT) {
+    jit_prepare(code, config);
+    return;
   }
-
-  if (loop_stack_length != 0) {
-    /* If loop addresses still around and execution ended, must be mismatched */
-    free(loop_stack);
-    throw_fault("mismatched loop brackets");
+#endif
+#ifdef BF_THREADED_DISPATCH
+  if (engine != ENGINE_SWITCH) {
+    BFVM vm;
+    memset(&vm, 0, sizeof(BFVM));
+    vm.config = *config;
+    vm.engine = ENGINE_THREADED;
+    vm.code = *code;
+    vm.ip = code->ops + code->length;
+
+    vm_run(&vm);
+    code->threads = vm.code.threads;
   }
-
-#undef IP
-#undef VALIDIP
-#undef INST
-#undef TP
-#undef VALIDTP
-#undef NEED_GROWTH
-#undef CELL
-#undef ISZERO
-#undef PUSH_LS
-#undef READ_LS
-#undef SHRINK_LS
+#endif
+  (void) code;
+  (void) config;
+  (void) engine;
 }
@@ -3,6 +3,9 @@
 #define BF_PLUS_PLUS_H
 
 #include <stdint.h>
+#include <stdio.h>
+#include <setjmp.h>
+#include <signal.h>
 
 /*
  * Define to print a summary of any memory leaks, provided that mltrack.c and
@@ -15,18 +18,57 @@
 #endif
 
 /*
- * BF++ uses unsigned 16-bit type as its standard value type - requires a
- * <stdint.h> implementation as included above, and for the architecture to
- * provide a 16-bit type
+ * Defined when building the benchmarks, to count the allocations made (see
+ * bench/allocs.h)
  */
-typedef uint16_t size_bf;
+#ifdef BF_BENCH_ALLOCS
+#include "bench/allocs.h"
+#endif
+
+/*
+ * BF++ cells are unsigned 8, 16 (the standard) or 32-bit values, chosen per
+ * run (see BFTapeConfig). Values of cells are passed around as the widest,
+ * 32-bit type, and wrap to the width of the cell they are stored in - requires
+ * a <stdint.h> implementation as included above
+ */
+typedef uint32_t size_bf;
 
 typedef enum _BFInst BFInst;
 typedef struct _BFInstructions BFInstructions;
+typedef enum _BFOpCode BFOpCode;
+typedef struct _BFOp BFOp;
+typedef struct _BFCallSite BFCallSite;
+typedef struct _BFFnDef BFFnDef;
+typedef struct _BFIdiomLoop BFIdiomLoop;
+typedef struct _BFMulTerm BFMulTerm;
+typedef struct _BFInline BFInline;
+typedef struct _BFCode BFCode;
 typedef struct _BFCell BFCell;
-typedef struct _BFInstructions BFFn;
+typedef struct _BFFn BFFn;
 typedef struct _BFVM BFVM;
-typedef struct _BFCall BFCall;
+typedef struct _BFFrames BFFrames;
+typedef struct _BFFnTable BFFnTable;
+typedef struct _BFTapeConfig BFTapeConfig;
+typedef struct _BFIO BFIO;
+typedef struct _BFProgram BFProgram;
+typedef struct _BFSource BFSource;
+typedef struct _BFProfile BFProfile;
+typedef struct _BFProfileNode BFProfileNode;
+typedef struct _BFMemoKey BFMemoKey;
+typedef struct _BFMemoEntry BFMemoEntry;
+typedef struct _BFMemo BFMemo;
+typedef struct _BFCheckpoint BFCheckpoint;
+typedef struct _BFStats BFStats;
+
+/*
+ * Storage local to each thread, for the little state that is not per VM, so
+ * that VMs can run on several threads at once
+ */
+#ifdef _MSC_VER
+#define BF_THREAD_LOCAL __declspec(thread)
+#else
+#define BF_THREAD_LOCAL _Thread_local
+#endif
 
 /*
  * The valid BF++ instructions
@@ -49,21 +91,269 @@ enum _BFInst {
 };
 
 /*
- * Structure for array of instructions to be fed to a VM.
+ * Structure for array of instructions as produced by the lexer, one per source
+ * character. These are lowered into a BFCode before being fed to a VM.
  *
- * Note that BFFn is also a typedef for this struct, because function
- * definitions are just an array of instructions within.
+ * If 'offsets' is not NULL (e.g. an empty allocation), the lexer also appends
+ * the byte offset in the source of each instruction to it, so that lowering
+ * can carry source positions through for --profile (profile.c).
  */
 struct _BFInstructions {
   BFInst* insts;
   size_t length;
+  uint32_t* offsets;
 };
 
+/*
+ * The text of a source file, mapped into memory or read in whole by
+ * source_open() (lexer.c)
+ */
+struct _BFSource {
+  const char* src;
+  size_t length;
+  int mapped;
+};
+
+/*
+ * The ops of the lowered IR actually run by the VM. A run of identical
+ * instructions is folded into a single op, with the run length carried in the
+ * op's argument (lower.c):
+ *   OP_ADD        arg is the signed delta: +n for a run of +, -n for a run of -
+ *   OP_MOVE       arg is the signed distance: +n for >, -n for <
+ *   OP_GET_CHAR   arg is the number of characters read
+ *   OP_PUT_CHAR   arg is the number of times the character is printed
+ *
+ * For the bracket ops ([, ], { and }) the arg is instead the relative distance
+ * to the matching bracket, resolved once at load time: positive on the open op
+ * and negative on the close op.
+ *
+ * A whole call, ( to ), is decoded at load time into a single OP_CALL op
+ * carrying a BFCallSite. The ' and @ decorators have no effect outside call
+ * brackets and so are dropped there. A call in tail position, directly before
+ * the } of its function body, is an OP_TAIL_CALL instead, which may run in the
+ * frame of the call it ends rather than a new one (see vm_call_tail()).
+ *
+ * Each { op also carries what lowering found of the function body it starts,
+ * e.g. that the body is pure, so that its calls can be memoised (see BFFnDef).
+ *
+ * Simple loops are also recognised as idioms and prefixed with a single op
+ * doing the work of the whole loop (see recognise_idioms() in lower.c):
+ *   OP_CLEAR      [-] or [+], setting the cell to zero
+ *   OP_MUL_LOOP   e.g. [->+>+++<<], adding multiples of the cell to the cells
+ *                 at the offsets given by the OP_MUL_TERM ops that follow it,
+ *                 then setting it to zero (a copy being a multiple of 1)
+ * The original loop is kept after these ops and is run instead whenever the
+ * idiom cannot be applied exactly, e.g. because a cell involved holds a
+ * function, so that the same fault is raised at the same point.
+ *
+ * A call whose function is known at load time, if small enough, is prefixed
+ * with a copy of the function's body, which runs in place of the call (see
+ * inline_calls() in lower.c):
+ *   OP_INLINE     starts the copy, if the call would run the function it was
+ *                 made from (see BFInline)
+ *   OP_INLINE_END ends the copy and skips the call after it; arg is the
+ *                 number of cells the copy runs on
+ * The call is kept after these ops and is made instead whenever the function
+ * turns out to be another, or the call would fault on entering.
+ *
+ * A loop whose pointer only reaches offsets known at load time is prefixed
+ * with a copy of itself whose moves are not checked (see check_ranges() in
+ * lower.c):
+ *   OP_RANGE          checks once that every cell the loop can reach is on
+ *                     the tape, skipping the copy otherwise
+ *   OP_MOVE_UNCHECKED a move within the copy, arg as for OP_MOVE
+ * The original loop is kept after the copy, and is run instead whenever the
+ * check fails, so that moves beyond the tape fault as before.
+ */
+enum _BFOpCode {
+  OP_ADD = 0,
+  OP_MOVE,
+  OP_OPEN_LOOP,
+  OP_CLOSE_LOOP,
+  OP_OPEN_FN,
+  OP_CLOSE_FN,
+  OP_CALL,
+  OP_TAIL_CALL,
+  OP_GET_CHAR,
+  OP_PUT_CHAR,
+  OP_CLEAR,
+  OP_MUL_LOOP,
+  OP_MUL_TERM,
+  OP_INLINE,
+  OP_INLINE_END,
+  OP_RANGE,
+  OP_MOVE_UNCHECKED,
+};
+
+#define OP_CODE_COUNT (OP_MOVE_UNCHECKED + 1)
+
+/*
+ * Decoded contents of a pair of call brackets: the number of - and + in them,
+ * and which scope to take the function from. The scope is the number of '
+ * decorators, or SCOPE_GLOBAL if there was an @ (which takes precedence).
+ */
+#define SCOPE_GLOBAL -1
+
+struct _BFCallSite {
+  uint16_t arg_count;
+  uint16_t res_count;
+  int32_t scope;
+};
+
+/*
+ * A function definition (OP_OPEN_FN): the distance to its }, the same as the
+ * op's arg, and flags for what effect analysis found of its body when lowered
+ * (see mark_pure_fns() in lower.c):
+ *   FN_PURE   the body does no I/O, defines no functions and makes no calls
+ *             through ' or @, so a call of it with the same argument values
+ *             always has the same results, and no other effect
+ */
+#define FN_PURE 1
+
+struct _BFFnDef {
+  int32_t skip;
+  uint32_t flags;
+};
+
+/*
+ * An idiom loop (OP_CLEAR, OP_MUL_LOOP): the distance to the ] of the original
+ * loop it replaces, and the lowest and highest tape offsets that the original
+ * loop's pointer reaches. Also a range check (OP_RANGE), where the distance
+ * is to the ] of the unchecked copy of the loop.
+ */
+struct _BFIdiomLoop {
+  int32_t skip;
+  int16_t min;
+  int16_t max;
+};
+
+/*
+ * A term of an OP_MUL_LOOP: the target cell's offset from the loop cell, and
+ * the multiple of the loop cell's value to add to it
+ */
+struct _BFMulTerm {
+  int32_t offset;
+  int32_t factor;
+};
+
+/*
+ * An inlined call (OP_INLINE): the distance to the OP_INLINE_END ending the
+ * copy of the function body, and from the OP_INLINE to the { of the function
+ * the copy was made from
+ */
+struct _BFInline {
+  int32_t skip;
+  int32_t def;
+};
+
+/*
+ * A single op, accessed through the 'as' union according to its code: 'call'
+ * for OP_CALL and OP_TAIL_CALL, 'loop' for OP_CLEAR, OP_MUL_LOOP and
+ * OP_RANGE, 'term' for OP_MUL_TERM, 'inlined' for OP_INLINE, otherwise 'arg'
+ * (and also 'def' for OP_OPEN_FN)
+ */
+struct _BFOp {
+  BFOpCode code;
+
+  union {
+    int32_t arg;
+    BFCallSite call;
+    BFFnDef def;
+    BFIdiomLoop loop;
+    BFMulTerm term;
+    BFInline inlined;
+  } as;
+};
+
+/*
+ * Structure for array of lowered ops to be fed to a VM.
+ *
+ * The threaded engine resolves the address of each op's handler once into
+ * 'threads', which is otherwise NULL. It has length + 1 entries, the last
+ * ending the run; for a function body this is the handler of its closing }.
+ *
+ * The JIT compiles the ops to a native function taking the BFVM, its entry
+ * point being kept in 'native', which is otherwise NULL. Native code is owned
+ * by the JIT rather than the BFCode, and lasts until jit_free().
+ *
+ * When lowered from instructions with offsets, 'offsets' holds the source
+ * offset of the first instruction of each op, for --profile to report by;
+ * otherwise (and for function bodies) it is NULL.
+ *
+ * For a function body, 'flags' are those of its definition (see BFFnDef); for
+ * a main program they are 0.
+ */
+struct _BFCode {
+  BFOp* ops;
+  size_t length;
+
+  const void** threads;
+  void* native;
+
+  uint32_t* offsets;
+  uint32_t flags;
+};
+
+/*
+ * A function value, defined by a { ... }. Its code is a slice of the loaded
+ * program (the ops between the brackets, with their handlers), so defining a
+ * function copies nothing.
+ *
+ * Function values are immutable, so cells holding the same function share a
+ * single BFFn, counting references to it (fn_retain(), fn_release()): copying,
+ * passing or returning a function is then O(1). The loaded program outlives
+ * every function value, which never free the code they slice.
+ */
+struct _BFFn {
+  BFCode code;
+  size_t refs;
+
+  BFFn* next;
+  BFFn** link;
+};
+
+/*
+ * The dispatch engines for running ops, selectable per run (bfcore.h).
+ *
+ * Threaded dispatch needs the labels as values extension of GCC and Clang;
+ * where it is not available (or BF_NO_THREADED_DISPATCH is defined), VMs set to
+ * ENGINE_THREADED run with the switch engine instead.
+ */
+#if defined(__GNUC__) && !defined(BF_NO_THREADED_DISPATCH)
+#define BF_THREADED_DISPATCH
+#endif
+
+/*
+ * The JIT (bfjit.c) compiles to x86-64 code, for either the System V or
+ * Windows calling convention. On other architectures (or with BF_NO_JIT
+ * defined), VMs set to ENGINE_JIT run with the best interpreter instead.
+ */
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(BF_NO_JIT)
+#define BF_JIT
+#endif
+
+/*
+ * The counters of --stats (stats.c) are built in unless BF_NO_STATS is
+ * defined, when the option is not offered and the counting compiles to nothing
+ */
+#ifndef BF_NO_STATS
+#define BF_STATS
+#endif
+
+typedef enum {
+  ENGINE_SWITCH,
+  ENGINE_THREADED,
+  ENGINE_JIT,
+} BFEngine;
+
 /*
  * Each cell can be a function or a value, and tagged by 'type' enum, and
  * accessed through 'as' union.
  *
- * This may be inefficient given just two types
+ * This is only how single cells are passed around (e.g. by cell_copy()), as
+ * it would be inefficient for a whole tape given just two types: tapes are
+ * instead stored as a dense array of values plus a bitmap of function cells
+ * (see BFFrames).
  */
 struct _BFCell {
   enum {
@@ -78,80 +368,469 @@ struct _BFCell {
 };
 
 /*
+ * The sizing of tapes and their cells, chosen per run (main.c) and shared by
+ * every VM of the run.
+ *
+ * Cells are 1, 2 or 4 bytes ('cell_size'), for 8, 16 or 32-bit values; each
+ * width has its own specialised copy of the interpreters (bfcore.h).
+ *
  * The maximum tape length is by default set to the canonical 30,000, but could
- * be set to anything below the unsigned 16-bit max of 65,535.
+ * be set to anything up to TAPE_MAX_LIMIT.
  *
  * The initial length is default 100, but could be anything between 1 and the
- * max length, affecting performance. Note that this will result in an
- * allocation of sizeof(BFCell) * TAPE_INITIAL_LENGTH every time a function is
- * called as each call has its own tape.
+ * max length, affecting performance. Note that each call has its own tape, and
+ * its cells up to the tape length are cleared again when the call returns.
  *
  * The tape grow rate is set to 1.5 for no real reason - this is the amount
- * by which the length will be multiplied by when growing the tape. It is just
- * an array, so if realloc is fast, no real need to have a particularly high
- * grow rate.
+ * by which the length will be multiplied by when growing the tape. Growing
+ * only extends the length within room already reserved, so there is no real
+ * need to have a particularly high grow rate.
+ *
+ * Tapes are frames on a frame stack, allocated in chunks of FRAME_CHUNK_FRAMES
+ * times the maximum length, so that each holds at least a few frames. The
+ * stack holds up to 'max_depth' calls in progress at once, by default
+ * FRAME_MAX_DEPTH; a call beyond that is a fault.
  */
+#define CELL_SIZE 2
 #define TAPE_MAX_LENGTH 30000
 #define TAPE_INITIAL_LENGTH 100
 #define TAPE_GROW_RATE 1.5
+#define TAPE_MAX_LIMIT (1 << 26)
+#define FRAME_CHUNK_FRAMES 8
+#define FRAME_MAX_DEPTH 1000000
+
+struct _BFTapeConfig {
+  size_t cell_size;
+  size_t max_length;
+  size_t initial_length;
+  double grow_rate;
+  size_t max_depth;
+};
+
+/*
+ * A chunk of the frame stack holding the tapes of the main program and each
+ * function call in progress, one above the other. Each frame (tape) starts
+ * directly after the end of the one below, with room to grow to the maximum
+ * length, so no tape is ever reallocated; every cell above the top frame is
+ * kept zeroed. Chunks are linked in stack order, and kept for reuse once
+ * allocated.
+ *
+ * The cells are stored as a struct of arrays: 'values' holds the value of each
+ * cell at the width of the run, and 'fn_bits' a bit for each cell, set if it
+ * holds a function instead, which is then found in the BFFnTable by the cell's
+ * address. Frames start on a multiple of 8 cells, so that each tape's bits
+ * start on a byte. The length is in cells.
+ *
+ * Both arrays are mapped straight from the OS rather than the heap, between
+ * guard pages (see pages_reserve() in bfvm.c), so that only the pages of cells
+ * actually used take up memory, and any access beyond a chunk faults at once.
+ */
+struct _BFFrames {
+  uint8_t* values;
+  uint8_t* fn_bits;
+  size_t length;
+  BFFrames* next;
+};
+
+/*
+ * The functions held by cells of a frame stack: a hash table from the address
+ * of each function cell's value to its function, with open addressing and
+ * linear probing. 'capacity' is a power of 2, or 0 before the first function.
+ *
+ * Every function value alive on the frame stack is also on the 'live' list,
+ * linked through its 'next' and 'link' (the pointer to it), including those
+ * held only by calls in progress: if a fault unwinds the calls (see
+ * fault_catch()), vm_reset() can then still free them all.
+ */
+struct _BFFnTable {
+  const uint8_t** keys;
+  BFFn** fns;
+  size_t length;
+  size_t capacity;
+
+  BFFn* live;
+};
+
+/*
+ * Memoisation of calls of pure functions (--memo, memo.c). A call is keyed by
+ * the function's code, its numbers of arguments and results, and the values
+ * of its arguments, which are followed by the values of its results once
+ * known. Only calls passing and returning no more than MEMO_MAX_CELLS cells in
+ * all, none of them functions, are memoised.
+ */
+#define MEMO_MAX_CELLS 16
+#define MEMO_ENTRIES 4096
+#define MEMO_NONE UINT32_MAX
+
+struct _BFMemoKey {
+  const BFOp* ops;
+  uint32_t hash;
+  uint16_t arg_count;
+  uint16_t res_count;
+  size_bf cells[MEMO_MAX_CELLS];
+};
+
+/*
+ * The memo table of a run, holding up to 'capacity' calls. Entries are chained
+ * from 'buckets' by the hash of their keys, and listed from the most recently
+ * used ('newest') to the least ('oldest'), which makes room for a new entry
+ * once the table is full; links are indexes of entries, or MEMO_NONE. 'calls'
+ * counts the calls looked up, and 'hits' those answered from the table.
+ */
+struct _BFMemoEntry {
+  BFMemoKey key;
+  uint32_t chain;
+  uint32_t newer;
+  uint32_t older;
+};
+
+struct _BFMemo {
+  BFMemoEntry* entries;
+  size_t length;
+  size_t capacity;
+  uint32_t* buckets;
+  size_t bucket_count;
+  uint32_t newest;
+  uint32_t oldest;
+
+  uint64_t calls;
+  uint64_t hits;
+};
+
+/*
+ * Checkpoints of a run (--checkpoint, checkpoint.c), written to 'path'. The
+ * checkpointing core counts down 'countdown' at each ] and call, taking a
+ * checkpoint when it reaches 0 (every 'interval' of them, if not 0) or once
+ * 'requested' by a signal. Writing a checkpoint is left to a forked copy of
+ * the process, 'writer' (or 0 if none is running). When resuming a run from a
+ * checkpoint, 'resume' is the VM of the call that was running, to carry on in
+ * once the run starts.
+ */
+struct _BFCheckpoint {
+  const char* path;
+  uint64_t interval;
+  uint64_t countdown;
+  volatile sig_atomic_t requested;
+  long writer;
+
+  BFVM* resume;
+};
+
+/*
+ * The counters of a run with --stats (stats.c), reported as text or as JSON
+ * ('json') when the run ends, or once 'requested' by SIGUSR1 while it runs.
+ * The counting core (bfcore.h) counts the ops run by opcode, the loops entered
+ * and the iterations of their bodies, the calls made in a new frame or in the
+ * frame they replace ('frames_reused'), the calls run by an inlined copy and
+ * the deepest nesting of calls. The runtime counts the growth of tapes with
+ * the longest that the main program's and any call's grew to, the cells
+ * copied between frames and which of those were functions, and the blocks of
+ * memory allocated while running.
+ */
+struct _BFStats {
+  uint64_t ops[OP_CODE_COUNT];
+  uint64_t loops;
+  uint64_t iterations;
+  uint64_t calls;
+  uint64_t frames_reused;
+  uint64_t inlined;
+  uint64_t max_depth;
+
+  uint64_t grows;
+  uint64_t main_peak;
+  uint64_t call_peak;
+  uint64_t cells_copied;
+  uint64_t fns_copied;
+  uint64_t allocs;
+
+  size_t cell_size;
+  int json;
+  volatile sig_atomic_t requested;
+};
+
+/*
+ * Accessing a VM's tape: is the cell at an index a function, and the index of
+ * the tape pointer
+ */
+#define VM_IS_FN(vm, index) (((vm)->fn_bits[(index) >> 3] >> ((index) & 7)) & 1)
+#define VM_INDEX(vm) ((size_t) ((vm)->ptr - (vm)->tape) / (vm)->config.cell_size)
+
+/*
+ * Adds to a counter of a VM's stats, if it has any (see BFStats); nothing at
+ * all without BF_STATS
+ */
+#ifdef BF_STATS
+#define VM_STAT(vm, counter, n) do { if ((vm)->stats != NULL) { (vm)->stats->counter += (n); } } while (0)
+#else
+#define VM_STAT(vm, counter, n) do {} while (0)
+#endif
+
+/*
+ * Memoisation of a VM's calls: is a call of a function looked up in the memo
+ * table (memo_call()), and is the call the VM runs to be recorded there when
+ * it returns (memo_return())
+ */
+#define VM_MEMOISES(vm, fn) ((vm)->memo != NULL && ((fn)->code.flags & FN_PURE))
+#define VM_MEMO_PENDING(vm) ((vm)->memo_key.ops != NULL)
 
 /*
  * The BF++ VM from which everything is run. The name may not be particularly
- * apt given that a new one is created for each function call.
+ * apt given that there is one for each function call in progress, as well as
+ * the main program's: each is the frame of its call, pushed onto the frame
+ * stack along with its tape ('frames' being the chunk holding the tape). The
+ * tape is the values of its cells, the bits of which are in 'fn_bits'; 'fns'
+ * is the table of functions shared by the whole frame stack. As the width of
+ * cells is only known at run time, the tape and pointer address bytes, and the
+ * tape length is in cells.
+ *
+ * The , and . operators use the I/O callbacks in 'io', or stdin and stdout if
+ * NULL (see io_getc()). If 'profile' is not NULL, the VM runs with the
+ * profiling core instead of its engine, counting into the profile. If 'memo'
+ * is not NULL, calls of pure functions are first looked up in it (memo.c), and
+ * 'memo_key' is that of the call the VM runs, if it is to be recorded there.
+ * If 'checkpoint' is not NULL, the VM runs with the checkpointing core, which
+ * takes checkpoints of the run as it goes (checkpoint.c), and if 'stats' is
+ * not NULL with the counting core, counting into the stats (stats.c).
+ *
+ * For function calls, the VM retains a reference to its parent VM, and to the
+ * main program's as 'global', which allow for ' and @ specifiers to work, and
+ * passes on its engine, tape config, I/O, profile, memo table, checkpoint and
+ * stats. It also holds a reference to the function being run in 'fn', sharing
+ * its code rather than owning it; for the main program 'fn' is NULL and the VM
+ * owns the code.
  *
- * For function calls, the VM retains a reference to its parent VM which allows
-  * for ' and @ specifiers to work.
+ * The VMs of calls are allocated on the heap rather than the C stack, so that
+ * the interpreters can run calls in a loop instead of recursively (bfcore.h):
+ * 'child' is the VM of calls made from this one, allocated by the first and
+ * kept for reuse, and 'depth' the number of calls in progress below it. When
+ * the call ends, its first 'res_count' cells from the pointer are returned
+ * to the parent, after any 'leads' left by frames this one has replaced with
+ * tail calls (see vm_call_tail()).
+ *
+ * While a copy of a function body inlined at a call runs on the cells beyond
+ * the VM's tape (see vm_inline_enter()), 'inline_index' is the index of the
+ * call's address cell and 'inline_length' the length of the tape before it.
  */
+#define TAIL_MAX_LEADS 4
+
 struct _BFVM {
-  BFCell* tape;
-  size_bf tape_length;
-  BFCell* ptr;
+  BFFrames* frames;
+  BFFnTable* fns;
+  BFTapeConfig config;
+  uint8_t* tape;
+  uint8_t* fn_bits;
+  size_t tape_length;
+  uint8_t* ptr;
+
+  BFCode code;
+  BFOp* ip;
 
-  BFInstructions instructions;
-  BFInst* ip;
+  BFEngine engine;
+  const BFIO* io;
+  BFProfile* profile;
+  BFMemo* memo;
+  BFCheckpoint* checkpoint;
+  BFStats* stats;
 
   BFVM* parent;
+  BFVM* global;
+  BFFn* fn;
+
+  BFVM* child;
+  size_t depth;
+  uint16_t res_count;
+  uint16_t lead_count;
+  size_bf leads[TAIL_MAX_LEADS];
+
+  size_t inline_index;
+  size_t inline_length;
+
+  BFMemoKey memo_key;
 };
 
 /*
- * A struct used for function calls; stores the arguments and results as well as
- * the original fn definition object
+ * Callbacks for the I/O of a VM, each passed 'ctx': 'get' returns the next
+ * byte of input, or EOF if there is none (read as 0), and 'put' takes a byte
+ * of output.
  */
-struct _BFCall {
-  BFCell* arguments;
-  size_bf arg_count;
+struct _BFIO {
+  int (*get)(void* ctx);
+  void (*put)(void* ctx, uint8_t c);
+  void* ctx;
+};
 
-  BFFn* fn;
+/*
+ * A program loaded by program_load() for embedding (libbfpp.c): its lowered
+ * code, prepared for its engine and tape config. Nothing in it is written to
+ * while running, so it can be run by any number of VMs, on any threads.
+ */
+struct _BFProgram {
+  BFCode code;
+  BFTapeConfig config;
+  BFEngine engine;
+};
+
+/*
+ * A call path of a profiled run (profile.c): the function called, as the index
+ * of its { op (or PROFILE_MAIN for the main program), below the call path it
+ * was called from. Counts the calls along the path, and the instructions run
+ * by it directly ('self'), with 'total' adding those of the calls it made
+ * once summed up for the report. A function calling itself directly stays on
+ * the same path, so that recursion takes one path however deep it goes:
+ * 'repeats' is the number of such calls in progress, and 'max_repeats' the
+ * most there have been at once.
+ */
+#define PROFILE_MAIN SIZE_MAX
+
+struct _BFProfileNode {
+  size_t def;
+  uint64_t calls;
+  uint64_t self;
+  uint64_t total;
+  uint64_t repeats;
+  uint64_t max_repeats;
 
-  BFCell* results;
-  size_bf res_count;
+  BFProfileNode* parent;
+  BFProfileNode* children;
+  BFProfileNode* sibling;
 };
 
+/*
+ * The counts of a profiled run (--profile) of a program: how many times each
+ * op ran ('counts'), with the number of source instructions each op stands for
+ * ('weights', e.g. 5 for a run of five +), and the tree of call paths, 'current'
+ * being that of the call running.
+ */
+struct _BFProfile {
+  const BFOp* ops;
+  size_t length;
+  uint64_t* counts;
+  uint32_t* weights;
+
+  BFProfileNode root;
+  BFProfileNode* current;
+};
+
+/*
+ * Results of loading and running programs through libbfpp.c
+ */
+typedef enum {
+  BF_OK = 0,
+  BF_ERR_LOAD,  /* the program could not be loaded, e.g. mismatched brackets */
+  BF_ERR_FAULT, /* the program faulted while running */
+} BFStatus;
+
 /* ---- */
 
 /* lexer.c */
-int lex_file(const char* fpath, BFVM* vm);
+int lex_file(const char* fpath, BFInstructions* insts);
+void lex_memory(const char* src, size_t length, BFInstructions* insts);
+int source_open(const char* fpath, BFSource* source);
+void source_close(BFSource* source);
+
+/* lower.c */
+void lower_instructions(BFInstructions* insts, BFCode* code);
+int loop_range(const BFOp* ops, size_t open, int16_t* min, int16_t* max);
 
 /* utils.c */
 void throw_fault(const char* msg);
+jmp_buf* fault_catch(jmp_buf* target);
+const char* fault_message();
 void cell_destroy(BFCell cell);
 void cells_dump(BFVM* vm);
-size_bf b_getchar();
-void b_putchar(size_bf c);
+void io_init();
+void io_flush();
+int io_getc();
+void io_counts(uint64_t* read, uint64_t* written);
+void io_resume(uint64_t read, uint64_t written);
+size_bf b_getchar(BFVM* vm);
+void b_putchar(BFVM* vm, size_bf c);
 
-BFFn* fn_create();
-void fn_destroy(BFFn* fn);
-void instructions_copy(BFInstructions* dest, BFInstructions* src);
+BFFn* fn_create(const BFCode* code, BFFnTable* fns);
+BFFn* fn_retain(BFFn* fn);
+void fn_release(BFFn* fn);
 BFCell cell_copy(BFCell c);
+size_bf vm_get_value(const BFVM* vm, size_t index);
+void vm_set_value(BFVM* vm, size_t index, size_bf value);
+BFFn* vm_get_fn(const BFVM* vm, size_t index);
+BFCell vm_get_cell(const BFVM* vm, size_t index);
+void vm_set_cell(BFVM* vm, size_t index, BFCell cell);
 
 /* bfvm.c */
-BFVM* vm_create();
+BFVM* vm_create(const BFTapeConfig* config);
+BFVM* vm_push_frame(BFVM* parent);
+void vm_pop_frame(BFVM* vm);
+void vm_reuse_frame(BFVM* vm, size_t keep);
+void vm_truncate_tape(BFVM* vm, size_t length);
+void vm_reset(BFVM* vm, int unwound);
 void vm_destroy(BFVM* vm);
 
-/* bfplusplus.c */
+/* bfruntime.c */
 void vm_grow_tape(BFVM* vm);
-void run_function_call(BFVM* vm, BFCall* call);
+BFFn* vm_call_target(BFVM* vm, const BFCallSite* site);
+BFVM* vm_call_enter(BFVM* vm, BFFn* fn, const BFCallSite* site);
+BFVM* vm_call_tail(BFVM* vm, BFFn* fn, const BFCallSite* site);
+BFVM* vm_call_return(BFVM* callvm);
+int vm_inline_enter(BFVM* vm, const BFOp* op);
+void vm_inline_leave(BFVM* vm, const BFOp* op);
+void run_function_call(BFVM* vm, BFFn* fn, const BFCallSite* site);
+int vm_mul_loop(BFVM* vm, const BFOp* op);
+void vm_define_fn(BFVM* vm, const BFCode* body);
+void vm_call(BFVM* vm, const BFCallSite* site);
+
+/* bfplusplus.c */
 void vm_run(BFVM* vm);
+void code_prepare(BFCode* code, const BFTapeConfig* config, BFEngine engine);
+
+/* profile.c */
+int profile_load(const char* fpath, BFCode* code);
+BFProfile* profile_create(const BFCode* code);
+BFProfileNode* profile_enter(BFProfile* profile, const BFFn* fn);
+BFProfileNode* profile_leave(BFProfile* profile);
+int profile_write(const BFProfile* profile, const BFCode* code, const char* fpath, const char* out_path);
+void profile_free(BFProfile* profile);
+
+/* memo.c */
+BFMemo* memo_create(size_t capacity);
+BFVM* memo_call(BFVM* vm, BFFn* fn, const BFCallSite* site);
+BFVM* memo_return(BFVM* callvm);
+void memo_report(const BFMemo* memo, FILE* out);
+void memo_free(BFMemo* memo);
+
+/* emitc.c */
+void emit_c(const BFCode* code, const BFTapeConfig* config, FILE* out);
+
+/* bfjit.c */
+void vm_run_jit(BFVM* vm);
+void jit_prepare(BFCode* code, const BFTapeConfig* config);
+void jit_release(void* native);
+void jit_free();
+
+/* cache.c */
+uint64_t hash_bytes(const char* src, size_t length);
+int cache_load(const char* fpath, BFCode* code, int use_cache);
+void cache_release(BFCode* code);
+
+/* checkpoint.c */
+BFCheckpoint* checkpoint_create(const char* path, uint64_t interval);
+void checkpoint_take(BFVM* vm);
+void checkpoint_restore(BFVM* vm, const char* path);
+void checkpoint_free(BFCheckpoint* checkpoint);
+
+/* stats.c */
+BFStats* stats_create(const BFTapeConfig* config, int json);
+void stats_report(const BFStats* stats, FILE* out);
+void stats_free(BFStats* stats);
+
+/* batch.c */
+int batch_run(const BFProgram* program, char** inputs, size_t count, const char* out_dir, size_t jobs);
+
+/* libbfpp.c */
+BFStatus program_load(const char* src, size_t length, const BFTapeConfig* config, BFEngine engine, BFProgram** program, const char** error);
+BFStatus program_load_file(const char* fpath, const BFTapeConfig* config, BFEngine engine, BFProgram** program, const char** error);
+void program_free(BFProgram* program);
+BFVM* program_create_vm(const BFProgram* program);
+BFStatus program_run(const BFProgram* program, BFVM* vm, const BFIO* io, const char** error);
 
 
 #endif /* BF_PLUS_PLUS_H */
@@ -0,0 +1,368 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bfplusplus.h"
+
+/*
+ * The runtime shared by every way of running a program: the interpreters and
+ * JIT (bfplusplus.c, bfjit.c), and programs compiled ahead of time to C by
+ * emit_c() (emitc.c), which link against this file along with bfvm.c and
+ * utils.c and supply their own vm_run().
+ */
+
+/*
+ * Grows the VM's tape based on its grow rate (by at least one cell). The tape
+ * is a frame on the frame stack, with room reserved to grow to the maximum
+ * length and the cells beyond its length kept zeroed, so this just extends the
+ * length: the tape never moves and nothing needs initialising.
+ *
+ * If the growth puts the VM beyond the maximum length, the length will be set
+ * to the maximum, which the caller may need to check for.
+ */
+void vm_grow_tape(BFVM* vm) {
+  size_t new_len = (size_t) (vm->tape_length * vm->config.grow_rate);
+  if (new_len <= vm->tape_length) {
+    new_len = vm->tape_length + 1;
+  }
+  if (new_len > vm->config.max_length) {
+    new_len = vm->config.max_length;
+  }
+  vm->tape_length = new_len;
+
+#ifdef BF_STATS
+  if (vm->stats != NULL) {
+    BFStats* stats = vm->stats;
+    stats->grows++;
+    uint64_t* peak = (vm->parent == NULL) ? &stats->main_peak : &stats->call_peak;
+    if (new_len > *peak) { *peak = new_len; }
+  }
+#endif
+}
+
+/*
+ * Copies the cell at an index of a VM's tape, to be passed between frames as
+ * an argument or result, counting it for --stats
+ */
+static BFCell frame_copy(const BFVM* vm, size_t index) {
+  BFCell cell = cell_copy(vm_get_cell(vm, index));
+  VM_STAT(vm, cells_copied, 1);
+  if (cell.type == TYPE_FN) { VM_STAT(vm, fns_copied, 1); }
+  return cell;
+}
+
+/*
+ * Starts a call of the function with the arguments and results given by the
+ * call site, in the VM of a new frame pushed onto the frame stack above the
+ * caller's, returning that VM ready to run the function's code from the start.
+ *
+ * The arguments are copied once, straight from the caller's tape to the start
+ * of the new tape; the caller must already have grown its tape to cover the
+ * results (see vm_call_target()), as the frame above it is in use until the
+ * call ends with vm_call_return().
+ */
+BFVM* vm_call_enter(BFVM* vm, BFFn* fn, const BFCallSite* site) {
+  BFVM* callvm = vm_push_frame(vm);
+
+  /* Run the function's code in place, holding a reference for the call */
+  callvm->fn = fn_retain(fn);
+  callvm->code = fn->code;
+  callvm->ip = callvm->code.ops;
+  callvm->res_count = site->res_count;
+
+  /* Push arguments */
+  size_t args = VM_INDEX(vm) - site->arg_count;
+  for (int i=0; i<site->arg_count; i++) {
+    vm_set_cell(callvm, i, frame_copy(vm, args + i));
+    if ((size_t) i + 1 >= callvm->tape_length) {
+      vm_grow_tape(callvm);
+    }
+  }
+  callvm->ptr += site->arg_count * callvm->config.cell_size;
+
+  return callvm;
+}
+
+/*
+ * Starts a call in tail position (OP_TAIL_CALL), which ends the call running
+ * in 'vm', in the same frame where possible: its arguments are moved down to
+ * the start of its tape and the rest of the tape emptied, so that a chain of
+ * tail calls, e.g. a recursive loop, runs in a single frame. Returns the VM
+ * to run the function's code in, 'vm' itself if its frame was reused.
+ *
+ * Whatever the caller would have had returned by the call being replaced is
+ * kept exact. Its first result would be the cell before the results of the
+ * tail call, always a value (the function's address), which is kept in the
+ * frame as a lead to be returned ahead of the results (see vm_call_return());
+ * its others are the first results of the tail call itself. So the frame is
+ * only reused where those cover all the results, and where pulling them into
+ * the frame being replaced could not have faulted. Otherwise, and for the
+ * main program, the call is made in a new frame as usual.
+ *
+ * Lowering only emits tail calls for programs with no ' decorators (see
+ * mark_tail_calls()), as only a call through ' could look into the frame of
+ * the call being replaced, or see its parent in its place. Nor is the frame of
+ * a call to be memoised reused, as its results are recorded as it returns
+ * (see memo_return()).
+ */
+BFVM* vm_call_tail(BFVM* vm, BFFn* fn, const BFCallSite* site) {
+  size_t index = VM_INDEX(vm);
+
+  if (vm->parent == NULL || VM_MEMO_PENDING(vm) || index + site->res_count >= vm->config.max_length
+    || (vm->res_count > 0 && (vm->res_count - 1 > site->res_count || vm->lead_count == TAIL_MAX_LEADS))) {
+    return vm_call_enter(vm, fn, site);
+  }
+
+  if (vm->res_count > 0) {
+    vm->leads[vm->lead_count++] = vm_get_value(vm, index);
+    vm->res_count--;
+  }
+
+  /*
+   * The arguments move down the same tape, each to a cell already read from
+   * or before the cells still to be read. The function may be held only by
+   * the frame being emptied, so is retained first.
+   */
+  fn_retain(fn);
+  size_t args = index - site->arg_count;
+  for (int i=0; i<site->arg_count; i++) {
+    vm_set_cell(vm, i, frame_copy(vm, args + i));
+  }
+  vm_reuse_frame(vm, site->arg_count);
+
+  fn_release(vm->fn);
+  vm->fn = fn;
+  vm->code = fn->code;
+  vm->ip = vm->code.ops;
+  vm->ptr = vm->tape + site->arg_count * vm->config.cell_size;
+
+  return vm;
+}
+
+/*
+ * Ends a call started by vm_call_enter(), returning its results to its parent
+ * and popping its frame. Returns the parent, to carry on running.
+ *
+ * The results are copied once, straight back from the call's tape to the
+ * parent's cells after its current one, after any leads kept by tail calls.
+ */
+BFVM* vm_call_return(BFVM* callvm) {
+  BFVM* vm = callvm->parent;
+
+  /* Pull the results; cells beyond the end of the call's tape would be zero */
+  size_t results = VM_INDEX(vm) + 1;
+  size_t from = VM_INDEX(callvm);
+  size_t leads = callvm->lead_count;
+  for (size_t i=0; i<leads+callvm->res_count; i++) {
+    if (results + i >= vm->config.max_length) { throw_fault("tried to pull invalid number of args"); }
+
+    BFCell result = { TYPE_VALUE, { .VALUE = 0 } };
+    if (i < leads) {
+      result.as.VALUE = callvm->leads[i];
+    }
+    else if (from + i - leads < callvm->tape_length) {
+      result = frame_copy(callvm, from + i - leads);
+    }
+    vm_set_cell(vm, results + i, result);
+  }
+
+  vm_pop_frame(callvm);
+  return vm;
+}
+
+/*
+ * Starts the copy of a function body inlined at a call (OP_INLINE, see
+ * inline_calls() in lower.c), if the call would run that function and not
+ * fault on entering it: as vm_call_target() and vm_push_frame() would find,
+ * the address cell holds the function defined by the { the copy was made
+ * from, the arguments are on the tape and the calls are not nested to the
+ * maximum depth.
+ *
+ * The copy then runs in the caller's VM, on as many cells beyond its tape as
+ * the OP_INLINE_END gives, which are zeroed as those of a new frame would be:
+ * the arguments are copied to the first of them and the pointer moved to
+ * after them, as for a call. The copy makes no calls and never moves the
+ * pointer before the arguments, so the cells before them are left alone.
+ *
+ * Returns 1 if the copy should run, to be ended by vm_inline_leave(), or 0 if
+ * the call should be made as usual instead, having grown the tape no more
+ * than vm_call_target() will.
+ */
+int vm_inline_enter(BFVM* vm, const BFOp* op) {
+  const BFOp* end = op + op->as.inlined.skip;
+  const BFCallSite* site = &end[1].as.call;
+  size_t index = VM_INDEX(vm);
+
+  if (VM_IS_FN(vm, index) || index < site->arg_count || vm->depth >= vm->config.max_depth) { return 0; }
+
+  size_bf fn_addr = vm_get_value(vm, index);
+  const BFVM* fnvm = (site->scope == SCOPE_GLOBAL) ? vm->global : vm;
+  if (fn_addr >= fnvm->tape_length || !VM_IS_FN(fnvm, fn_addr)
+    || vm_get_fn(fnvm, fn_addr)->code.ops != op + op->as.inlined.def + 1) {
+    return 0;
+  }
+
+  /* The results must fit on the tape, and the copy's cells beyond them */
+  if (index + site->res_count >= vm->config.max_length) { return 0; }
+  while (index + site->res_count >= vm->tape_length) {
+    vm_grow_tape(vm);
+  }
+  size_t base = vm->tape_length;
+  if ((size_t) end->as.arg > vm->config.max_length - base) { return 0; }
+
+  vm->tape_length = base + (size_t) end->as.arg;
+  size_t args = index - site->arg_count;
+  for (size_t i=0; i<site->arg_count; i++) {
+    vm_set_cell(vm, base + i, frame_copy(vm, args + i));
+  }
+
+  vm->inline_index = index;
+  vm->inline_length = base;
+  vm->ptr = vm->tape + (base + site->arg_count) * vm->config.cell_size;
+  return 1;
+}
+
+/*
+ * Ends the copy of an inlined function body started by vm_inline_enter() (at
+ * its OP_INLINE_END), returning its results to the cells after the call's
+ * address cell as vm_call_return() would, then emptying the cells the copy ran
+ * on and moving the pointer back to the address cell.
+ */
+void vm_inline_leave(BFVM* vm, const BFOp* op) {
+  const BFCallSite* site = &op[1].as.call;
+  size_t results = vm->inline_index + 1;
+  size_t from = VM_INDEX(vm);
+  for (size_t i=0; i<site->res_count; i++) {
+    BFCell result = { TYPE_VALUE, { .VALUE = 0 } };
+    if (from + i < vm->tape_length) {
+      result = frame_copy(vm, from + i);
+    }
+    vm_set_cell(vm, results + i, result);
+  }
+
+  vm_truncate_tape(vm, vm->inline_length);
+  vm->ptr = vm->tape + vm->inline_index * vm->config.cell_size;
+}
+
+/*
+ * Runs a whole call of a function, as vm_call_enter() then vm_call_return()
+ * with a vm_run() of the new frame in between, for native code that makes
+ * its calls recursively on the C stack. The interpreters and compiled C
+ * instead run the calls of a program in a loop.
+ */
+void run_function_call(BFVM* vm, BFFn* fn, const BFCallSite* site) {
+  BFVM* callvm = vm_call_enter(vm, fn, site);
+  vm_run(callvm);
+  vm_call_return(callvm);
+}
+
+/*
+ * Runs an OP_MUL_LOOP idiom at the current cell (see recognise_idioms()).
+ *
+ * Returns 1 if the whole loop has been run, so the caller should skip to the
+ * end of the original loop. Returns 0, having changed nothing, if the original
+ * loop should be run instead so that it faults at the same point as before:
+ * because it would move the pointer beyond the tape or touch a function cell.
+ */
+int vm_mul_loop(BFVM* vm, const BFOp* op) {
+  const BFIdiomLoop* loop = &op->as.loop;
+  const BFOp* term;
+  size_t tp_index = VM_INDEX(vm);
+
+  if (VM_IS_FN(vm, tp_index)) { return 0; }
+  size_bf count = vm_get_value(vm, tp_index);
+  if (count == 0) { return 1; }
+
+  if (tp_index < (size_t) -loop->min) { return 0; }
+  if (vm->config.max_length - tp_index <= (size_t) loop->max) { return 0; }
+  while (tp_index + loop->max >= vm->tape_length) {
+    vm_grow_tape(vm);
+  }
+  for (term = op + 1; term->code == OP_MUL_TERM; term++) {
+    if (VM_IS_FN(vm, tp_index + term->as.term.offset)) { return 0; }
+  }
+
+  for (term = op + 1; term->code == OP_MUL_TERM; term++) {
+    size_t index = tp_index + term->as.term.offset;
+    vm_set_value(vm, index, vm_get_value(vm, index) + count * (uint32_t) term->as.term.factor);
+  }
+  vm_set_value(vm, tp_index, 0);
+
+  return 1;
+}
+
+/*
+ * Defines a function at the current cell with the given body, as for a { ... }
+ * definition. The body is a slice of the loaded program, shared rather than
+ * copied.
+ */
+void vm_define_fn(BFVM* vm, const BFCode* body) {
+  /*
+   * We can overwrite both functions and values with fn definitions, any
+   * function being released by vm_set_cell()
+   */
+  BFCell cell;
+  cell.type = TYPE_FN;
+  cell.as.FN = fn_create(body, vm->fns);
+  VM_STAT(vm, allocs, 1);
+
+  vm_set_cell(vm, VM_INDEX(vm), cell);
+}
+
+/*
+ * Finds the function for the call described by a call site, with the function
+ * address in the current cell, in the right scope, and checks the arguments
+ * and results fit on the tape; to be called with vm_call_enter() or
+ * vm_call_tail().
+ */
+BFFn* vm_call_target(BFVM* vm, const BFCallSite* site) {
+
+/* Index of the tape pointer */
+#define TP_INDEX VM_INDEX(vm)
+
+  /* Current cell should be value with function address index */
+  if (VM_IS_FN(vm, TP_INDEX)) { throw_fault("tried to call function with invalid address"); }
+  size_bf fn_addr = vm_get_value(vm, TP_INDEX);
+
+  /* Based on the scope decorators, get VM from which to find function */
+  BFVM* fnvm = vm;
+  if (site->scope == SCOPE_GLOBAL) {
+    fnvm = vm->global;
+  }
+  else {
+    for (int32_t i=0; i<site->scope; i++) {
+      fnvm = fnvm->parent;
+      if (fnvm == NULL) {
+        throw_fault("invalid scope up configuration, nonexistent scope");
+      }
+    }
+  }
+  /* Get function structure from address */
+  if (fn_addr >= fnvm->tape_length || !VM_IS_FN(fnvm, fn_addr)) { throw_fault("value at address for function call is not function"); }
+  BFFn* fn = vm_get_fn(fnvm, fn_addr);
+
+  /* Arguments are taken from the cells before the current one */
+  if (TP_INDEX < site->arg_count) { throw_fault("tried to push invalid number of arguments"); }
+
+  /*
+   * Results go in the cells after the current one, so grow the tape to cover
+   * them now, before the call's frame is pushed above it. Any results beyond
+   * the tape's maximum are a fault once the call has run.
+   */
+  while (TP_INDEX + site->res_count >= vm->tape_length && vm->tape_length < vm->config.max_length) {
+    vm_grow_tape(vm);
+  }
+
+  return fn;
+
+#undef TP_INDEX
+}
+
+/*
+ * Runs the call described by a call site, as run_function_call() of the
+ * function found by vm_call_target()
+ */
+void vm_call(BFVM* vm, const BFCallSite* site) {
+  run_function_call(vm, vm_call_target(vm, site), site);
+}
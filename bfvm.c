@@ -1,41 +1,357 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
 #include "bfplusplus.h"
 
+/* Size of the pages of memory mapped by the OS */
+static size_t page_size() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (size_t) info.dwPageSize;
+#else
+  return (size_t) sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/* Rounds a size up to whole pages */
+static size_t page_round(size_t size) {
+  size_t page = page_size();
+  return (size + page - 1) / page * page;
+}
+
 /*
- * Allocates a new VM structure and sets fields to initial values.
- * Instructions are initialised as blank; can be added by lexer
+ * Maps zeroed memory for 'size' bytes of cells, between two guard pages that
+ * fault on any access. The OS only commits each page of memory the first time
+ * it is touched, so the cells of a chunk never used cost nothing, however
+ * long the tapes may grow. Returns NULL if the memory cannot be mapped.
  */
-BFVM* vm_create() {
-  BFVM* out = (BFVM*) malloc(sizeof(BFVM));
+static uint8_t* pages_reserve(size_t size) {
+  size_t page = page_size();
+  size_t length = page_round(size) + 2 * page;
+
+#ifdef _WIN32
+  uint8_t* base = (uint8_t*) VirtualAlloc(NULL, length, MEM_RESERVE, PAGE_NOACCESS);
+  if (base == NULL) { return NULL; }
+  if (VirtualAlloc(base + page, length - 2 * page, MEM_COMMIT, PAGE_READWRITE) == NULL) {
+    VirtualFree(base, 0, MEM_RELEASE);
+    return NULL;
+  }
+#else
+  uint8_t* base = (uint8_t*) mmap(NULL, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == (uint8_t*) MAP_FAILED) { return NULL; }
+  if (mprotect(base + page, length - 2 * page, PROT_READ | PROT_WRITE) != 0) {
+    munmap(base, length);
+    return NULL;
+  }
+#endif
+
+  return base + page;
+}
+
+/*
+ * Zeroes memory mapped by pages_reserve() by handing its pages back to the
+ * OS, to be mapped afresh as zero pages if touched again, rather than writing
+ * zeroes over them all
+ */
+static void pages_zero(uint8_t* mem, size_t size) {
+  size_t length = page_round(size);
+
+#ifdef _WIN32
+  VirtualFree(mem, length, MEM_DECOMMIT);
+  if (VirtualAlloc(mem, length, MEM_COMMIT, PAGE_READWRITE) == NULL) {
+    throw_fault("not enough memory for frame stack");
+  }
+#else
+  if (mmap(mem, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+    memset(mem, 0, size);
+  }
+#endif
+}
+
+/* Unmaps memory mapped by pages_reserve(), along with its guard pages */
+static void pages_release(uint8_t* mem, size_t size) {
+  size_t page = page_size();
+
+#ifdef _WIN32
+  (void) size;
+  VirtualFree(mem - page, 0, MEM_RELEASE);
+#else
+  munmap(mem - page, page_round(size) + 2 * page);
+#endif
+}
+
+/*
+ * Allocates a new chunk of the frame stack, with all cells zeroed (and so
+ * values of 0)
+ */
+static BFFrames* frames_create(const BFTapeConfig* config) {
+  BFFrames* out = (BFFrames*) malloc(sizeof(BFFrames));
+  if (out == NULL) { throw_fault("not enough memory for frame stack"); }
+
+  out->length = FRAME_CHUNK_FRAMES * ((config->max_length + 7) & ~(size_t) 7);
+  out->values = pages_reserve(out->length * config->cell_size);
+  out->fn_bits = pages_reserve(out->length / 8);
+  if (out->values == NULL || out->fn_bits == NULL) { throw_fault("not enough memory for frame stack"); }
+  out->next = NULL;
+  return out;
+}
+
+/*
+ * Sets the fields of a VM for a tape at the given cell of a chunk of the frame
+ * stack, which must be a multiple of 8. The VM's 'child' is left as it is, for
+ * the VMs of calls to be kept for reuse.
+ */
+static void vm_init(BFVM* vm, const BFTapeConfig* config, BFFrames* frames, BFFnTable* fns, size_t base) {
+  vm->frames = frames;
+  vm->fns = fns;
+  vm->config = *config;
+  vm->tape = frames->values + base * config->cell_size;
+  vm->fn_bits = frames->fn_bits + base / 8;
+  vm->tape_length = config->initial_length;
+  vm->ptr = vm->tape;
+
+  vm->code.ops = NULL;
+  vm->code.length = 0;
+  vm->code.threads = NULL;
+  vm->code.native = NULL;
+  vm->code.offsets = NULL;
+  vm->code.flags = 0;
+  vm->ip = NULL;
+
+#ifdef BF_THREADED_DISPATCH
+  vm->engine = ENGINE_THREADED;
+#else
+  vm->engine = ENGINE_SWITCH;
+#endif
+
+  vm->io = NULL;
+  vm->profile = NULL;
+  vm->memo = NULL;
+  vm->checkpoint = NULL;
+  vm->stats = NULL;
+  vm->parent = NULL;
+  vm->global = vm;
+  vm->fn = NULL;
+  vm->depth = 0;
+  vm->res_count = 0;
+  vm->lead_count = 0;
+  vm->inline_index = 0;
+  vm->inline_length = 0;
+  vm->memo_key.ops = NULL;
+}
 
-  out->tape = (BFCell*) malloc(sizeof(BFCell) * TAPE_INITIAL_LENGTH);
-  out->tape_length = TAPE_INITIAL_LENGTH;
-  out->ptr = out->tape;
-  for (int i=0; i<out->tape_length; i++) {
-    out->tape[i].type = TYPE_VALUE;
-    out->tape[i].as.VALUE = 0;
+/*
+ * Allocates a new VM structure and sets fields to initial values, with a new
+ * frame stack whose first frame is its tape, sized by the given config (or the
+ * defaults if NULL).
+ * Code is initialised as blank; can be added by lower_instructions()
+ */
+BFVM* vm_create(const BFTapeConfig* config) {
+  BFTapeConfig defaults = { CELL_SIZE, TAPE_MAX_LENGTH, TAPE_INITIAL_LENGTH, TAPE_GROW_RATE, FRAME_MAX_DEPTH };
+  if (config == NULL) {
+    config = &defaults;
   }
 
-  out->instructions.insts = NULL;
-  out->instructions.length = 0;
-  out->ip = NULL;
+  BFVM* out = (BFVM*) malloc(sizeof(BFVM));
+  if (out == NULL) { throw_fault("not enough memory for VM"); }
+
+  BFFnTable* fns = (BFFnTable*) calloc(1, sizeof(BFFnTable));
+  if (fns == NULL) { throw_fault("not enough memory for VM"); }
 
-  out->parent = NULL;
+  out->child = NULL;
+  vm_init(out, config, frames_create(config), fns, 0);
   return out;
 }
 
 /*
- * Destroys, frees VM and all cells and instructions
+ * Sets up the VM for a function call from 'parent', its child, with its tape
+ * pushed onto the frame stack directly above the parent's (rounded up to a
+ * multiple of 8 cells). Each frame has room to grow to the maximum tape
+ * length, so where that does not fit in the current chunk of the stack the
+ * next is used, allocated the first time it is needed and then kept; as is the
+ * child VM itself. A call beyond the maximum depth is a fault.
+ *
+ * The cells above the top frame are always zeroed, so pushing a frame does no
+ * more than set the fields of the VM. Must be matched by vm_pop_frame().
+ */
+BFVM* vm_push_frame(BFVM* parent) {
+  if (parent->depth >= parent->config.max_depth) { throw_fault("calls nested beyond the maximum depth"); }
+
+  BFVM* vm = parent->child;
+  if (vm == NULL) {
+    vm = (BFVM*) malloc(sizeof(BFVM));
+    if (vm == NULL) { throw_fault("not enough memory for frame stack"); }
+    vm->child = NULL;
+    parent->child = vm;
+    VM_STAT(parent, allocs, 1);
+  }
+
+  BFFrames* frames = parent->frames;
+  size_t base = (parent->tape - frames->values) / parent->config.cell_size + parent->tape_length;
+  base = (base + 7) & ~(size_t) 7;
+
+  if (base + parent->config.max_length > frames->length) {
+    if (frames->next == NULL) {
+      frames->next = frames_create(&parent->config);
+      VM_STAT(parent, allocs, 1);
+    }
+    frames = frames->next;
+    base = 0;
+  }
+
+  vm_init(vm, &parent->config, frames, parent->fns, base);
+  vm->parent = parent;
+  vm->global = parent->global;
+  vm->engine = parent->engine;
+  vm->io = parent->io;
+  vm->profile = parent->profile;
+  vm->memo = parent->memo;
+  vm->checkpoint = parent->checkpoint;
+  vm->stats = parent->stats;
+  vm->depth = parent->depth + 1;
+  return vm;
+}
+
+/*
+ * Releases the functions held by a VM's cells from 'from' to the end of its
+ * tape, and zeroes the cells again
+ */
+static void vm_clear_cells(BFVM* vm, size_t from) {
+  size_t end = vm->tape_length;
+  BFCell zero = { TYPE_VALUE, { .VALUE = 0 } };
+  if (from >= end) { return; }
+
+  /* The rest of the byte of bits holding 'from', then whole bytes */
+  for (size_t i=from; i<end && (i & 7) != 0; i++) {
+    if (VM_IS_FN(vm, i)) { vm_set_cell(vm, i, zero); }
+  }
+  for (size_t b=(from+7)/8; b<(end+7)/8; b++) {
+    for (size_t i=b*8; vm->fn_bits[b] != 0; i++) {
+      if (VM_IS_FN(vm, i)) { vm_set_cell(vm, i, zero); }
+    }
+  }
+  memset(vm->tape + from * vm->config.cell_size, 0, vm->config.cell_size * (end - from));
+}
+
+/*
+ * Releases the functions held by a VM's cells, and zeroes the cells again
+ */
+static void vm_clear_tape(BFVM* vm) {
+  vm_clear_cells(vm, 0);
+}
+
+/*
+ * Empties the tape of a call's VM but for its first 'keep' cells, for its
+ * frame to be reused by a tail call (see vm_call_tail()): the tape starts over
+ * from the initial length, grown to cover the cells kept, as for a new frame.
+ */
+void vm_reuse_frame(BFVM* vm, size_t keep) {
+  vm_clear_cells(vm, keep);
+
+  vm->tape_length = vm->config.initial_length;
+  while (keep >= vm->tape_length) {
+    vm_grow_tape(vm);
+  }
+}
+
+/*
+ * Empties the cells of a VM's tape from 'length' onwards and shrinks the tape
+ * back to that length, as once an inlined function body has run on the cells
+ * beyond it (see vm_inline_leave())
+ */
+void vm_truncate_tape(BFVM* vm, size_t length) {
+  vm_clear_cells(vm, length);
+  vm->tape_length = length;
+}
+
+/*
+ * Pops the frame of a VM set up by vm_push_frame(), destroying its cells and
+ * zeroing them again ready for the next frame, so that the cost is in the
+ * cells used rather than the maximum length. Releases the function being run.
+ */
+void vm_pop_frame(BFVM* vm) {
+  vm_clear_tape(vm);
+
+  if (vm->fn != NULL) {
+    fn_release(vm->fn);
+  }
+}
+
+/*
+ * Resets a VM created by vm_create() to an empty tape, ready to run again,
+ * keeping its frame stack and function table rather than reallocating them.
+ *
+ * If a fault unwound the run ('unwound', see fault_catch()), the frames of the
+ * calls in progress were never popped: then every function value is freed,
+ * whatever references are left, and every chunk of the frame stack zeroed,
+ * by mapping its pages afresh.
+ */
+void vm_reset(BFVM* vm, int unwound) {
+  if (unwound) {
+    BFFnTable* fns = vm->fns;
+    while (fns->live != NULL) {
+      BFFn* next = fns->live->next;
+      free(fns->live);
+      fns->live = next;
+    }
+    if (fns->capacity > 0) {
+      memset(fns->keys, 0, sizeof(uint8_t*) * fns->capacity);
+    }
+    fns->length = 0;
+
+    for (BFFrames* frames = vm->frames; frames != NULL; frames = frames->next) {
+      pages_zero(frames->values, frames->length * vm->config.cell_size);
+      pages_zero(frames->fn_bits, frames->length / 8);
+    }
+  }
+  else {
+    vm_clear_tape(vm);
+  }
+
+  vm->tape_length = vm->config.initial_length;
+  vm->ptr = vm->tape;
+  vm->ip = vm->code.ops;
+}
+
+/*
+ * Destroys, frees VM created by vm_create(), along with all cells, the frame
+ * stack, the VMs kept for calls and code
  */
 void vm_destroy(BFVM* vm) {
-  for (int i=0; i<vm->tape_length; i++) {
-    cell_destroy(vm->tape[i]);
+  vm_clear_tape(vm);
+
+  BFVM* child = vm->child;
+  while (child != NULL) {
+    BFVM* next = child->child;
+    free(child);
+    child = next;
   }
-  free(vm->tape);
 
-  free(vm->instructions.insts);
+  BFFrames* frames = vm->frames;
+  while (frames != NULL) {
+    BFFrames* next = frames->next;
+    pages_release(frames->values, frames->length * vm->config.cell_size);
+    pages_release(frames->fn_bits, frames->length / 8);
+    free(frames);
+    frames = next;
+  }
+
+  free(vm->fns->keys);
+  free(vm->fns->fns);
+  free(vm->fns);
+
+  free(vm->code.ops);
+  free(vm->code.threads);
+  free(vm->code.offsets);
   free(vm);
 }
@@ -0,0 +1,314 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "bfplusplus.h"
+
+/*
+ * A cache of each program's lowered code, written beside its source file (as
+ * program.bppc for program.bpp) so that later runs can skip lexing and
+ * lowering altogether.
+ *
+ * Lowered ops hold no pointers, their brackets and calls being resolved into
+ * relative distances and call sites within the ops themselves, and function
+ * bodies being the ranges between their brackets. So the cache is simply a
+ * header followed by the ops exactly as they are in memory, which are mapped
+ * straight into memory and run in place. The header records the version of
+ * the format (to be bumped whenever BFOp changes) and a hash of the source,
+ * so that the cache is rebuilt whenever the source changes, along with a hash
+ * of the ops themselves to catch a damaged cache.
+ */
+#define BPPC_VERSION 5
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t op_size;
+  uint32_t reserved;
+  uint64_t source_hash;
+  uint64_t source_length;
+  uint64_t op_count;
+  uint64_t ops_hash;
+} BPPCHeader;
+
+/*
+ * 64-bit hash of some bytes (source text or ops), taking 8 at a time. Also
+ * identifies the program of a checkpoint (checkpoint.c).
+ */
+uint64_t hash_bytes(const char* src, size_t length) {
+  uint64_t hash = 0x9E3779B97F4A7C15ull ^ length;
+  size_t i = 0;
+
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, src + i, 8);
+    hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 32;
+  }
+  for (; i < length; i++) {
+    hash = (hash ^ (uint8_t) src[i]) * 0xC4CEB9FE1A85EC53ull;
+  }
+
+  return hash ^ (hash >> 29);
+}
+
+/*
+ * Path of the cache of a source file: with a c appended to .bpp, otherwise
+ * .bppc appended
+ */
+static char* cache_path(const char* fpath) {
+  size_t length = strlen(fpath);
+  char* out = (char*) malloc(length + 6);
+  if (out == NULL) { throw_fault("not enough memory to load program"); }
+
+  strcpy(out, fpath);
+  if (length >= 4 && strcmp(fpath + length - 4, ".bpp") == 0) {
+    strcat(out, "c");
+  }
+  else {
+    strcat(out, ".bppc");
+  }
+  return out;
+}
+
+/*
+ * Checks that cached ops are ones lowering could have produced, so that a
+ * corrupt cache can never make a VM jump outside the code
+ */
+static int cache_valid_ops(const BFOp* ops, size_t length) {
+  /* The op after the unchecked copy of a loop, before which moves may be unchecked */
+  size_t ranged_until = 0;
+
+  for (size_t i=0; i<length; i++) {
+    const BFOp* op = &ops[i];
+    int64_t target = (int64_t) i + op->as.arg;
+
+    switch (op->code) {
+      case OP_OPEN_LOOP:
+      case OP_OPEN_FN:
+        if (op->as.arg <= 0 || target >= (int64_t) length) { return 0; }
+        if (ops[target].code != op->code + 1 || ops[target].as.arg != -op->as.arg) { return 0; }
+        break;
+
+      case OP_CLOSE_LOOP:
+      case OP_CLOSE_FN:
+        if (op->as.arg >= 0 || target < 0) { return 0; }
+        if (ops[target].code != op->code - 1) { return 0; }
+        break;
+
+      case OP_CLEAR:
+      case OP_MUL_LOOP:
+        if (op->as.loop.skip <= 0 || (int64_t) i + op->as.loop.skip > (int64_t) length) { return 0; }
+        break;
+
+      case OP_INLINE:
+        /* Ends at an OP_INLINE_END, and was copied from a function body */
+        target = (int64_t) i + op->as.inlined.def;
+        if (op->as.inlined.skip <= 0 || (int64_t) i + op->as.inlined.skip >= (int64_t) length) { return 0; }
+        if (ops[i+op->as.inlined.skip].code != OP_INLINE_END) { return 0; }
+        if (target < 0 || target >= (int64_t) length || ops[target].code != OP_OPEN_FN) { return 0; }
+        break;
+
+      case OP_INLINE_END:
+        /* Only ever followed by the call it replaces */
+        if (op->as.arg <= 0 || i + 1 >= length) { return 0; }
+        if (ops[i+1].code != OP_CALL && ops[i+1].code != OP_TAIL_CALL) { return 0; }
+        break;
+
+      case OP_RANGE: {
+        /* Followed by an unchecked copy of the loop after it, reaching no further than checked */
+        int16_t min, max;
+        size_t skip = (size_t) op->as.loop.skip;
+        if (op->as.loop.skip <= 0 || i + skip + 1 >= length || i < ranged_until) { return 0; }
+        if (ops[i+1].code != OP_OPEN_LOOP || ops[i+1].as.arg != op->as.loop.skip - 1) { return 0; }
+        if (ops[i+skip+1].code != OP_OPEN_LOOP) { return 0; }
+        if (!loop_range(ops, i + 1, &min, &max) || min < op->as.loop.min || max > op->as.loop.max) { return 0; }
+        ranged_until = i + skip + 1;
+      } break;
+
+      case OP_MOVE_UNCHECKED:
+        if (i >= ranged_until) { return 0; }
+        break;
+
+      case OP_TAIL_CALL:
+        /* Only ever the last op of a function body */
+        if (i + 1 >= length || ops[i+1].code != OP_CLOSE_FN) { return 0; }
+        break;
+
+      case OP_ADD:
+      case OP_MOVE:
+      case OP_GET_CHAR:
+      case OP_PUT_CHAR:
+      case OP_CALL:
+      case OP_MUL_TERM:
+        break;
+
+      default:
+        return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Maps the ops of a cache into memory, if it exists and matches the source.
+ * Returns 1 if 'code' has been set to them
+ */
+static int cache_read(const char* path, const BFSource* source, uint64_t hash, BFCode* code) {
+#ifndef _WIN32
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) { return 0; }
+
+  struct stat st;
+  BPPCHeader header;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(BPPCHeader)
+    || read(fd, &header, sizeof(BPPCHeader)) != (ssize_t) sizeof(BPPCHeader)) {
+    close(fd);
+    return 0;
+  }
+
+  if (memcmp(header.magic, "BPPC", 4) != 0 || header.version != BPPC_VERSION || header.op_size != sizeof(BFOp)
+    || header.source_hash != hash || header.source_length != source->length || header.op_count == 0
+    || (uint64_t) st.st_size != sizeof(BPPCHeader) + header.op_count * sizeof(BFOp)) {
+    close(fd);
+    return 0;
+  }
+
+  void* map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) { return 0; }
+
+  BFOp* ops = (BFOp*) ((uint8_t*) map + sizeof(BPPCHeader));
+  if (hash_bytes((const char*) ops, (size_t) header.op_count * sizeof(BFOp)) != header.ops_hash
+    || !cache_valid_ops(ops, (size_t) header.op_count)) {
+    munmap(map, (size_t) st.st_size);
+    return 0;
+  }
+
+  code->ops = ops;
+  code->length = (size_t) header.op_count;
+  code->threads = NULL;
+  code->native = NULL;
+  code->offsets = NULL;
+  code->flags = 0;
+  return 1;
+#else
+  /* Without mmap, reading the cache would be little quicker than lexing */
+  (void) path;
+  (void) source;
+  (void) hash;
+  (void) code;
+  return 0;
+#endif
+}
+
+/*
+ * Writes the cache of lowered code, to a temporary file renamed into place so
+ * that other runs never see it half written; the temporary file is named after
+ * the process, so that runs writing the cache at once each write their own.
+ * Failures are ignored, leaving no cache, e.g. if the source is in a read-only
+ * directory.
+ */
+static void cache_write(const char* path, const BFSource* source, uint64_t hash, const BFCode* code) {
+  BPPCHeader header;
+  memset(&header, 0, sizeof(BPPCHeader));
+  memcpy(header.magic, "BPPC", 4);
+  header.version = BPPC_VERSION;
+  header.op_size = sizeof(BFOp);
+  header.source_hash = hash;
+  header.source_length = source->length;
+  header.op_count = code->length;
+  header.ops_hash = hash_bytes((const char*) code->ops, code->length * sizeof(BFOp));
+
+  char* tmp = (char*) malloc(strlen(path) + 32);
+  if (tmp == NULL) { return; }
+  sprintf(tmp, "%s.%ld.tmp", path, (long) getpid());
+
+  FILE* f = fopen(tmp, "wb");
+  if (f == NULL) {
+    free(tmp);
+    return;
+  }
+  int ok = fwrite(&header, sizeof(BPPCHeader), 1, f) == 1
+    && fwrite(code->ops, sizeof(BFOp), code->length, f) == code->length;
+  ok = (fclose(f) == 0) && ok;
+
+#ifdef _WIN32
+  remove(path);
+#endif
+  if (!ok || rename(tmp, path) != 0) {
+    remove(tmp);
+  }
+  free(tmp);
+}
+
+/*
+ * Loads the lowered code of a source file into 'code', which should be empty.
+ *
+ * If 'use_cache' is set and the file's cache matches it, the ops are mapped
+ * from the cache; otherwise the source is lexed and lowered, and the cache
+ * (re)written if 'use_cache' is set.
+ *
+ * Returns -1 if the file is not found, 1 if the ops are mapped from the cache,
+ * to be released by cache_release() rather than freed with the code, or 0.
+ */
+int cache_load(const char* fpath, BFCode* code, int use_cache) {
+  BFSource source;
+  if (source_open(fpath, &source) == -1) {
+    return -1;
+  }
+
+  if (!use_cache) {
+    BFInstructions insts = { NULL, 0, NULL };
+    lex_memory(source.src, source.length, &insts);
+    source_close(&source);
+
+    lower_instructions(&insts, code);
+    free(insts.insts);
+    return 0;
+  }
+
+  uint64_t hash = hash_bytes(source.src, source.length);
+  char* path = cache_path(fpath);
+
+  if (cache_read(path, &source, hash, code)) {
+    source_close(&source);
+    free(path);
+    return 1;
+  }
+
+  BFInstructions insts = { NULL, 0, NULL };
+  lex_memory(source.src, source.length, &insts);
+  lower_instructions(&insts, code);
+  free(insts.insts);
+
+  if (code->length > 0) {
+    cache_write(path, &source, hash, code);
+  }
+
+  source_close(&source);
+  free(path);
+  return 0;
+}
+
+/*
+ * Unmaps ops mapped from a cache by cache_load(), leaving the code empty
+ */
+void cache_release(BFCode* code) {
+#ifndef _WIN32
+  munmap((uint8_t*) code->ops - sizeof(BPPCHeader), sizeof(BPPCHeader) + code->length * sizeof(BFOp));
+#endif
+  code->ops = NULL;
+  code->length = 0;
+}
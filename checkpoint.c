@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+#include "bfplusplus.h"
+
+/*
+ * Checkpoints of a run (--checkpoint), from which a run killed part way
+ * through can be carried on (--resume) rather than started over.
+ *
+ * A checkpoint holds all the state of a run: the VM of each call in progress,
+ * from the main program's down to the call running, with its instruction
+ * pointer, tape pointer and the cells of its tape, along with how many bytes
+ * of input the run has read and of output it has written. Only the cells up to
+ * each tape's length are kept, those beyond always being zero, and a function
+ * cell as the index of the { that defined it, which the resumed run defines
+ * again; so a checkpoint takes little more room than the tapes themselves. The
+ * memo table (--memo) is not kept, a resumed run starting with an empty one.
+ *
+ * The checkpointing core (bfcore.h) takes checkpoints at a ] or a call, once
+ * every 'interval' of them if set, or once asked to by SIGUSR2, when each VM
+ * is between ops. The checkpoint is written by a forked copy of the process,
+ * which sees the run's memory just as it was when forked while the run itself
+ * carries straight on. It is written under a temporary name and renamed into
+ * place, so that a run killed while one is being written still leaves the
+ * last whole checkpoint. One falling due while the last is still being written
+ * is put off until that one is done. Without fork() (on Windows), the run
+ * waits for it to be written instead.
+ */
+#define BPPS_VERSION 1
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t op_size;
+  uint32_t cell_size;
+  uint64_t ops_hash;
+  uint64_t op_count;
+  uint64_t max_length;
+  uint64_t initial_length;
+  double grow_rate;
+  uint64_t max_depth;
+  uint64_t input_read;
+  uint64_t output_written;
+  uint64_t vm_count;
+} BPPSHeader;
+
+/*
+ * A VM of a checkpoint, with its positions as indexes: of ops of the program
+ * for 'ip' and 'fn', the { of the function it runs (or FN_MAIN for the main
+ * program), and of cells of its tape otherwise. It is followed by the values
+ * of its cells up to its tape length, then the bits of those that are
+ * functions, then the index of the { of each function cell in turn.
+ */
+#define FN_MAIN UINT64_MAX
+
+typedef struct {
+  uint64_t fn;
+  uint64_t ip;
+  uint64_t ptr;
+  uint64_t tape_length;
+  uint64_t inline_index;
+  uint64_t inline_length;
+  uint32_t res_count;
+  uint32_t lead_count;
+  uint32_t leads[TAIL_MAX_LEADS];
+} BPPSFrame;
+
+/* The checkpoint SIGUSR2 asks for */
+static BFCheckpoint* signalled = NULL;
+
+#ifdef SIGUSR2
+static void checkpoint_signal(int sig) {
+  (void) sig;
+  if (signalled != NULL) { signalled->requested = 1; }
+}
+#endif
+
+/*
+ * Creates the checkpoints of a run, written to 'path' every 'interval' ] and
+ * calls (or only when asked if 0) and whenever the process gets SIGUSR2
+ */
+BFCheckpoint* checkpoint_create(const char* path, uint64_t interval) {
+  BFCheckpoint* checkpoint = (BFCheckpoint*) malloc(sizeof(BFCheckpoint));
+  if (checkpoint == NULL) { throw_fault("not enough memory for checkpoints"); }
+
+  checkpoint->path = path;
+  checkpoint->interval = interval;
+  checkpoint->countdown = (interval > 0) ? interval : UINT64_MAX;
+  checkpoint->requested = 0;
+  checkpoint->writer = 0;
+  checkpoint->resume = NULL;
+
+  signalled = checkpoint;
+#ifdef SIGUSR2
+  signal(SIGUSR2, checkpoint_signal);
+#endif
+  return checkpoint;
+}
+
+/*
+ * Writes a checkpoint of the run whose call running is in 'vm', to a temporary
+ * file renamed into place. Returns 0 if it could not be written.
+ */
+static int checkpoint_write(const BFVM* vm, const char* path) {
+  const BFVM* global = vm->global;
+  size_t cell_size = vm->config.cell_size;
+
+  size_t count = 0;
+  for (const BFVM* v = vm; v != NULL; v = v->parent) {
+    count++;
+  }
+  const BFVM** vms = (const BFVM**) malloc(sizeof(BFVM*) * count);
+  char* tmp = (char*) malloc(strlen(path) + 5);
+  if (vms == NULL || tmp == NULL) { return 0; }
+
+  /* From the main program down */
+  size_t k = count;
+  for (const BFVM* v = vm; v != NULL; v = v->parent) {
+    vms[--k] = v;
+  }
+
+  BPPSHeader header;
+  memset(&header, 0, sizeof(BPPSHeader));
+  memcpy(header.magic, "BPPS", 4);
+  header.version = BPPS_VERSION;
+  header.op_size = sizeof(BFOp);
+  header.cell_size = (uint32_t) cell_size;
+  header.ops_hash = hash_bytes((const char*) global->code.ops, global->code.length * sizeof(BFOp));
+  header.op_count = global->code.length;
+  header.max_length = vm->config.max_length;
+  header.initial_length = vm->config.initial_length;
+  header.grow_rate = vm->config.grow_rate;
+  header.max_depth = vm->config.max_depth;
+  io_counts(&header.input_read, &header.output_written);
+  header.vm_count = count;
+
+  sprintf(tmp, "%s.tmp", path);
+  FILE* f = fopen(tmp, "wb");
+  if (f == NULL) {
+    free(vms);
+    free(tmp);
+    return 0;
+  }
+  int ok = fwrite(&header, sizeof(BPPSHeader), 1, f) == 1;
+
+  for (k=0; k<count && ok; k++) {
+    const BFVM* v = vms[k];
+    BPPSFrame frame;
+    memset(&frame, 0, sizeof(BPPSFrame));
+    frame.fn = (v->fn != NULL) ? (uint64_t) (v->fn->code.ops - 1 - global->code.ops) : FN_MAIN;
+    frame.ip = (uint64_t) (v->ip - global->code.ops);
+    frame.ptr = VM_INDEX(v);
+    frame.tape_length = v->tape_length;
+    frame.inline_index = v->inline_index;
+    frame.inline_length = v->inline_length;
+    frame.res_count = v->res_count;
+    frame.lead_count = v->lead_count;
+    memcpy(frame.leads, v->leads, sizeof(frame.leads));
+
+    size_t bytes = (v->tape_length + 7) / 8;
+    ok = fwrite(&frame, sizeof(BPPSFrame), 1, f) == 1
+      && fwrite(v->tape, cell_size, v->tape_length, f) == v->tape_length
+      && fwrite(v->fn_bits, 1, bytes, f) == bytes;
+
+    for (size_t i=0; i<v->tape_length && ok; i++) {
+      if (VM_IS_FN(v, i)) {
+        uint64_t def = (uint64_t) (vm_get_fn(v, i)->code.ops - 1 - global->code.ops);
+        ok = fwrite(&def, sizeof(uint64_t), 1, f) == 1;
+      }
+    }
+  }
+  ok = (fclose(f) == 0) && ok;
+
+#ifdef _WIN32
+  remove(path);
+#endif
+  if (!ok || rename(tmp, path) != 0) {
+    remove(tmp);
+    ok = 0;
+  }
+  free(vms);
+  free(tmp);
+  return ok;
+}
+
+/*
+ * The ] and calls after which a checkpoint due while the last is still being
+ * written asks again whether that one is done
+ */
+#define CHECKPOINT_RETRY 4096
+
+/*
+ * Waits for the checkpoint being written by a forked copy of the process, if
+ * any, reporting whether it could be. Unless 'block' is set, only checks
+ * whether it has been, giving 0 if it is still being written.
+ */
+static int checkpoint_wait(BFCheckpoint* checkpoint, int block) {
+#ifndef _WIN32
+  if (checkpoint->writer == 0) { return 1; }
+
+  int status = 0;
+  pid_t pid;
+  while ((pid = waitpid((pid_t) checkpoint->writer, &status, block ? 0 : WNOHANG)) == -1 && errno == EINTR) {}
+  if (pid == 0) { return 0; }
+
+  checkpoint->writer = 0;
+  if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Could not write checkpoint to %s\n", checkpoint->path);
+  }
+#else
+  (void) checkpoint;
+  (void) block;
+#endif
+  return 1;
+}
+
+/*
+ * Takes a checkpoint of the run whose call running is in 'vm', which is at the
+ * op about to be run (see CHECKPOINT_POLL in bfcore.h), and starts counting
+ * down to the next.
+ *
+ * The output so far is written out first, so that it all comes before the
+ * checkpoint. Only one checkpoint is written at once, so one due while the
+ * last is still being written is put off, the run carrying on and asking
+ * again after CHECKPOINT_RETRY more ] and calls rather than waiting for it.
+ */
+void checkpoint_take(BFVM* vm) {
+  BFCheckpoint* checkpoint = vm->checkpoint;
+  checkpoint->requested = 0;
+
+  if (!checkpoint_wait(checkpoint, 0)) {
+    checkpoint->countdown = (checkpoint->interval > 0 && checkpoint->interval < CHECKPOINT_RETRY)
+      ? checkpoint->interval : CHECKPOINT_RETRY;
+    return;
+  }
+  checkpoint->countdown = (checkpoint->interval > 0) ? checkpoint->interval : UINT64_MAX;
+
+  io_flush();
+
+#ifndef _WIN32
+  pid_t pid = fork();
+  if (pid == 0) {
+    _exit(checkpoint_write(vm, checkpoint->path) ? 0 : 1);
+  }
+  if (pid > 0) {
+    checkpoint->writer = (long) pid;
+    return;
+  }
+  /* Otherwise write it from the run itself */
+#endif
+
+  if (!checkpoint_write(vm, checkpoint->path)) {
+    fprintf(stderr, "Could not write checkpoint to %s\n", checkpoint->path);
+  }
+}
+
+/* Reads from a checkpoint, faulting if it ends early */
+static void checkpoint_read(FILE* f, void* out, size_t size) {
+  if (size > 0 && fread(out, size, 1, f) != 1) { throw_fault("checkpoint is not valid"); }
+}
+
+/*
+ * The function defined by the { at an index of the program, created the first
+ * time it is needed and kept in 'fns' (by the index of its {) for the cells
+ * holding it to share. Faults if there is no { there.
+ */
+static BFFn* checkpoint_fn(BFVM* vm, BFFn** fns, uint64_t def) {
+  const BFCode* code = &vm->code;
+  if (def >= code->length || code->ops[def].code != OP_OPEN_FN) { throw_fault("checkpoint is not valid"); }
+
+  if (fns[def] == NULL) {
+    const BFOp* op = &code->ops[def];
+    BFCode body = { (BFOp*) op + 1, (size_t) op->as.arg - 1, NULL, NULL, NULL, op->as.def.flags };
+    if (code->threads != NULL) {
+      body.threads = code->threads + (def + 1);
+    }
+    fns[def] = fn_create(&body, vm->fns);
+  }
+  return fns[def];
+}
+
+/*
+ * Restores the run of a checkpoint written by checkpoint_write() into 'vm', a
+ * main program's VM with the same program and tape config as the run it was
+ * taken of, and nothing run yet. The input the run had read is skipped (see
+ * io_resume()). The VM should then be run with vm_run(), which carries on in
+ * the call that was running (see 'resume').
+ *
+ * Faults if the checkpoint cannot be read, was taken of another program or
+ * tape config, or is not one that a run could have written.
+ */
+void checkpoint_restore(BFVM* vm, const char* path) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) { throw_fault("could not read checkpoint"); }
+
+  BPPSHeader header;
+  checkpoint_read(f, &header, sizeof(BPPSHeader));
+  if (memcmp(header.magic, "BPPS", 4) != 0 || header.version != BPPS_VERSION || header.op_size != sizeof(BFOp)
+    || header.vm_count == 0 || header.vm_count - 1 > vm->config.max_depth) {
+    throw_fault("checkpoint is not valid");
+  }
+  if (header.cell_size != vm->config.cell_size || header.max_length != vm->config.max_length
+    || header.initial_length != vm->config.initial_length || header.grow_rate != vm->config.grow_rate
+    || header.max_depth != vm->config.max_depth || header.op_count != vm->code.length
+    || header.ops_hash != hash_bytes((const char*) vm->code.ops, vm->code.length * sizeof(BFOp))) {
+    throw_fault("checkpoint was taken of another program or with other tape options");
+  }
+
+  /*
+   * Resolve the handlers of the whole program first, as code_prepare() does,
+   * for the functions defined below to share
+   */
+  vm->ip = vm->code.ops + vm->code.length;
+  vm_run(vm);
+
+  BFFn** fns = (BFFn**) calloc(vm->code.length, sizeof(BFFn*));
+  uint8_t* bits = (uint8_t*) malloc((vm->config.max_length + 7) / 8);
+  if (fns == NULL || bits == NULL) { throw_fault("not enough memory to resume checkpoint"); }
+
+  BFVM* current = vm;
+  for (uint64_t k=0; k<header.vm_count; k++) {
+    BPPSFrame frame;
+    checkpoint_read(f, &frame, sizeof(BPPSFrame));
+    if (frame.tape_length == 0 || frame.tape_length > vm->config.max_length || frame.ptr >= frame.tape_length
+      || frame.inline_index >= frame.tape_length || frame.inline_length > frame.tape_length
+      || frame.lead_count > TAIL_MAX_LEADS || frame.res_count > UINT16_MAX) {
+      throw_fault("checkpoint is not valid");
+    }
+
+    /* Each call's frame goes above its parent's, the parent's tape length already set */
+    if (k > 0) {
+      if (frame.fn == FN_MAIN) { throw_fault("checkpoint is not valid"); }
+      current = vm_push_frame(current);
+      current->fn = fn_retain(checkpoint_fn(vm, fns, frame.fn));
+      current->code = current->fn->code;
+    }
+    else if (frame.fn != FN_MAIN) {
+      throw_fault("checkpoint is not valid");
+    }
+
+    /* Calls were made from the op of each VM but the last, which is at a ] or call */
+    BFOp* ip = vm->code.ops + frame.ip;
+    if (frame.ip >= vm->code.length || ip < current->code.ops || ip >= current->code.ops + current->code.length) {
+      throw_fault("checkpoint is not valid");
+    }
+    int last = (k + 1 == header.vm_count);
+    if (ip->code != OP_CALL && ip->code != OP_TAIL_CALL && !(last && ip->code == OP_CLOSE_LOOP)) {
+      throw_fault("checkpoint is not valid");
+    }
+    if (!last && frame.ptr + ip->as.call.res_count >= frame.tape_length && frame.tape_length < vm->config.max_length) {
+      throw_fault("checkpoint is not valid");
+    }
+    current->ip = ip;
+
+    current->tape_length = (size_t) frame.tape_length;
+    current->ptr = current->tape + frame.ptr * vm->config.cell_size;
+    current->inline_index = (size_t) frame.inline_index;
+    current->inline_length = (size_t) frame.inline_length;
+    current->res_count = (uint16_t) frame.res_count;
+    current->lead_count = (uint16_t) frame.lead_count;
+    memcpy(current->leads, frame.leads, sizeof(current->leads));
+
+    size_t length = current->tape_length;
+    checkpoint_read(f, current->tape, length * vm->config.cell_size);
+    checkpoint_read(f, bits, (length + 7) / 8);
+    for (size_t i=0; i<length; i++) {
+      if ((bits[i >> 3] >> (i & 7)) & 1) {
+        uint64_t def;
+        checkpoint_read(f, &def, sizeof(uint64_t));
+        BFCell cell = { TYPE_FN, { .FN = fn_retain(checkpoint_fn(vm, fns, def)) } };
+        vm_set_cell(current, i, cell);
+      }
+    }
+  }
+  fclose(f);
+
+  /* The cells and calls now hold their own references to the functions */
+  for (size_t i=0; i<vm->code.length; i++) {
+    if (fns[i] != NULL) { fn_release(fns[i]); }
+  }
+  free(fns);
+  free(bits);
+
+  io_resume(header.input_read, header.output_written);
+  vm->checkpoint->resume = current;
+}
+
+/*
+ * Waits for the last checkpoint to be written, and frees the checkpoints of a
+ * run
+ */
+void checkpoint_free(BFCheckpoint* checkpoint) {
+  checkpoint_wait(checkpoint, 1);
+#ifdef SIGUSR2
+  signal(SIGUSR2, SIG_DFL);
+#endif
+  signalled = NULL;
+  free(checkpoint);
+}
@@ -0,0 +1,315 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bfplusplus.h"
+
+/*
+ * Ahead-of-time compilation of a lowered program to a standalone C file, which
+ * links against the runtime in bfruntime.c, bfvm.c and utils.c (and rawmode.c)
+ * to give a native binary with no interpretation at all.
+ *
+ * Each function body becomes a C function taking the BFVM, as does the main
+ * program, and loops become while loops. The generated file supplies its own
+ * vm_run(), which runs the C function of the VM's code, stored as its
+ * 'native' entry point just as for the JIT. Definitions, calls (with their '
+ * and @ scopes), idiom loops, tape growth and faults all go through the same
+ * runtime as the interpreters, so behaviour is the same.
+ *
+ * Calls do not recurse on the C stack, which would overflow long before the
+ * maximum depth. As in the interpreters (bfcore.h), a call is started with
+ * vm_call_enter() (or vm_call_tail()) and its VM returned from the C function,
+ * for vm_run() to carry on in, and the end of a function's code returns to
+ * its parent with vm_call_return(). The C function of the caller is then run
+ * again, from just after the call: the body of each is a switch on the point
+ * to carry on from, kept in the VM's 'ip' (unused by compiled code otherwise,
+ * and so 0 at the start of a call), with a case after each call.
+ *
+ * The generated file is specialised for the tape config it is emitted with,
+ * its cells being accessed as 'bf_cell' of the chosen width.
+ */
+
+/*
+ * The start of every generated file: the checks done for each op by the
+ * interpreters, as macros so that the generated code stays readable
+ */
+static const char* prelude =
+  "#define CELL (*(bf_cell*) vm->ptr)\n"
+  "#define TP_INDEX ((size_t) (vm->ptr - vm->tape) / sizeof(bf_cell))\n"
+  "#define ISVALUE (!VM_IS_FN(vm, TP_INDEX))\n"
+  "#define ISZERO (CELL == 0 && ISVALUE)\n"
+  "\n"
+  "#define ADD(n) \\\n"
+  "  do { \\\n"
+  "    if (!ISVALUE) { throw_fault((n) > 0 ? \"+ operation not valid on function\" : \"- operation not valid on function\"); } \\\n"
+  "    CELL += (bf_cell) (n); \\\n"
+  "  } while (0)\n"
+  "\n"
+  "#define MOVE_LEFT(n) \\\n"
+  "  do { \\\n"
+  "    if (TP_INDEX < (size_t) (n)) { throw_fault(\"< operator took pointer beyond valid region\"); } \\\n"
+  "    vm->ptr -= (n) * sizeof(bf_cell); \\\n"
+  "  } while (0)\n"
+  "\n"
+  "#define MOVE_RIGHT(n) \\\n"
+  "  do { \\\n"
+  "    if (vm->config.max_length - TP_INDEX <= (size_t) (n)) { throw_fault(\"> operator took pointer beyond valid region\"); } \\\n"
+  "    vm->ptr += (n) * sizeof(bf_cell); \\\n"
+  "    while (TP_INDEX >= vm->tape_length) { vm_grow_tape(vm); } \\\n"
+  "  } while (0)\n"
+  "\n"
+  "#define GET_CHAR(n) \\\n"
+  "  do { \\\n"
+  "    if (!ISVALUE) { throw_fault(\", operation not valid on function\"); } \\\n"
+  "    for (int32_t i=0; i<(n); i++) { CELL = b_getchar(vm); } \\\n"
+  "  } while (0)\n"
+  "\n"
+  "#define PUT_CHAR(n) \\\n"
+  "  do { \\\n"
+  "    if (!ISVALUE) { throw_fault(\". operation not valid on function\"); } \\\n"
+  "    for (int32_t i=0; i<(n); i++) { b_putchar(vm, CELL); } \\\n"
+  "  } while (0)\n"
+  "\n"
+  "/* Idiom ops, giving 0 if the original loop that follows should run instead */\n"
+  "#define CLEAR() (ISVALUE ? (CELL = 0, 1) : 0)\n"
+  "#define MUL_LOOP(ops) vm_mul_loop(vm, ops)\n"
+  "\n"
+  "/* Range checks, giving 1 if the copy of a loop that follows may run without checks on its moves */\n"
+  "#define IN_RANGE(min, max) (TP_INDEX >= (size_t) -(min) && vm->tape_length - TP_INDEX > (size_t) (max))\n"
+  "#define MOVE_UNCHECKED(n) (vm->ptr += (n) * (int64_t) sizeof(bf_cell))\n"
+  "\n"
+  "#define DEFINE_FN(fn) \\\n"
+  "  do { \\\n"
+  "    BFCode body = { NULL, 0, NULL, (void*) fn, NULL, 0 }; \\\n"
+  "    vm_define_fn(vm, &body); \\\n"
+  "  } while (0)\n"
+  "\n"
+  "/*\n"
+  " * Calls return the VM of the call for vm_run() to carry on in, having kept\n"
+  " * the point to carry on from once it returns, where there is a case of the\n"
+  " * switch of the function's body\n"
+  " */\n"
+  "#define RESUME_POINT ((uintptr_t) vm->ip)\n"
+  "\n"
+  "#define CALL(args, results, scope, point) \\\n"
+  "  do { \\\n"
+  "    static const BFCallSite site = { args, results, scope }; \\\n"
+  "    vm->ip = (BFOp*) (uintptr_t) (point); \\\n"
+  "    return vm_call_enter(vm, vm_call_target(vm, &site), &site); \\\n"
+  "    case point:; \\\n"
+  "  } while (0)\n"
+  "\n"
+  "#define TAIL_CALL(args, results, scope, point) \\\n"
+  "  do { \\\n"
+  "    static const BFCallSite site = { args, results, scope }; \\\n"
+  "    vm->ip = (BFOp*) (uintptr_t) (point); \\\n"
+  "    return vm_call_tail(vm, vm_call_target(vm, &site), &site); \\\n"
+  "    case point:; \\\n"
+  "  } while (0)\n"
+  "\n";
+
+/*
+ * The end of every generated file: running the main program, as main.c does
+ */
+static const char* postlude =
+  "/*\n"
+  " * Every VM runs compiled code, whether the main program or a function body,\n"
+  " * carrying on in the VM of each call it makes until its code ends\n"
+  " */\n"
+  "void vm_run(BFVM* vm) {\n"
+  "  BFVM* entry = vm;\n"
+  "  for (;;) {\n"
+  "    BFVM* callvm = ((BFVM* (*)(BFVM*)) vm->code.native)(vm);\n"
+  "    if (callvm != NULL) {\n"
+  "      vm = callvm;\n"
+  "    }\n"
+  "    else if (vm == entry) {\n"
+  "      break;\n"
+  "    }\n"
+  "    else {\n"
+  "      vm = vm_call_return(vm);\n"
+  "    }\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "int main() {\n"
+  "  BFVM* vm = vm_create(&config);\n"
+  "  vm->code.native = (void*) bf_main;\n"
+  "\n"
+  "  io_init();\n"
+  "  enter_raw_mode();\n"
+  "  vm_run(vm);\n"
+  "  io_flush();\n"
+  "  exit_raw_mode();\n"
+  "  printf(\"\\n\");\n"
+  "\n"
+  "  vm_destroy(vm);\n"
+  "  return 0;\n"
+  "}\n";
+
+/* Print the indentation for the given depth of nesting */
+static void emit_indent(FILE* out, int depth) {
+  for (int i=0; i<depth; i++) {
+    fputs("  ", out);
+  }
+}
+
+/*
+ * Emits the ops [start, start + length) of the program as the C function
+ * 'name', which returns the VM of a call it makes, or NULL at the end of its
+ * code. Function bodies defined within are not emitted here, only referred
+ * to by the name of their own C function.
+ */
+static void emit_function(const BFCode* code, size_t start, size_t length, const char* name, FILE* out) {
+  const BFOp* ops = code->ops;
+  int depth = 2;
+  unsigned long points = 0;
+
+  /* Condition of an idiom op, to be put in front of the loop that follows */
+  char idiom[64] = "";
+
+  fprintf(out, "static BFVM* %s(BFVM* vm) {\n", name);
+  fputs("  switch (RESUME_POINT) {\n  case 0:\n", out);
+
+  for (size_t i=start; i<start+length; i++) {
+    const BFOp* op = &ops[i];
+
+    switch (op->code) {
+      case OP_ADD:
+        emit_indent(out, depth);
+        fprintf(out, "ADD(%ld);\n", (long) op->as.arg);
+        break;
+
+      case OP_MOVE:
+        emit_indent(out, depth);
+        if (op->as.arg < 0) { fprintf(out, "MOVE_LEFT(%ld);\n", -(long) op->as.arg); }
+        else { fprintf(out, "MOVE_RIGHT(%ld);\n", (long) op->as.arg); }
+        break;
+
+      case OP_GET_CHAR:
+        emit_indent(out, depth);
+        fprintf(out, "GET_CHAR(%ld);\n", (long) op->as.arg);
+        break;
+
+      case OP_PUT_CHAR:
+        emit_indent(out, depth);
+        fprintf(out, "PUT_CHAR(%ld);\n", (long) op->as.arg);
+        break;
+
+      case OP_OPEN_LOOP:
+        emit_indent(out, depth);
+        fprintf(out, "%swhile (!ISZERO) {\n", idiom);
+        idiom[0] = '\0';
+        depth++;
+        break;
+
+      case OP_CLOSE_LOOP:
+        depth--;
+        emit_indent(out, depth);
+        fputs("}\n", out);
+        break;
+
+      case OP_CLEAR:
+        strcpy(idiom, "if (!CLEAR()) ");
+        break;
+
+      case OP_MUL_LOOP:
+        sprintf(idiom, "if (!MUL_LOOP(bf_mul_%lu)) ", (unsigned long) i);
+        break;
+
+      case OP_MUL_TERM:
+        /* Emitted along with their OP_MUL_LOOP by emit_c() */
+        break;
+
+      case OP_RANGE:
+        sprintf(idiom, "if (IN_RANGE(%d, %d)) ", op->as.loop.min, op->as.loop.max);
+        break;
+
+      case OP_MOVE_UNCHECKED:
+        emit_indent(out, depth);
+        fprintf(out, "MOVE_UNCHECKED(%ld);\n", (long) op->as.arg);
+        break;
+
+      case OP_INLINE:
+        /* Only the call is emitted, which runs the same function body */
+        i += op->as.inlined.skip;
+        break;
+
+      case OP_INLINE_END:
+        /* Always skipped along with the copy of the function body */
+        break;
+
+      case OP_OPEN_FN:
+        emit_indent(out, depth);
+        fprintf(out, "DEFINE_FN(bf_fn_%lu);\n", (unsigned long) i);
+        i += op->as.arg;
+        break;
+
+      case OP_CALL:
+      case OP_TAIL_CALL:
+        emit_indent(out, depth);
+        fprintf(out, "%s(%u, %u, %ld, %lu);\n", (op->code == OP_TAIL_CALL) ? "TAIL_CALL" : "CALL",
+          (unsigned) op->as.call.arg_count, (unsigned) op->as.call.res_count, (long) op->as.call.scope, ++points);
+        break;
+
+      case OP_CLOSE_FN:
+        /* Close ops are always skipped along with their function bodies */
+        throw_fault("mismatched function/call end");
+        break;
+    }
+  }
+
+  fputs("  }\n  return NULL;\n}\n\n", out);
+}
+
+/*
+ * Writes a lowered program out as a standalone C file.
+ *
+ * The idiom ops of OP_MUL_LOOP are written as constant BFOp arrays, for
+ * vm_mul_loop() to run just as for the interpreters, other than those of the
+ * copies of inlined function bodies, which are not emitted.
+ */
+void emit_c(const BFCode* code, const BFTapeConfig* config, FILE* out) {
+  const BFOp* ops = code->ops;
+  char name[32];
+
+  fputs("/* Generated from a BF++ program by --emit-c */\n\n", out);
+  fputs("#include <stdio.h>\n\n#include \"bfplusplus.h\"\n#include \"rawmode.h\"\n\n", out);
+
+  fprintf(out, "typedef uint%lu_t bf_cell;\n\n", (unsigned long) config->cell_size * 8);
+  fprintf(out, "static const BFTapeConfig config = { %lu, %lu, %lu, %.17g, %lu };\n\n",
+    (unsigned long) config->cell_size, (unsigned long) config->max_length,
+    (unsigned long) config->initial_length, config->grow_rate, (unsigned long) config->max_depth);
+  fputs(prelude, out);
+
+  for (size_t i=0; i<code->length; i++) {
+    if (ops[i].code == OP_INLINE) { i += ops[i].as.inlined.skip; }
+    if (ops[i].code != OP_MUL_LOOP) { continue; }
+
+    fprintf(out, "static const BFOp bf_mul_%lu[] = {\n", (unsigned long) i);
+    fprintf(out, "  { OP_MUL_LOOP, { .loop = { %ld, %d, %d } } },\n", (long) ops[i].as.loop.skip, ops[i].as.loop.min, ops[i].as.loop.max);
+    for (size_t t=i+1; ops[t].code == OP_MUL_TERM; t++) {
+      fprintf(out, "  { OP_MUL_TERM, { .term = { %ld, %ld } } },\n", (long) ops[t].as.term.offset, (long) ops[t].as.term.factor);
+    }
+    fputs("  { OP_ADD, { 0 } },\n};\n\n", out);
+  }
+
+  for (size_t i=0; i<code->length; i++) {
+    if (ops[i].code == OP_OPEN_FN) {
+      fprintf(out, "static BFVM* bf_fn_%lu(BFVM* vm);\n", (unsigned long) i);
+    }
+  }
+  fputs("\n", out);
+
+  for (size_t i=0; i<code->length; i++) {
+    if (ops[i].code == OP_OPEN_FN) {
+      sprintf(name, "bf_fn_%lu", (unsigned long) i);
+      emit_function(code, i + 1, (size_t) ops[i].as.arg - 1, name, out);
+    }
+  }
+
+  emit_function(code, 0, code->length, "bf_main", out);
+
+  fputs(postlude, out);
+}
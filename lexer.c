@@ -1,113 +1,279 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define LEX_SIMD
+#endif
 
 #include "bfplusplus.h"
 
+/* Classes of source characters besides the instructions themselves */
+#define LEX_SKIP 0xFF
+#define LEX_LINE_COMMENT 0xFE
+#define LEX_BLOCK_COMMENT 0xFD
+
+/*
+ * The class of every byte of source: its BFInst if it is an instruction,
+ * otherwise one of the LEX_* classes above
+ */
+static unsigned char lex_table[256];
+static int lex_table_ready = 0;
+
+static void lex_init_table() {
+  memset(lex_table, LEX_SKIP, sizeof(lex_table));
+
+  lex_table['+'] = INST_PLUS;
+  lex_table['-'] = INST_MINUS;
+  lex_table['<'] = INST_MOVE_LEFT;
+  lex_table['>'] = INST_MOVE_RIGHT;
+  lex_table['['] = INST_OPEN_LOOP;
+  lex_table[']'] = INST_CLOSE_LOOP;
+  lex_table['('] = INST_OPEN_CALL;
+  lex_table[')'] = INST_CLOSE_CALL;
+  lex_table['\''] = INST_SCOPE_UP;
+  lex_table['@'] = INST_SCOPE_GLOBAL;
+  lex_table['{'] = INST_OPEN_FN;
+  lex_table['}'] = INST_CLOSE_FN;
+  lex_table[','] = INST_GET_CHAR;
+  lex_table['.'] = INST_PUT_CHAR;
+
+  /* Single line comments: ! ignores all characters until newline */
+  lex_table['!'] = LEX_LINE_COMMENT;
+  /* Multi line comments: all characters ignored between * and * */
+  lex_table['*'] = LEX_BLOCK_COMMENT;
+
+  lex_table_ready = 1;
+}
+
+/*
+ * Skips the run of ignored characters (whitespace, prose etc.) starting at p,
+ * returning the first character that may be significant, or end.
+ *
+ * With SSE2, 16 bytes are checked at a time against the ranges holding every
+ * significant character, ! to . < to @ [ to ] and { to }; a block may be
+ * stopped at by something in range that is ignored after all, e.g. =, which
+ * the caller then simply skips.
+ */
+static const unsigned char* lex_skip(const unsigned char* p, const unsigned char* end) {
+#ifdef LEX_SIMD
+/* Mask of the bytes of v within [lo, hi] */
+#define IN_RANGE(v, lo, hi) \
+  _mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8(v, _mm_set1_epi8(lo)), _mm_set1_epi8((hi) - (lo))), \
+    _mm_sub_epi8(v, _mm_set1_epi8(lo)))
+
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*) p);
+    __m128i hits = _mm_or_si128(
+      _mm_or_si128(IN_RANGE(v, '!', '.'), IN_RANGE(v, '<', '@')),
+      _mm_or_si128(IN_RANGE(v, '[', ']'), IN_RANGE(v, '{', '}')));
+    int mask = _mm_movemask_epi8(hits);
+
+    if (mask != 0) {
+      return p + __builtin_ctz((unsigned) mask);
+    }
+    p += 16;
+  }
+
+#undef IN_RANGE
+#endif
+
+  while (p < end && lex_table[*p] == LEX_SKIP) {
+    p++;
+  }
+  return p;
+}
+
+/*
+ * The single pass of lex_memory() over the source [p, end), writing each
+ * instruction to 'out' and, if 'offs' is not NULL, its offset from 'start' to
+ * 'offs'. Returns the end of the instructions written.
+ *
+ * Inlined into lex_memory() once with offsets and once without, so that the
+ * usual pass does not check for them on every instruction.
+ */
+static inline BFInst* lex_scan(const unsigned char* start, const unsigned char* p, const unsigned char* end, BFInst* out, uint32_t* offs) {
+  while (p < end) {
+    unsigned char class = lex_table[*p];
+
+    if (class < LEX_BLOCK_COMMENT) {
+      if (offs != NULL) {
+        *offs++ = (uint32_t) (p - start);
+      }
+      *out++ = (BFInst) class;
+      p++;
+    }
+    else if (class == LEX_SKIP) {
+      p = lex_skip(p + 1, end);
+    }
+    else if (class == LEX_LINE_COMMENT) {
+      const unsigned char* nl = (const unsigned char*) memchr(p + 1, '\n', (size_t) (end - p - 1));
+      p = (nl == NULL) ? end : nl + 1;
+    }
+    else {
+      const unsigned char* close = (const unsigned char*) memchr(p + 1, '*', (size_t) (end - p - 1));
+      if (close == NULL) { throw_fault("unterminated multi-line comment"); }
+      p = close + 1;
+    }
+  }
+  return out;
+}
+
+/*
+ * Lexes BF++ source held in memory, appending the results to an Instructions
+ * struct, ready to be lowered by lower_instructions(). If the struct has
+ * offsets, the offset of each instruction is appended to them too.
+ *
+ * Makes one pass over the source, classifying each character by lex_table.
+ * The instructions array is grown once up front to fit the whole source (no
+ * more instructions than characters) and shrunk to size at the end.
+ */
+void lex_memory(const char* src, size_t length, BFInstructions* insts) {
+  const unsigned char* p = (const unsigned char*) src;
+  const unsigned char* end = p + length;
+
+  if (!lex_table_ready) {
+    lex_init_table();
+  }
+
+  insts->insts = (BFInst*) realloc(insts->insts, sizeof(BFInst) * (insts->length + length + 1));
+  if (insts->insts == NULL) {
+    throw_fault("not enough memory to lex program");
+  }
+  BFInst* out = insts->insts + insts->length;
+
+  if (insts->offsets != NULL) {
+    insts->offsets = (uint32_t*) realloc(insts->offsets, sizeof(uint32_t) * (insts->length + length + 1));
+    if (insts->offsets == NULL) {
+      throw_fault("not enough memory to lex program");
+    }
+    out = lex_scan(p, p, end, out, insts->offsets + insts->length);
+  }
+  else {
+    out = lex_scan(p, p, end, out, NULL);
+  }
+
+  insts->length = (size_t) (out - insts->insts);
+  insts->insts = (BFInst*) realloc(insts->insts, sizeof(BFInst) * (insts->length + 1));
+  if (insts->offsets != NULL) {
+    insts->offsets = (uint32_t*) realloc(insts->offsets, sizeof(uint32_t) * (insts->length + 1));
+  }
+}
+
+/* The text of an empty source file, which is neither mapped nor allocated */
+static const char empty_source[] = "";
+
 /*
- * Lexes a file of BF++ source, putting the results into a VM's Instructions
- * struct, and also positioning the VM's instruction pointer to the first
- * instruction.
+ * Opens a source file, mapping it into memory where possible, otherwise
+ * reading it in whole (e.g. a pipe), to be closed by source_close().
  *
  * Returns -1 if the file is not found; otherwise 0
  */
-int lex_file(const char* fpath, BFVM* vm) {
-#define ADD_INST(vm, inst) \
-  do { \
-    vm->instructions.length++; \
-    vm->instructions.insts = (BFInst*) realloc(vm->instructions.insts, sizeof(BFInst) * vm->instructions.length); \
-    vm->instructions.insts[vm->instructions.length-1] = inst; \
-  } while (0)
-
-  FILE* f = fopen(fpath, "r");
+int source_open(const char* fpath, BFSource* source) {
+  source->src = empty_source;
+  source->length = 0;
+  source->mapped = 0;
+
+#ifndef _WIN32
+  int fd = open(fpath, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    if (st.st_size == 0) {
+      close(fd);
+      return 0;
+    }
+
+    void* map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      close(fd);
+      source->src = (const char*) map;
+      source->length = (size_t) st.st_size;
+      source->mapped = 1;
+      return 0;
+    }
+  }
+  close(fd);
+#endif
+
+  FILE* f = fopen(fpath, "rb");
   if (f == NULL) {
     return -1;
   }
 
-  int c;
-  while ((c = getc(f)) != EOF) {
-    switch ((char) c) {
-      case '+':
-        ADD_INST(vm, INST_PLUS);
-        break;
-
-      case '-':
-        ADD_INST(vm, INST_MINUS);
-        break;
-
-      case '<':
-        ADD_INST(vm, INST_MOVE_LEFT);
-        break;
-
-      case '>':
-        ADD_INST(vm, INST_MOVE_RIGHT);
-        break;
-
-      case '[':
-        ADD_INST(vm, INST_OPEN_LOOP);
-        break;
-
-      case ']':
-        ADD_INST(vm, INST_CLOSE_LOOP);
-        break;
-
-      case '(':
-        ADD_INST(vm, INST_OPEN_CALL);
-        break;
-
-      case ')':
-        ADD_INST(vm, INST_CLOSE_CALL);
-        break;
-
-      case '\'':
-        ADD_INST(vm, INST_SCOPE_UP);
-        break;
-
-      case '@':
-        ADD_INST(vm, INST_SCOPE_GLOBAL);
-        break;
-
-      case '{':
-        ADD_INST(vm, INST_OPEN_FN);
-        break;
-
-      case '}':
-        ADD_INST(vm, INST_CLOSE_FN);
-        break;
-
-      case ',':
-        ADD_INST(vm, INST_GET_CHAR);
-        break;
-
-      case '.':
-        ADD_INST(vm, INST_PUT_CHAR);
-        break;
-
-      /* Single line comments: ! ignores all characters until newline */
-      case '!':
-        c = getc(f);
-        while (!(c == EOF || c == '\n')) {
-          c = getc(f);
-        }
-        break;
-
-      /* Multi line comments: all characters ignored between * and * */
-      case '*':
-        c = getc(f);
-        while (!(c == EOF || c == '*')) {
-          c = getc(f);
-        }
-        if (c == EOF) { throw_fault("unterminated multi-line comment"); }
-        break;
-
-      default:
-        /* Ignore all other characters */
-        break;
+  char* src = NULL;
+  size_t length = 0;
+  size_t capacity = 0;
+  size_t n;
+  do {
+    if (length == capacity) {
+      capacity = (capacity == 0) ? 65536 : capacity * 2;
+      src = (char*) realloc(src, capacity);
+      if (src == NULL) { throw_fault("not enough memory to lex program"); }
     }
+    n = fread(src + length, 1, capacity - length, f);
+    length += n;
+  } while (n > 0);
+
+  fclose(f);
+
+  source->src = src;
+  source->length = length;
+  return 0;
+}
+
+/*
+ * Unmaps or frees a source file opened by source_open()
+ */
+void source_close(BFSource* source) {
+#ifndef _WIN32
+  if (source->mapped) {
+    munmap((void*) source->src, source->length);
+    return;
+  }
+#endif
+  if (source->src != empty_source) {
+    free((void*) source->src);
   }
+}
+
+/*
+ * Lexes a file of BF++ source, appending the results to an Instructions
+ * struct, ready to be lowered by lower_instructions(). A fault while lexing
+ * closes the file before carrying on to wherever faults unwind to.
+ *
+ * Returns -1 if the file is not found; otherwise 0
+ */
+int lex_file(const char* fpath, BFInstructions* insts) {
+  BFSource source;
+  if (source_open(fpath, &source) == -1) {
+    return -1;
+  }
+
+  jmp_buf target;
+  jmp_buf* previous = fault_catch(&target);
+  if (setjmp(target) != 0) {
+    fault_catch(previous);
+    source_close(&source);
+    throw_fault(fault_message());
+  }
+
+  lex_memory(source.src, source.length, insts);
 
-  vm->ip = vm->instructions.insts;
+  fault_catch(previous);
+  source_close(&source);
 
   return 0;
-#undef ADD_INST
 }
@@ -0,0 +1,176 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include "bfplusplus.h"
+
+/*
+ * The embedding API (libbfpp), for running BF++ programs within a long-lived
+ * process rather than through main.c.
+ *
+ * A program is loaded once from source in memory by program_load() (or from a
+ * file by program_load_file()), and can then be run by any number of VMs made
+ * by program_create_vm(), each of which is reset and reused by every
+ * program_run() rather than reallocated. Faults do not exit the process: they
+ * unwind (see fault_catch()) back to program_load() or program_run(), which
+ * free or reset whatever was in use and return an error code, along with the
+ * fault's message.
+ *
+ * Programs and VMs may be used on any thread, each VM by one thread at a time.
+ * Programs compiled by the JIT should be loaded and freed by one thread at a
+ * time, and VMs run without I/O callbacks share the process's stdin and stdout.
+ */
+
+/*
+ * Loads a program from source held in memory, or from the file at 'fpath' if
+ * not NULL, for program_load() and program_load_file()
+ */
+static BFStatus load(const char* src, size_t length, const char* fpath, const BFTapeConfig* config, BFEngine engine, BFProgram** program, const char** error) {
+  BFTapeConfig defaults = { CELL_SIZE, TAPE_MAX_LENGTH, TAPE_INITIAL_LENGTH, TAPE_GROW_RATE, FRAME_MAX_DEPTH };
+  *program = NULL;
+
+  BFProgram* out = (BFProgram*) calloc(1, sizeof(BFProgram));
+  BFInstructions* insts = (BFInstructions*) calloc(1, sizeof(BFInstructions));
+  if (out == NULL || insts == NULL) {
+    free(out);
+    free(insts);
+    if (error != NULL) { *error = "not enough memory to load program"; }
+    return BF_ERR_LOAD;
+  }
+
+  out->config = (config != NULL) ? *config : defaults;
+  out->engine = engine;
+#ifdef _WIN32
+  /* longjmp() unwinds through every frame on Windows, which compiled code cannot describe */
+  if (out->engine == ENGINE_JIT) {
+    out->engine = ENGINE_THREADED;
+  }
+#endif
+
+  jmp_buf target;
+  jmp_buf* previous = fault_catch(&target);
+  if (setjmp(target) != 0) {
+    fault_catch(previous);
+    if (error != NULL) { *error = fault_message(); }
+
+    free(insts->insts);
+    free(insts);
+    free(out->code.ops);
+    free(out->code.threads);
+    free(out);
+    return BF_ERR_LOAD;
+  }
+
+  if (fpath == NULL) {
+    lex_memory(src, length, insts);
+  }
+  else if (lex_file(fpath, insts) == -1) {
+    throw_fault("source file not found");
+  }
+  lower_instructions(insts, &out->code);
+  code_prepare(&out->code, &out->config, out->engine);
+
+  fault_catch(previous);
+
+  free(insts->insts);
+  free(insts);
+
+  *program = out;
+  return BF_OK;
+}
+
+/*
+ * Loads a program from source held in memory, lexing, lowering and preparing
+ * it for the given engine and tape config (or the defaults if NULL).
+ *
+ * Returns BF_OK, setting 'program', or BF_ERR_LOAD, setting 'error' (if not
+ * NULL) to the fault's message, e.g. for mismatched brackets.
+ */
+BFStatus program_load(const char* src, size_t length, const BFTapeConfig* config, BFEngine engine, BFProgram** program, const char** error) {
+  return load(src, length, NULL, config, engine, program, error);
+}
+
+/*
+ * Loads a program from a source file, as program_load() does from memory
+ */
+BFStatus program_load_file(const char* fpath, const BFTapeConfig* config, BFEngine engine, BFProgram** program, const char** error) {
+  return load(NULL, 0, fpath, config, engine, program, error);
+}
+
+/*
+ * Frees a program loaded by program_load(), which no VM may still be running
+ */
+void program_free(BFProgram* program) {
+  if (program->code.native != NULL) {
+    jit_release(program->code.native);
+  }
+  free(program->code.ops);
+  free(program->code.threads);
+  free(program);
+}
+
+/*
+ * Creates a VM to run a program (or any other with the same tape config), to be
+ * destroyed by vm_destroy(). Returns NULL if there is not enough memory.
+ */
+BFVM* program_create_vm(const BFProgram* program) {
+  jmp_buf target;
+  jmp_buf* previous = fault_catch(&target);
+  if (setjmp(target) != 0) {
+    fault_catch(previous);
+    return NULL;
+  }
+
+  BFVM* vm = vm_create(&program->config);
+  vm->engine = program->engine;
+
+  fault_catch(previous);
+  return vm;
+}
+
+/*
+ * Runs a program on a VM from program_create_vm(), starting from an empty tape
+ * whatever the VM ran before. The , and . operators use the I/O callbacks in
+ * 'io', or stdin and stdout if NULL.
+ *
+ * Returns BF_OK, leaving the VM's tape as the program left it, or BF_ERR_FAULT,
+ * setting 'error' (if not NULL) to the fault's message.
+ */
+BFStatus program_run(const BFProgram* program, BFVM* vm, const BFIO* io, const char** error) {
+  BFCode none = { NULL, 0, NULL, NULL, NULL, 0 };
+
+  if (vm->config.cell_size != program->config.cell_size || vm->config.max_length != program->config.max_length) {
+    if (error != NULL) { *error = "VM was not created for the program's tape config"; }
+    return BF_ERR_FAULT;
+  }
+
+  vm_reset(vm, 0);
+  vm->config = program->config;
+  vm->code = program->code;
+  vm->ip = vm->code.ops;
+  vm->engine = program->engine;
+  vm->io = io;
+
+  jmp_buf target;
+  jmp_buf* previous = fault_catch(&target);
+  if (setjmp(target) != 0) {
+    fault_catch(previous);
+    if (error != NULL) { *error = fault_message(); }
+
+    vm_reset(vm, 1);
+    vm->code = none;
+    vm->io = NULL;
+    return BF_ERR_FAULT;
+  }
+
+  vm_run(vm);
+
+  fault_catch(previous);
+
+  /* The code is the program's, and must not be freed with the VM */
+  vm->code = none;
+  vm->io = NULL;
+  return BF_OK;
+}
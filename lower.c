@@ -0,0 +1,991 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bfplusplus.h"
+
+/*
+ * Appends an op to the code, growing the ops array geometrically so that
+ * lowering large programs does not realloc once per op. If the code has
+ * offsets, they are grown along with the ops and the op's source offset is
+ * recorded.
+ *
+ * Returns the new op, with its code set and arg zeroed, for the caller to fill
+ */
+static BFOp* code_push(BFCode* code, size_t* capacity, BFOpCode opcode, uint32_t offset) {
+  if (code->length == *capacity) {
+    *capacity = (*capacity == 0) ? 64 : *capacity * 2;
+    code->ops = (BFOp*) realloc(code->ops, sizeof(BFOp) * *capacity);
+    if (code->ops == NULL) {
+      throw_fault("not enough memory to lower program");
+    }
+    if (code->offsets != NULL) {
+      code->offsets = (uint32_t*) realloc(code->offsets, sizeof(uint32_t) * *capacity);
+      if (code->offsets == NULL) {
+        throw_fault("not enough memory to lower program");
+      }
+    }
+  }
+  if (code->offsets != NULL) {
+    code->offsets[code->length] = offset;
+  }
+  BFOp* op = &code->ops[code->length++];
+  memset(op, 0, sizeof(BFOp));
+  op->code = opcode;
+  return op;
+}
+
+/*
+ * Resolves every [/] and {/} pair of the lowered code once, storing the
+ * relative distance to the matching op in the arg of both ops of the pair: the
+ * open op gets a positive distance and the close op a negative one. Because
+ * the distances are relative, they remain valid in copies of function bodies.
+ *
+ * Brackets of different kinds must nest properly; any mismatch is reported as
+ * a fault here, before the program starts running.
+ */
+static void match_brackets(BFCode* code) {
+  size_t* stack = NULL;
+  size_t stack_length = 0;
+  size_t stack_capacity = 0;
+
+  for (size_t i=0; i<code->length; i++) {
+    BFOp* op = &code->ops[i];
+
+    switch (op->code) {
+      case OP_OPEN_LOOP:
+      case OP_OPEN_FN:
+        if (stack_length == stack_capacity) {
+          stack_capacity = (stack_capacity == 0) ? 16 : stack_capacity * 2;
+          stack = (size_t*) realloc(stack, sizeof(size_t) * stack_capacity);
+          if (stack == NULL) { throw_fault("maximum possible bracket depth exceeded"); }
+        }
+        stack[stack_length++] = i;
+        break;
+
+      case OP_CLOSE_LOOP:
+      case OP_CLOSE_FN: {
+        BFOpCode open = (op->code == OP_CLOSE_LOOP) ? OP_OPEN_LOOP : OP_OPEN_FN;
+
+        if (stack_length == 0 || code->ops[stack[stack_length-1]].code != open) {
+          free(stack);
+          if (open == OP_OPEN_LOOP) { throw_fault("mismatched loop brackets"); }
+          else { throw_fault("mismatched function def brackets"); }
+        }
+
+        size_t match = stack[--stack_length];
+        code->ops[match].as.arg = (int32_t) (i - match);
+        op->as.arg = -(int32_t) (i - match);
+      } break;
+
+      default:
+        break;
+    }
+  }
+
+  if (stack_length != 0) {
+    BFOpCode open = code->ops[stack[stack_length-1]].code;
+    free(stack);
+    if (open == OP_OPEN_LOOP) { throw_fault("mismatched loop brackets"); }
+    else { throw_fault("mismatched function def brackets"); }
+  }
+
+  free(stack);
+}
+
+/*
+ * The most ops of a loop to copy for running without checks on its moves (see
+ * check_ranges())
+ */
+#define RANGE_MAX_OPS 256
+
+/*
+ * Finds the lowest and highest offsets from the [ at 'open' that the pointer
+ * can reach within its loop, if the loop and each loop within it leave the
+ * pointer where they started, and it makes no calls or definitions: the
+ * pointer's offset from the [ is then the same at each op on every iteration.
+ * Returns 0 if not, or if the loop is longer than RANGE_MAX_OPS or reaches
+ * offsets beyond an int16_t.
+ *
+ * Also checks the ranges of a cache (cache.c), so the jumps within the loop
+ * are checked too: each bracket must jump to its pair, and each idiom op to
+ * the ] of the loop that follows it.
+ */
+int loop_range(const BFOp* ops, size_t open, int16_t* min, int16_t* max) {
+  size_t close = open + (size_t) ops[open].as.arg;
+  int64_t offsets[RANGE_MAX_OPS];
+  size_t opens[RANGE_MAX_OPS];
+  size_t depth = 0;
+  int64_t offset = 0, lo = 0, hi = 0;
+
+  if (ops[open].as.arg <= 0 || close - open + 1 > RANGE_MAX_OPS) { return 0; }
+
+  for (size_t i=open+1; i<close; i++) {
+    const BFOp* op = &ops[i];
+    switch (op->code) {
+      case OP_MOVE:
+      case OP_MOVE_UNCHECKED:
+        offset += op->as.arg;
+        if (offset < lo) { lo = offset; }
+        if (offset > hi) { hi = offset; }
+        if (lo < INT16_MIN || hi > INT16_MAX) { return 0; }
+        break;
+
+      case OP_OPEN_LOOP:
+        if (i + (size_t) op->as.arg >= close) { return 0; }
+        offsets[depth] = offset;
+        opens[depth++] = i;
+        break;
+
+      case OP_CLOSE_LOOP:
+        if (depth == 0 || offsets[--depth] != offset) { return 0; }
+        if (i - opens[depth] != (size_t) -(int64_t) op->as.arg || ops[opens[depth]].as.arg != -op->as.arg) { return 0; }
+        break;
+
+      case OP_CLEAR:
+      case OP_MUL_LOOP: {
+        /* Idiom ops check their own range, which is that of their loops */
+        size_t loop = i + 1;
+        while (loop < close && ops[loop].code == OP_MUL_TERM) { loop++; }
+        if (loop >= close || ops[loop].code != OP_OPEN_LOOP || op->as.loop.skip <= 0) { return 0; }
+        if (i + (size_t) op->as.loop.skip != loop + (size_t) ops[loop].as.arg) { return 0; }
+      } break;
+
+      case OP_ADD:
+      case OP_GET_CHAR:
+      case OP_PUT_CHAR:
+      case OP_MUL_TERM:
+        break;
+
+      default:
+        return 0;
+    }
+  }
+
+  if (depth != 0 || offset != 0) { return 0; }
+  *min = (int16_t) lo;
+  *max = (int16_t) hi;
+  return 1;
+}
+
+/*
+ * Prefixes each loop whose pointer only reaches offsets known at load time
+ * (see loop_range()) with an OP_RANGE and a copy of the loop whose moves are
+ * OP_MOVE_UNCHECKED, so that the moves of the whole loop are checked at once
+ * as it is entered rather than one by one on every iteration. Where the check
+ * fails, the copy is skipped for the original loop, whose moves then fault
+ * just as before; otherwise the copy runs, and leaves a zero cell for the
+ * original loop to skip.
+ *
+ * Only the outermost of nested loops is copied, and not loops replaced by
+ * idiom ops, nor loops that never move the pointer. Copying stops once it
+ * would double the length of the code.
+ */
+static void check_ranges(BFCode* code) {
+  size_t length = code->length;
+  BFIdiomLoop* ranges = (BFIdiomLoop*) calloc(length + 1, sizeof(BFIdiomLoop));
+  if (ranges == NULL) { throw_fault("not enough memory to lower program"); }
+
+  size_t added = 0;
+  for (size_t i=0; i<length; i++) {
+    const BFOp* op = &code->ops[i];
+    if (op->code != OP_OPEN_LOOP) { continue; }
+
+    BFOpCode prev = (i > 0) ? code->ops[i-1].code : OP_ADD;
+    if (prev == OP_CLEAR || prev == OP_MUL_LOOP || prev == OP_MUL_TERM) { continue; }
+
+    int16_t min, max;
+    size_t loop_length = (size_t) op->as.arg + 1;
+    if (loop_range(code->ops, i, &min, &max) && (min < 0 || max > 0) && added + loop_length + 1 <= length) {
+      ranges[i].skip = (int32_t) loop_length;
+      ranges[i].min = min;
+      ranges[i].max = max;
+      added += loop_length + 1;
+      i += (size_t) op->as.arg;
+    }
+  }
+
+  if (added == 0) {
+    free(ranges);
+    return;
+  }
+
+  BFCode out = { NULL, 0, NULL, NULL, NULL, 0 };
+  size_t capacity = 0;
+  if (code->offsets != NULL) {
+    out.offsets = (uint32_t*) malloc(sizeof(uint32_t));
+    if (out.offsets == NULL) { throw_fault("not enough memory to lower program"); }
+  }
+
+  for (size_t i=0; i<length; i++) {
+    uint32_t offset = (code->offsets != NULL) ? code->offsets[i] : 0;
+
+    if (ranges[i].skip > 0) {
+      code_push(&out, &capacity, OP_RANGE, offset)->as.loop = ranges[i];
+      for (size_t j=i; j<i+(size_t)ranges[i].skip; j++) {
+        const BFOp* op = &code->ops[j];
+        BFOp* copy = code_push(&out, &capacity, op->code, (code->offsets != NULL) ? code->offsets[j] : 0);
+        *copy = *op;
+        if (op->code == OP_MOVE) { copy->code = OP_MOVE_UNCHECKED; }
+      }
+    }
+
+    *code_push(&out, &capacity, code->ops[i].code, offset) = code->ops[i];
+  }
+
+  free(ranges);
+  free(code->ops);
+  free(code->offsets);
+  out.flags = code->flags;
+  *code = out;
+  match_brackets(code);
+}
+
+/*
+ * Inlining of small functions at the calls whose function is known at load
+ * time (see inline_calls()): the most ops of a function body to copy into its
+ * callers, and the cells whose contents are followed when predicting which
+ * function a call runs, by their offset from the pointer's starting position
+ * (-KNOWN_BIAS to KNOWN_CELLS - KNOWN_BIAS - 1)
+ */
+#define INLINE_MAX_OPS 48
+#define KNOWN_CELLS 4096
+#define KNOWN_BIAS 256
+
+/*
+ * What is known of a cell's contents at some point of the code whatever path
+ * led there: nothing, its value, or that it holds the function defined by the
+ * { at index 'value'
+ */
+typedef struct {
+  enum { KNOWN_NOTHING = 0, KNOWN_VALUE, KNOWN_FN } kind;
+  uint32_t value;
+} KnownCell;
+
+/*
+ * The cells known while predicting calls, with the pointer's offset from its
+ * starting position. The offsets are also tape indexes while 'absolute', as
+ * for the main program until the pointer's position is lost.
+ */
+typedef struct {
+  KnownCell* cells;
+  int64_t pos;
+  int absolute;
+} KnownTape;
+
+/* The cell at an offset from the pointer, or NULL if not followed */
+static KnownCell* known_cell(KnownTape* tape, int64_t offset) {
+  int64_t i = tape->pos + offset + KNOWN_BIAS;
+  return (i >= 0 && i < KNOWN_CELLS) ? &tape->cells[i] : NULL;
+}
+
+static void known_set(KnownTape* tape, int64_t offset, int kind, uint32_t value) {
+  KnownCell* cell = known_cell(tape, offset);
+  if (cell != NULL) {
+    cell->kind = kind;
+    cell->value = value;
+  }
+}
+
+/* Forgets every cell, and where the pointer is */
+static void known_forget_all(KnownTape* tape) {
+  memset(tape->cells, 0, sizeof(KnownCell) * KNOWN_CELLS);
+  tape->pos = 0;
+  tape->absolute = 0;
+}
+
+/*
+ * Finds each loop that leaves the pointer where it started, as do all the
+ * loops within it, setting 'balanced' for its [. The pointer's offset from the
+ * start of such a loop is then known at each of its ops. Function bodies are
+ * left out, as they move the pointer of their own calls.
+ */
+static void find_balanced_loops(const BFCode* code, uint8_t* balanced) {
+  typedef struct { int64_t pos; int ok; } Open;
+  Open* stack = (Open*) malloc(sizeof(Open) * (code->length + 1));
+  if (stack == NULL) { throw_fault("not enough memory to lower program"); }
+  size_t depth = 0;
+  int64_t pos = 0;
+
+  for (size_t i=0; i<code->length; i++) {
+    const BFOp* op = &code->ops[i];
+    switch (op->code) {
+      case OP_MOVE:
+      case OP_MOVE_UNCHECKED:
+        pos += op->as.arg;
+        break;
+
+      case OP_OPEN_LOOP:
+      case OP_OPEN_FN:
+        stack[depth].pos = pos;
+        stack[depth].ok = 1;
+        depth++;
+        break;
+
+      case OP_CLOSE_LOOP: {
+        Open open = stack[--depth];
+        balanced[i + op->as.arg] = (uint8_t) (open.ok && pos == open.pos);
+        if (!balanced[i + op->as.arg] && depth > 0) { stack[depth-1].ok = 0; }
+      } break;
+
+      case OP_CLOSE_FN:
+        pos = stack[--depth].pos;
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  free(stack);
+}
+
+/*
+ * Forgets every cell the loop whose [ is at 'open' may write to, as the
+ * pointer is at its [ on every iteration. Only called for balanced loops (see
+ * find_balanced_loops()), so the offset of each write from the [ is known.
+ */
+static void known_forget_loop(KnownTape* tape, const BFCode* code, size_t open) {
+  size_t close = open + (size_t) code->ops[open].as.arg;
+  int64_t offset = 0;
+
+  for (size_t i=open+1; i<close; i++) {
+    const BFOp* op = &code->ops[i];
+    switch (op->code) {
+      case OP_MOVE:
+      case OP_MOVE_UNCHECKED:
+        offset += op->as.arg;
+        break;
+
+      case OP_ADD:
+      case OP_GET_CHAR:
+      case OP_CLEAR:
+        known_set(tape, offset, KNOWN_NOTHING, 0);
+        break;
+
+      case OP_MUL_TERM:
+        known_set(tape, offset + op->as.term.offset, KNOWN_NOTHING, 0);
+        break;
+
+      case OP_OPEN_FN:
+        known_set(tape, offset, KNOWN_NOTHING, 0);
+        i += op->as.arg;
+        break;
+
+      case OP_CALL:
+        for (int64_t r=1; r<=op->as.call.res_count; r++) {
+          known_set(tape, offset + r, KNOWN_NOTHING, 0);
+        }
+        break;
+
+      default:
+        break;
+    }
+  }
+}
+
+/*
+ * Predicts which function each call in the ops [start, end) runs, from the
+ * cells known to hold functions and values as the ops run in order, setting
+ * 'targets' to the index of the function's { for the calls predicted.
+ *
+ * Only calls taking the function from the tape the ops run on (i.e. with no '
+ * or @) in the main program are predicted from it, while its pointer's
+ * position is known, and then every call through @ from the functions defined
+ * at the same cell throughout the main program, recorded in 'global_defs' by
+ * tape index. The prediction may be wrong, e.g. where the value of an address
+ * cell differs between iterations of a loop, so inlined calls check it as they
+ * run (see vm_inline_enter()).
+ */
+static void predict_calls(const BFCode* code, size_t start, size_t end, int absolute, const uint8_t* balanced,
+  KnownTape* tape, int32_t* global_defs, int32_t* targets) {
+  known_forget_all(tape);
+  tape->absolute = absolute;
+
+  /* The main program's tape starts out zeroed */
+  if (absolute) {
+    for (int64_t i=0; i<KNOWN_CELLS-KNOWN_BIAS; i++) {
+      known_set(tape, i, KNOWN_VALUE, 0);
+    }
+  }
+
+  for (size_t i=start; i<end; i++) {
+    const BFOp* op = &code->ops[i];
+    KnownCell* cell = known_cell(tape, 0);
+
+    switch (op->code) {
+      case OP_ADD:
+        if (cell != NULL && cell->kind == KNOWN_VALUE) { cell->value += (uint32_t) op->as.arg; }
+        else if (cell != NULL) { cell->kind = KNOWN_NOTHING; }
+        break;
+
+      case OP_MOVE:
+      case OP_MOVE_UNCHECKED:
+        tape->pos += op->as.arg;
+        break;
+
+      case OP_GET_CHAR:
+        known_set(tape, 0, KNOWN_NOTHING, 0);
+        break;
+
+      case OP_CLEAR:
+        /* A function cell would fall into the loop and fault */
+        known_set(tape, 0, KNOWN_VALUE, 0);
+        i += op->as.loop.skip;
+        break;
+
+      case OP_MUL_LOOP:
+        for (size_t t=i+1; code->ops[t].code == OP_MUL_TERM; t++) {
+          known_set(tape, code->ops[t].as.term.offset, KNOWN_NOTHING, 0);
+        }
+        known_set(tape, 0, KNOWN_VALUE, 0);
+        i += op->as.loop.skip;
+        break;
+
+      case OP_RANGE:
+        /* The copy does just as the original loop after it */
+        i += op->as.loop.skip;
+        break;
+
+      case OP_OPEN_LOOP:
+        if (balanced[i]) { known_forget_loop(tape, code, i); }
+        else { known_forget_all(tape); }
+        break;
+
+      case OP_CLOSE_LOOP:
+        /* The loop may have run any number of times, and ends on a zero */
+        if (balanced[i + op->as.arg]) {
+          known_forget_loop(tape, code, i + op->as.arg);
+          known_set(tape, 0, KNOWN_VALUE, 0);
+        }
+        else {
+          known_forget_all(tape);
+        }
+        break;
+
+      case OP_OPEN_FN:
+        known_set(tape, 0, KNOWN_FN, (uint32_t) i);
+        if (tape->absolute && tape->pos >= 0 && tape->pos < KNOWN_CELLS - KNOWN_BIAS) {
+          int32_t* def = &global_defs[tape->pos];
+          *def = (*def == -1 || *def == (int32_t) i) ? (int32_t) i : -2;
+        }
+        i += op->as.arg;
+        break;
+
+      case OP_CALL: {
+        const BFCallSite* site = &op->as.call;
+        if (cell != NULL && cell->kind == KNOWN_VALUE) {
+          int64_t addr = cell->value;
+          KnownCell* fn = tape->absolute ? known_cell(tape, addr - tape->pos) : NULL;
+          if ((site->scope == 0 || site->scope == SCOPE_GLOBAL) && fn != NULL && fn->kind == KNOWN_FN) {
+            targets[i] = (int32_t) fn->value;
+          }
+          else if (site->scope == SCOPE_GLOBAL && !absolute && addr < KNOWN_CELLS - KNOWN_BIAS && global_defs[addr] >= 0) {
+            targets[i] = global_defs[addr];
+          }
+        }
+        for (int64_t r=1; r<=site->res_count; r++) {
+          known_set(tape, r, KNOWN_NOTHING, 0);
+        }
+      } break;
+
+      default:
+        break;
+    }
+  }
+}
+
+/*
+ * Finds whether the body of the function defined by the { at 'def' can be
+ * inlined: it is short, makes no calls and defines no functions, and each of
+ * its loops leaves the pointer where it started, so that the cells it can
+ * reach are known. Sets the lowest and highest offsets of those cells from
+ * where the pointer starts.
+ */
+static int inline_extent(const BFCode* code, size_t def, int64_t* min, int64_t* max) {
+  size_t end = def + (size_t) code->ops[def].as.arg;
+  int64_t opens[INLINE_MAX_OPS];
+  size_t depth = 0;
+  int64_t offset = 0;
+
+  if (end - def - 1 > INLINE_MAX_OPS) { return 0; }
+  *min = 0;
+  *max = 0;
+
+  for (size_t i=def+1; i<end; i++) {
+    const BFOp* op = &code->ops[i];
+    switch (op->code) {
+      case OP_MOVE:
+      case OP_MOVE_UNCHECKED:
+        offset += op->as.arg;
+        if (offset < *min) { *min = offset; }
+        if (offset > *max) { *max = offset; }
+        break;
+
+      case OP_OPEN_LOOP:
+        opens[depth++] = offset;
+        break;
+
+      case OP_CLOSE_LOOP:
+        if (opens[--depth] != offset) { return 0; }
+        break;
+
+      case OP_ADD:
+      case OP_GET_CHAR:
+      case OP_PUT_CHAR:
+      case OP_CLEAR:
+      case OP_MUL_LOOP:
+      case OP_MUL_TERM:
+      case OP_RANGE:
+        /* Idiom ops and range checks reach no further than the loops they are followed by */
+        break;
+
+      default:
+        return 0;
+    }
+  }
+  return *max - *min < TAPE_MAX_LIMIT;
+}
+
+/*
+ * Copies the bodies of small functions into the calls that are predicted to
+ * run them (see predict_calls()), so that the call itself, with the frame it
+ * pushes, is not made. Each call inlined is prefixed with an OP_INLINE, the
+ * copy of the function body and an OP_INLINE_END; the call is kept after them
+ * for the VM to make instead whenever the prediction turns out to be wrong, or
+ * the call would fault on entering (see vm_inline_enter()).
+ *
+ * Only bodies whose cells are known (see inline_extent()) are inlined, where
+ * they never move the pointer before the call's arguments, so that the copy
+ * can run on cells past the end of the caller's tape. Inlining stops once it
+ * would double the length of the code.
+ */
+static void inline_calls(BFCode* code) {
+  size_t length = code->length;
+  int32_t* targets = (int32_t*) malloc(sizeof(int32_t) * (length + 1));
+  int32_t* global_defs = (int32_t*) malloc(sizeof(int32_t) * KNOWN_CELLS);
+  uint8_t* balanced = (uint8_t*) calloc(length + 1, 1);
+  KnownTape tape;
+  tape.cells = (KnownCell*) malloc(sizeof(KnownCell) * KNOWN_CELLS);
+  if (targets == NULL || global_defs == NULL || balanced == NULL || tape.cells == NULL) {
+    throw_fault("not enough memory to lower program");
+  }
+
+  for (size_t i=0; i<length; i++) {
+    targets[i] = -1;
+  }
+  for (size_t i=0; i<KNOWN_CELLS; i++) {
+    global_defs[i] = -1;
+  }
+
+  find_balanced_loops(code, balanced);
+  predict_calls(code, 0, length, 1, balanced, &tape, global_defs, targets);
+  for (size_t i=0; i<length; i++) {
+    if (code->ops[i].code == OP_OPEN_FN) {
+      predict_calls(code, i + 1, i + (size_t) code->ops[i].as.arg, 0, balanced, &tape, global_defs, targets);
+    }
+  }
+
+  /* Choose the calls to inline, the cells each copy runs on, and where each op moves to */
+  int32_t* spans = (int32_t*) malloc(sizeof(int32_t) * (length + 1));
+  size_t* moved = (size_t*) malloc(sizeof(size_t) * (length + 1));
+  if (spans == NULL || moved == NULL) { throw_fault("not enough memory to lower program"); }
+  size_t added = 0;
+  for (size_t i=0; i<length; i++) {
+    int64_t min, max;
+    if (targets[i] >= 0) {
+      size_t body = (size_t) code->ops[targets[i]].as.arg - 1;
+      if (!inline_extent(code, (size_t) targets[i], &min, &max) || min + code->ops[i].as.call.arg_count < 0
+        || added + body + 2 > length) {
+        targets[i] = -1;
+      }
+      else {
+        added += body + 2;
+        spans[i] = (int32_t) (code->ops[i].as.call.arg_count + max + 1);
+      }
+    }
+    moved[i] = i + added;
+  }
+
+  free(global_defs);
+  free(balanced);
+  free(tape.cells);
+
+  if (added > 0) {
+    BFOp* ops = (BFOp*) malloc(sizeof(BFOp) * (length + added));
+    uint32_t* offsets = NULL;
+    if (ops == NULL) { throw_fault("not enough memory to lower program"); }
+    if (code->offsets != NULL) {
+      offsets = (uint32_t*) malloc(sizeof(uint32_t) * (length + added));
+      if (offsets == NULL) { throw_fault("not enough memory to lower program"); }
+    }
+
+    for (size_t i=0; i<length; i++) {
+      size_t at = moved[i];
+      if (targets[i] >= 0) {
+        size_t def = (size_t) targets[i];
+        size_t body = (size_t) code->ops[def].as.arg - 1;
+        size_t start = at - body - 2;
+
+        memset(&ops[start], 0, sizeof(BFOp));
+        ops[start].code = OP_INLINE;
+        ops[start].as.inlined.skip = (int32_t) (body + 1);
+        ops[start].as.inlined.def = (int32_t) ((int64_t) moved[def] - (int64_t) start);
+        memcpy(&ops[start+1], &code->ops[def+1], sizeof(BFOp) * body);
+        memset(&ops[at-1], 0, sizeof(BFOp));
+        ops[at-1].code = OP_INLINE_END;
+        ops[at-1].as.arg = spans[i];
+
+        /* The copy has the offsets of the body, and its ends that of the call */
+        if (offsets != NULL) {
+          offsets[start] = code->offsets[i];
+          memcpy(&offsets[start+1], &code->offsets[def+1], sizeof(uint32_t) * body);
+          offsets[at-1] = code->offsets[i];
+        }
+      }
+      ops[at] = code->ops[i];
+      if (offsets != NULL) { offsets[at] = code->offsets[i]; }
+    }
+
+    free(code->ops);
+    free(code->offsets);
+    code->ops = ops;
+    code->offsets = offsets;
+    code->length = length + added;
+    match_brackets(code);
+  }
+
+  free(targets);
+  free(spans);
+  free(moved);
+}
+
+/*
+ * Turns each call directly before the } of its function body into a tail
+ * call, OP_TAIL_CALL, which may reuse the frame of the call it ends (see
+ * vm_call_tail()).
+ *
+ * Only done for programs with no ' decorators: a call through ' looks into a
+ * frame below its own, which may have been reused by a tail call, and which
+ * calls could reach which frames is only known at run time.
+ */
+static void mark_tail_calls(BFCode* code) {
+  for (size_t i=0; i<code->length; i++) {
+    if (code->ops[i].code == OP_CALL && code->ops[i].as.call.scope > 0) { return; }
+  }
+
+  for (size_t i=1; i<code->length; i++) {
+    if (code->ops[i].code == OP_CLOSE_FN && code->ops[i-1].code == OP_CALL) {
+      code->ops[i-1].code = OP_TAIL_CALL;
+    }
+  }
+}
+
+/*
+ * Flags each function body that is pure as FN_PURE in its { op (see BFFnDef):
+ * one with no , or . ops, no definitions and no calls through ' or @. Such a
+ * body can only see its arguments and its own tape, and can only call the
+ * functions passed to it, so calls of it passing only values depend on
+ * nothing but their values, which memoisation relies on (see memo_call()).
+ *
+ * The body of a function with nested definitions is impure, so each body is
+ * scanned only up to its first nested {, and each op at most once.
+ */
+static void mark_pure_fns(BFCode* code) {
+  for (size_t i=0; i<code->length; i++) {
+    if (code->ops[i].code != OP_OPEN_FN) { continue; }
+
+    size_t end = i + (size_t) code->ops[i].as.def.skip;
+    uint32_t flags = FN_PURE;
+    for (size_t j=i+1; j<end && flags != 0; j++) {
+      const BFOp* op = &code->ops[j];
+      if (op->code == OP_GET_CHAR || op->code == OP_PUT_CHAR || op->code == OP_OPEN_FN
+        || ((op->code == OP_CALL || op->code == OP_TAIL_CALL) && op->as.call.scope != 0)) {
+        flags = 0;
+      }
+    }
+    code->ops[i].as.def.flags = flags;
+  }
+}
+
+/*
+ * The most distinct cells a loop may add to and still be recognised as an
+ * OP_MUL_LOOP idiom
+ */
+#define MAX_MUL_TERMS 32
+
+/*
+ * Looks for innermost loops whose bodies only add to cells and move the
+ * pointer, leaving it where it started and adding exactly 1 or -1 to the loop
+ * cell on each iteration, e.g. [-], [->+<] or [->++>+++<<]. The number of
+ * iterations of such a loop is then known on entry, so it can be run as a
+ * single op:
+ *   [-] and [+] are prefixed with an OP_CLEAR
+ *   others are prefixed with an OP_MUL_LOOP followed by one OP_MUL_TERM for
+ *   each cell added to, in the order the loop first adds to them
+ * For loops adding 1 to the loop cell, the term factors are negated, so the VM
+ * can always multiply by the loop cell's value.
+ *
+ * The original loop is kept after the prefix, for the VM to fall back on when
+ * the idiom cannot be applied exactly.
+ */
+static void recognise_idioms(BFCode* code) {
+  BFCode out = { NULL, 0, NULL, NULL, NULL, 0 };
+  size_t capacity = 0;
+
+  if (code->offsets != NULL) {
+    out.offsets = (uint32_t*) malloc(sizeof(uint32_t));
+    if (out.offsets == NULL) { throw_fault("not enough memory to lower program"); }
+  }
+
+  int32_t offsets[MAX_MUL_TERMS];
+  int32_t factors[MAX_MUL_TERMS];
+
+  for (size_t i=0; i<code->length; i++) {
+    BFOp* op = &code->ops[i];
+    uint32_t offset = (code->offsets != NULL) ? code->offsets[i] : 0;
+
+    if (op->code == OP_OPEN_LOOP) {
+      /* Find the end of the loop if it only contains + - < > */
+      size_t end = i + 1;
+      while (end < code->length && (code->ops[end].code == OP_ADD || code->ops[end].code == OP_MOVE)) {
+        end++;
+      }
+
+      if (end < code->length && end > i + 1 && code->ops[end].code == OP_CLOSE_LOOP) {
+        int64_t pos = 0, min = 0, max = 0;
+        int64_t delta = 0;
+        size_t term_count = 0;
+        int valid = 1;
+
+        for (size_t j=i+1; j<end && valid; j++) {
+          BFOp* body = &code->ops[j];
+
+          if (body->code == OP_MOVE) {
+            pos += body->as.arg;
+            if (pos < min) { min = pos; }
+            if (pos > max) { max = pos; }
+            if (min < INT16_MIN || max > INT16_MAX) { valid = 0; }
+          }
+          else if (pos == 0) {
+            delta += body->as.arg;
+          }
+          else {
+            size_t t = 0;
+            while (t < term_count && offsets[t] != pos) { t++; }
+            if (t == term_count) {
+              if (term_count == MAX_MUL_TERMS) { valid = 0; break; }
+              offsets[t] = (int32_t) pos;
+              factors[t] = 0;
+              term_count++;
+            }
+            factors[t] += body->as.arg;
+          }
+        }
+
+        if (valid && pos == 0 && (delta == 1 || delta == -1)) {
+          size_t skip = 1 + term_count + (end - i);
+
+          if (term_count == 0 && min == 0 && max == 0) {
+            BFOp* clear = code_push(&out, &capacity, OP_CLEAR, offset);
+            clear->as.loop.skip = (int32_t) skip;
+          }
+          else {
+            BFOp* mul = code_push(&out, &capacity, OP_MUL_LOOP, offset);
+            mul->as.loop.skip = (int32_t) skip;
+            mul->as.loop.min = (int16_t) min;
+            mul->as.loop.max = (int16_t) max;
+
+            for (size_t t=0; t<term_count; t++) {
+              BFOp* term = code_push(&out, &capacity, OP_MUL_TERM, offset);
+              term->as.term.offset = offsets[t];
+              term->as.term.factor = (delta == -1) ? factors[t] : -factors[t];
+            }
+          }
+        }
+      }
+    }
+
+    *code_push(&out, &capacity, op->code, offset) = *op;
+  }
+
+  free(code->ops);
+  free(code->offsets);
+  *code = out;
+}
+
+/*
+ * Lowers the lexed instructions into the run-length-folded IR run by the VM,
+ * so that a run of, say, 60 + instructions is dispatched once as OP_ADD 60
+ * rather than 60 times.
+ *
+ * Only runs of the same instruction are folded, so that faults (e.g. + on a
+ * function cell, or a > beyond the tape) are still raised by the same
+ * character as before.
+ *
+ * Each pair of call brackets is decoded here into a single OP_CALL, counting
+ * the +, -, ' and @ decorators into its BFCallSite so that they are never
+ * re-read at run time; all other instructions within call brackets are
+ * ignored. Simple loops are then replaced by idiom ops by recognise_idioms(),
+ * loop and function brackets are matched up by match_brackets(), loops
+ * copied to run without checks on their moves by check_ranges(), calls of
+ * small functions known at load time inlined by inline_calls(), calls in
+ * tail position marked by mark_tail_calls(), and pure function bodies by
+ * mark_pure_fns(). Any mismatch is a fault.
+ *
+ * The resulting ops are written to code, which should be empty; the
+ * instructions are left untouched and may be freed by the caller. If the
+ * instructions have offsets, the code gets the offset of each op (that of its
+ * first instruction, or of the loop for an idiom op).
+ */
+void lower_instructions(BFInstructions* insts, BFCode* code) {
+  size_t capacity = 0;
+  int in_call = 0;
+  BFCallSite call = { 0, 0, 0 };
+  uint32_t call_offset = 0;
+
+  code->ops = NULL;
+  code->length = 0;
+  code->threads = NULL;
+  code->native = NULL;
+  code->offsets = NULL;
+  code->flags = 0;
+
+  if (insts->offsets != NULL) {
+    code->offsets = (uint32_t*) malloc(sizeof(uint32_t));
+    if (code->offsets == NULL) { throw_fault("not enough memory to lower program"); }
+  }
+
+/* Last op emitted, if any */
+#define LAST (code->length > 0 ? &code->ops[code->length-1] : NULL)
+
+/* Can the last op absorb another op of this opcode with a same-signed arg? */
+#define CAN_FOLD(opc, a) \
+  (LAST != NULL && LAST->code == (opc) && (LAST->as.arg < 0) == ((a) < 0) \
+    && LAST->as.arg != INT32_MAX && LAST->as.arg != INT32_MIN)
+
+/* Emit an op, folding it into the previous one where possible */
+#define EMIT_FOLDED(opc, a) \
+  do { \
+    if (CAN_FOLD(opc, a)) { LAST->as.arg += (a); } \
+    else { code_push(code, &capacity, opc, offset)->as.arg = (a); } \
+  } while (0)
+
+  for (size_t i=0; i<insts->length; i++) {
+    BFInst inst = insts->insts[i];
+    uint32_t offset = (insts->offsets != NULL) ? insts->offsets[i] : 0;
+
+    if (in_call) {
+      switch (inst) {
+        case INST_MINUS: /* - indicates number of spaces back to start pulling arguments from */
+          call.arg_count++;
+          break;
+
+        case INST_PLUS: /* + indicates number of spaces forward to push results to */
+          call.res_count++;
+          break;
+
+        case INST_SCOPE_UP: /* ' indicates number of scopes up to take the function from */
+          if (call.scope != SCOPE_GLOBAL) { call.scope++; }
+          break;
+
+        case INST_SCOPE_GLOBAL: /* @ indicates to take the function from the global scope */
+          call.scope = SCOPE_GLOBAL;
+          break;
+
+        case INST_CLOSE_CALL:
+          code_push(code, &capacity, OP_CALL, call_offset)->as.call = call;
+          in_call = 0;
+          break;
+
+        default:
+          /* Ignore other instructions within call brackets */
+          break;
+      }
+      continue;
+    }
+
+    switch (inst) {
+      case INST_PLUS:
+        EMIT_FOLDED(OP_ADD, 1);
+        break;
+
+      case INST_MINUS:
+        EMIT_FOLDED(OP_ADD, -1);
+        break;
+
+      case INST_MOVE_LEFT:
+        EMIT_FOLDED(OP_MOVE, -1);
+        break;
+
+      case INST_MOVE_RIGHT:
+        EMIT_FOLDED(OP_MOVE, 1);
+        break;
+
+      case INST_GET_CHAR:
+        EMIT_FOLDED(OP_GET_CHAR, 1);
+        break;
+
+      case INST_PUT_CHAR:
+        EMIT_FOLDED(OP_PUT_CHAR, 1);
+        break;
+
+      case INST_OPEN_LOOP:
+        code_push(code, &capacity, OP_OPEN_LOOP, offset);
+        break;
+
+      case INST_CLOSE_LOOP:
+        code_push(code, &capacity, OP_CLOSE_LOOP, offset);
+        break;
+
+      case INST_OPEN_FN:
+        code_push(code, &capacity, OP_OPEN_FN, offset);
+        break;
+
+      case INST_CLOSE_FN:
+        code_push(code, &capacity, OP_CLOSE_FN, offset);
+        break;
+
+      case INST_OPEN_CALL:
+        call.arg_count = 0;
+        call.res_count = 0;
+        call.scope = 0;
+        call_offset = offset;
+        in_call = 1;
+        break;
+
+      case INST_CLOSE_CALL:
+        throw_fault("mismatched function call brackets");
+        break;
+
+      case INST_SCOPE_UP:
+      case INST_SCOPE_GLOBAL:
+        /* No effect outside call brackets */
+        break;
+    }
+  }
+
+  if (in_call) {
+    throw_fault("mismatched function call brackets");
+  }
+
+  recognise_idioms(code);
+  match_brackets(code);
+  check_ranges(code);
+  inline_calls(code);
+  mark_tail_calls(code);
+  mark_pure_fns(code);
+
+  /* Shrink to the exact size, as the main program keeps these ops for its run */
+  if (code->length > 0) {
+    code->ops = (BFOp*) realloc(code->ops, sizeof(BFOp) * code->length);
+    if (code->offsets != NULL) {
+      code->offsets = (uint32_t*) realloc(code->offsets, sizeof(uint32_t) * code->length);
+    }
+  }
+
+#undef LAST
+#undef CAN_FOLD
+#undef EMIT_FOLDED
+}
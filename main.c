@@ -2,23 +2,288 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <setjmp.h>
 
 #include "bfplusplus.h"
 #include "rawmode.h"
 
+static void print_usage(const char* prog) {
+  printf("Usage: %s [options] [source file]\n", prog);
+  printf("       %s [options] --batch <source file> <input file>...\n", prog);
+  printf("Options:\n");
+  printf("  --engine=threaded  run with direct-threaded dispatch (default, GCC/Clang builds)\n");
+  printf("  --engine=switch    run with the portable switch dispatch loop\n");
+  printf("  --engine=jit       compile to native x86-64 code before running\n");
+  printf("  --emit-c           write the program out as C instead of running it\n");
+  printf("  --cell-bits=N      width of each tape cell: 8, 16 (default) or 32 bits\n");
+  printf("  --tape-max=N       most cells each tape may grow to (default %d)\n", TAPE_MAX_LENGTH);
+  printf("  --tape-initial=N   cells each tape starts with (default %d)\n", TAPE_INITIAL_LENGTH);
+  printf("  --tape-grow=R      factor by which tapes grow when full (default %g)\n", TAPE_GROW_RATE);
+  printf("  --max-depth=N      most function calls in progress at once (default %d)\n", FRAME_MAX_DEPTH);
+  printf("  --no-cache         neither use nor write the lowered program cached in <source file>c\n");
+  printf("  --batch            run the program over each input file, writing each output to\n");
+  printf("                     <input file>.out\n");
+  printf("  --jobs=N           threads to run a batch with (default one per core)\n");
+  printf("  --out-dir=DIR      directory to write the outputs of a batch to\n");
+  printf("  --profile[=FILE]   count where the run spends its time, writing a report to FILE\n");
+  printf("                     (default bfpp.prof) and collapsed stacks to FILE.folded\n");
+  printf("  --memo[=N]         reuse the results of calls of pure functions, remembering up to\n");
+  printf("                     N calls (default %d), and report the hit rate\n", MEMO_ENTRIES);
+  printf("  --checkpoint=FILE  write the state of the run to FILE whenever sent SIGUSR2, for\n");
+  printf("                     --resume to carry on from (runs without the JIT)\n");
+  printf("  --checkpoint-every=N\n");
+  printf("                     also write it every N loop iterations and calls\n");
+  printf("  --resume=FILE      carry on the run checkpointed in FILE, given the same program,\n");
+  printf("                     options and input, checkpointing to FILE unless --checkpoint is given\n");
+#ifdef BF_STATS
+  printf("  --stats[=json]     count the ops, loops, calls, tape growth, copies and allocations\n");
+  printf("                     of the run, reporting them at the end and on SIGUSR1 (runs\n");
+  printf("                     without the JIT)\n");
+#endif
+}
+
+/*
+ * Parses the value of a numeric option such as --tape-max=N into value,
+ * returning 0 if it is not a whole positive number
+ */
+static int parse_size(const char* arg, size_t* value) {
+  char* end;
+  if (*arg < '0' || *arg > '9') { return 0; }
+  unsigned long n = strtoul(arg, &end, 10);
+  if (*end != '\0' || n == 0) { return 0; }
+  *value = (size_t) n;
+  return 1;
+}
+
+/*
+ * Runs a VM with a profile, writing the report once it ends, or if it faults,
+ * when the fault is reported as usual. Returns 0 if the report is written.
+ */
+static int run_profiled(BFVM* vm, const char* fpath, const char* out_path) {
+  BFProfile* profile = profile_create(&vm->code);
+  vm->profile = profile;
+
+  jmp_buf target;
+  jmp_buf* previous = fault_catch(&target);
+  if (setjmp(target) != 0) {
+    fault_catch(previous);
+    io_flush();
+    exit_raw_mode();
+    fprintf(stderr, "%s\n", fault_message());
+
+    if (profile_write(profile, &vm->code, fpath, out_path) != 0) {
+      fprintf(stderr, "Could not write profile to %s\n", out_path);
+    }
+    exit(1);
+  }
+
+  vm_run(vm);
+
+  fault_catch(previous);
+  vm->profile = NULL;
+
+  int res = profile_write(profile, &vm->code, fpath, out_path);
+  profile_free(profile);
+  return res;
+}
+
+#ifdef BF_STATS
+/*
+ * Runs a VM with stats, reporting them once it ends, or if it faults, once
+ * the fault is reported as usual
+ */
+static void run_with_stats(BFVM* vm, BFStats* stats) {
+  vm->stats = stats;
+
+  jmp_buf target;
+  jmp_buf* previous = fault_catch(&target);
+  if (setjmp(target) != 0) {
+    fault_catch(previous);
+    io_flush();
+    exit_raw_mode();
+    fprintf(stderr, "%s\n", fault_message());
+    stats_report(stats, stderr);
+    exit(1);
+  }
+
+  vm_run(vm);
+
+  fault_catch(previous);
+  vm->stats = NULL;
+}
+#endif
+
 int main(int argc, char** argv) {
 
 #ifdef DEBUG_MLTRACK
   TRACK_init(stdout, TRACK_report_warn);
 #endif
 
-  char* fpath;
-  if (argc == 1) {
-    fpath = NULL;
+  char* fpath = NULL;
+  BFEngine engine = ENGINE_THREADED;
+  int emit = 0;
+  int use_cache = 1;
+  int batch = 0;
+  size_t jobs = 0;
+  const char* out_dir = NULL;
+  const char* profile_path = NULL;
+  size_t memo_entries = 0;
+  const char* checkpoint_path = NULL;
+  size_t checkpoint_every = 0;
+  const char* resume_path = NULL;
+  int stats_format = 0;
+  char** inputs = (char**) malloc(sizeof(char*) * argc);
+  size_t input_count = 0;
+  int valid = 1;
+  BFTapeConfig config = { CELL_SIZE, TAPE_MAX_LENGTH, TAPE_INITIAL_LENGTH, TAPE_GROW_RATE, FRAME_MAX_DEPTH };
+
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "--engine=threaded") == 0) {
+      engine = ENGINE_THREADED;
+    }
+    else if (strcmp(argv[i], "--engine=switch") == 0) {
+      engine = ENGINE_SWITCH;
+    }
+    else if (strcmp(argv[i], "--engine=jit") == 0) {
+      engine = ENGINE_JIT;
+    }
+    else if (strcmp(argv[i], "--emit-c") == 0) {
+      emit = 1;
+    }
+    else if (strncmp(argv[i], "--cell-bits=", 12) == 0) {
+      size_t bits = 0;
+      valid = parse_size(argv[i] + 12, &bits) && (bits == 8 || bits == 16 || bits == 32);
+      config.cell_size = bits / 8;
+    }
+    else if (strncmp(argv[i], "--tape-max=", 11) == 0) {
+      valid = parse_size(argv[i] + 11, &config.max_length);
+    }
+    else if (strncmp(argv[i], "--tape-initial=", 15) == 0) {
+      valid = parse_size(argv[i] + 15, &config.initial_length);
+    }
+    else if (strncmp(argv[i], "--tape-grow=", 12) == 0) {
+      char* end;
+      config.grow_rate = strtod(argv[i] + 12, &end);
+      valid = (*end == '\0' && config.grow_rate > 1.0);
+    }
+    else if (strncmp(argv[i], "--max-depth=", 12) == 0) {
+      valid = parse_size(argv[i] + 12, &config.max_depth);
+    }
+    else if (strcmp(argv[i], "--no-cache") == 0) {
+      use_cache = 0;
+    }
+    else if (strcmp(argv[i], "--batch") == 0) {
+      batch = 1;
+    }
+    else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+      valid = parse_size(argv[i] + 7, &jobs);
+    }
+    else if (strncmp(argv[i], "--out-dir=", 10) == 0) {
+      out_dir = argv[i] + 10;
+    }
+    else if (strcmp(argv[i], "--profile") == 0) {
+      profile_path = "bfpp.prof";
+    }
+    else if (strncmp(argv[i], "--profile=", 10) == 0) {
+      profile_path = argv[i] + 10;
+      valid = (*profile_path != '\0');
+    }
+    else if (strcmp(argv[i], "--memo") == 0) {
+      memo_entries = MEMO_ENTRIES;
+    }
+    else if (strncmp(argv[i], "--memo=", 7) == 0) {
+      valid = parse_size(argv[i] + 7, &memo_entries);
+    }
+    else if (strncmp(argv[i], "--checkpoint=", 13) == 0) {
+      checkpoint_path = argv[i] + 13;
+      valid = (*checkpoint_path != '\0');
+    }
+    else if (strncmp(argv[i], "--checkpoint-every=", 19) == 0) {
+      valid = parse_size(argv[i] + 19, &checkpoint_every);
+    }
+    else if (strncmp(argv[i], "--resume=", 9) == 0) {
+      resume_path = argv[i] + 9;
+      valid = (*resume_path != '\0');
+    }
+#ifdef BF_STATS
+    else if (strcmp(argv[i], "--stats") == 0) {
+      stats_format = 1;
+    }
+    else if (strcmp(argv[i], "--stats=json") == 0) {
+      stats_format = 2;
+    }
+#endif
+    else if (strncmp(argv[i], "--", 2) == 0) {
+      valid = 0;
+    }
+    else if (fpath != NULL) {
+      inputs[input_count++] = argv[i];
+    }
+    else {
+      fpath = strdup(argv[i]);
+    }
+
+    if (!valid) {
+      print_usage(argv[0]);
+      free(fpath);
+      free(inputs);
+      return 1;
+    }
+  }
+
+  /*
+   * Only a batch takes more than one file, and is neither profiled, memoised,
+   * checkpointed nor counted; nor is a run more than one of profiled,
+   * checkpointed and counted
+   */
+  int checkpointed = (checkpoint_path != NULL || resume_path != NULL);
+  int cores = (profile_path != NULL) + checkpointed + (stats_format > 0);
+  if ((batch ? (fpath == NULL || memo_entries > 0 || cores > 0) : (input_count > 0))
+    || cores > 1 || (checkpoint_every > 0 && !checkpointed)) {
+    print_usage(argv[0]);
+    free(fpath);
+    free(inputs);
+    return 1;
+  }
+
+  /* A tape never starts out longer than it may grow to */
+  if (config.initial_length > config.max_length) {
+    config.initial_length = config.max_length;
+  }
+  if (config.max_length > TAPE_MAX_LIMIT) {
+    print_usage(argv[0]);
+    free(fpath);
+    free(inputs);
+    return 1;
+  }
+
+  if (batch) {
+    BFProgram* program;
+    const char* error;
+    if (program_load_file(fpath, &config, engine, &program, &error) != BF_OK) {
+      printf("%s\n", error);
+      free(fpath);
+      free(inputs);
+      return 1;
+    }
+
+    int failed = batch_run(program, inputs, input_count, out_dir, jobs);
+
+    program_free(program);
+    jit_free();
+    free(fpath);
+    free(inputs);
+    return (failed > 0) ? 1 : 0;
+  }
+  free(inputs);
+
+  io_init();
+
+  if (fpath == NULL) {
     int len = 0;
     printf("Enter path to source file to run: ");
     int c;
-    while ((c = getchar()) != '\n') {
+    while ((c = io_getc()) != '\n' && c != EOF) {
       len++;
       fpath = (char*) realloc(fpath, len);
       fpath[len-1] = (char) c;
@@ -26,27 +291,98 @@ int main(int argc, char** argv) {
     fpath = (char*) realloc(fpath, len+1);
     fpath[len] = '\0';
   }
-  else if (argc == 2) {
-    fpath = strdup(argv[1]);
-  }
 
-  BFVM* vm = vm_create();
+  BFVM* vm = vm_create(&config);
+  vm->engine = engine;
 
-  int res = lex_file(fpath, vm);
+  /* A profiled run needs the source positions of its ops, which are not cached */
+  int res = (profile_path != NULL) ? profile_load(fpath, &vm->code) : cache_load(fpath, &vm->code, use_cache);
   if (res == -1) {
     printf("File at path %s not found\n", fpath);
     vm_destroy(vm);
     free(fpath);
     return 1;
   }
-  free(fpath);
+  vm->ip = vm->code.ops;
+
+  /* Ops mapped from the cache are not the VM's to free */
+  int cached = (res == 1);
+
+  if (emit) {
+    emit_c(&vm->code, &config, stdout);
+    if (cached) { cache_release(&vm->code); }
+    vm_destroy(vm);
+    free(fpath);
+    return 0;
+  }
+
+  BFMemo* memo = NULL;
+  if (memo_entries > 0) {
+    memo = memo_create(memo_entries);
+    vm->memo = memo;
+  }
+
+  BFCheckpoint* checkpoint = NULL;
+  if (checkpointed) {
+    checkpoint = checkpoint_create((checkpoint_path != NULL) ? checkpoint_path : resume_path, checkpoint_every);
+    vm->checkpoint = checkpoint;
+  }
+  if (resume_path != NULL) {
+    checkpoint_restore(vm, resume_path);
+
+    uint64_t read, written;
+    io_counts(&read, &written);
+    fprintf(stderr, "Resuming from %s, with %llu bytes of input already read and %llu of output already written\n",
+      resume_path, (unsigned long long) read, (unsigned long long) written);
+  }
+
+#ifdef BF_STATS
+  BFStats* stats = NULL;
+  if (stats_format > 0) {
+    stats = stats_create(&config, stats_format == 2);
+  }
+#endif
 
   enter_raw_mode();
-  vm_run(vm);
+  if (profile_path != NULL) {
+    res = run_profiled(vm, fpath, profile_path);
+  }
+#ifdef BF_STATS
+  else if (stats != NULL) {
+    run_with_stats(vm, stats);
+  }
+#endif
+  else {
+    vm_run(vm);
+  }
+  io_flush();
   exit_raw_mode();
   printf("\n");
 
+  if (profile_path != NULL) {
+    if (res == 0) { fprintf(stderr, "Profile written to %s and %s.folded\n", profile_path, profile_path); }
+    else { fprintf(stderr, "Could not write profile to %s\n", profile_path); }
+  }
+  if (memo != NULL) {
+    memo_report(memo, stderr);
+    vm->memo = NULL;
+    memo_free(memo);
+  }
+  if (checkpoint != NULL) {
+    vm->checkpoint = NULL;
+    checkpoint_free(checkpoint);
+  }
+#ifdef BF_STATS
+  if (stats != NULL) {
+    stats_report(stats, stderr);
+    stats_free(stats);
+  }
+#endif
+  free(fpath);
+
+  if (cached) { cache_release(&vm->code); }
   vm_destroy(vm);
+  jit_free();
 
 #ifdef DEBUG_MLTRACK
   TRACK_status(TRACK_print_chars);
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bfplusplus.h"
+
+/*
+ * Memoisation of calls of pure functions (--memo).
+ *
+ * Lowering flags each function body that can have no effect beyond its
+ * results as FN_PURE (see mark_pure_fns() in lower.c). With a memo table, the
+ * engines make each call of such a function through memo_call(), which looks
+ * the call up by the function's code and the values of its arguments: if it
+ * has been made before, its results are copied straight to the caller and the
+ * function is not run. Otherwise the call is made as usual, with its key kept
+ * in its VM, and its results are recorded as it returns (memo_return()).
+ *
+ * The table is bounded, dropping the least recently used call to make room
+ * for each new one once full, so that memory use stays fixed however many
+ * distinct calls a run makes. Each VM of a run shares its table, so a table
+ * is only ever used by one thread.
+ */
+
+/*
+ * Adds a value to a hash, mixed in as by fn_table_hash() in utils.c
+ */
+static uint64_t memo_mix(uint64_t hash, uint64_t value) {
+  hash = (hash ^ value) * 0x9E3779B97F4A7C15ull;
+  return hash ^ (hash >> 29);
+}
+
+/*
+ * Makes the key of a call of a pure function from the caller's VM, returning
+ * 0 if the call cannot be memoised: because it passes or returns too many
+ * cells, passes a function, or would fault, by nesting beyond the maximum
+ * depth or returning results beyond the tape, which it must still do as usual.
+ * The arguments are known to be on the tape (see vm_call_target()).
+ */
+static int memo_key(const BFVM* vm, const BFFn* fn, const BFCallSite* site, BFMemoKey* key) {
+  size_t index = VM_INDEX(vm);
+
+  if ((size_t) site->arg_count + site->res_count > MEMO_MAX_CELLS) { return 0; }
+  if (vm->depth >= vm->config.max_depth) { return 0; }
+  if (index + site->res_count >= vm->config.max_length) { return 0; }
+
+  key->ops = fn->code.ops;
+  key->arg_count = site->arg_count;
+  key->res_count = site->res_count;
+
+  uint64_t hash = memo_mix(memo_mix(0, (uint64_t) (uintptr_t) key->ops), ((uint64_t) site->arg_count << 16) | site->res_count);
+  size_t args = index - site->arg_count;
+  for (size_t i=0; i<site->arg_count; i++) {
+    if (VM_IS_FN(vm, args + i)) { return 0; }
+    key->cells[i] = vm_get_value(vm, args + i);
+    hash = memo_mix(hash, key->cells[i]);
+  }
+  key->hash = (uint32_t) (hash >> 32);
+  return 1;
+}
+
+/*
+ * Index of the entry for a key in the table, or MEMO_NONE if there is none
+ */
+static uint32_t memo_find(const BFMemo* memo, const BFMemoKey* key) {
+  uint32_t i = memo->buckets[key->hash & (memo->bucket_count - 1)];
+  while (i != MEMO_NONE) {
+    const BFMemoKey* other = &memo->entries[i].key;
+    if (other->hash == key->hash && other->ops == key->ops && other->arg_count == key->arg_count
+      && other->res_count == key->res_count
+      && memcmp(other->cells, key->cells, sizeof(size_bf) * key->arg_count) == 0) {
+      return i;
+    }
+    i = memo->entries[i].chain;
+  }
+  return MEMO_NONE;
+}
+
+/*
+ * Takes an entry out of the list of entries by use
+ */
+static void memo_unlink(BFMemo* memo, uint32_t i) {
+  BFMemoEntry* entry = &memo->entries[i];
+  if (entry->newer != MEMO_NONE) { memo->entries[entry->newer].older = entry->older; }
+  else { memo->newest = entry->older; }
+  if (entry->older != MEMO_NONE) { memo->entries[entry->older].newer = entry->newer; }
+  else { memo->oldest = entry->newer; }
+}
+
+/*
+ * Puts an entry at the start of the list of entries by use, as the newest
+ */
+static void memo_link(BFMemo* memo, uint32_t i) {
+  BFMemoEntry* entry = &memo->entries[i];
+  entry->newer = MEMO_NONE;
+  entry->older = memo->newest;
+  if (memo->newest != MEMO_NONE) { memo->entries[memo->newest].newer = i; }
+  else { memo->oldest = i; }
+  memo->newest = i;
+}
+
+/*
+ * Adds a call with its results to the table, in place of the least recently
+ * used once the table is full
+ */
+static void memo_insert(BFMemo* memo, const BFMemoKey* key) {
+  uint32_t i;
+  if (memo->length < memo->capacity) {
+    i = (uint32_t) memo->length++;
+  }
+  else {
+    i = memo->oldest;
+    memo_unlink(memo, i);
+
+    uint32_t* link = &memo->buckets[memo->entries[i].key.hash & (memo->bucket_count - 1)];
+    while (*link != i) {
+      link = &memo->entries[*link].chain;
+    }
+    *link = memo->entries[i].chain;
+  }
+
+  BFMemoEntry* entry = &memo->entries[i];
+  entry->key = *key;
+  uint32_t* bucket = &memo->buckets[key->hash & (memo->bucket_count - 1)];
+  entry->chain = *bucket;
+  *bucket = i;
+  memo_link(memo, i);
+}
+
+/*
+ * Creates an empty memo table holding up to 'capacity' calls
+ */
+BFMemo* memo_create(size_t capacity) {
+  BFMemo* memo = (BFMemo*) malloc(sizeof(BFMemo));
+  if (memo == NULL) { throw_fault("not enough memory for memo table"); }
+
+  if (capacity == 0) { capacity = 1; }
+  if (capacity >= MEMO_NONE) { capacity = MEMO_NONE - 1; }
+  memo->bucket_count = 1;
+  while (memo->bucket_count < capacity) {
+    memo->bucket_count *= 2;
+  }
+
+  memo->entries = (BFMemoEntry*) malloc(sizeof(BFMemoEntry) * capacity);
+  memo->buckets = (uint32_t*) malloc(sizeof(uint32_t) * memo->bucket_count);
+  if (memo->entries == NULL || memo->buckets == NULL) { throw_fault("not enough memory for memo table"); }
+  memset(memo->buckets, 0xff, sizeof(uint32_t) * memo->bucket_count);
+
+  memo->length = 0;
+  memo->capacity = capacity;
+  memo->newest = MEMO_NONE;
+  memo->oldest = MEMO_NONE;
+  memo->calls = 0;
+  memo->hits = 0;
+  return memo;
+}
+
+/*
+ * Makes a call of a pure function (see VM_MEMOISES()) through the VM's memo
+ * table, with its function and arguments checked by vm_call_target().
+ *
+ * If the table holds the call, its results are copied to the caller's cells
+ * after the current one, as vm_call_return() would, and NULL is returned: the
+ * caller carries on after the call. Otherwise the call is started as by
+ * vm_call_enter(), in a new frame (even for a tail call), to be ended with
+ * memo_return() if it is to be recorded (see VM_MEMO_PENDING()).
+ */
+BFVM* memo_call(BFVM* vm, BFFn* fn, const BFCallSite* site) {
+  BFMemo* memo = vm->memo;
+  BFMemoKey key;
+  if (!memo_key(vm, fn, site, &key)) {
+    return vm_call_enter(vm, fn, site);
+  }
+
+  memo->calls++;
+  uint32_t i = memo_find(memo, &key);
+  if (i != MEMO_NONE) {
+    memo->hits++;
+    memo_unlink(memo, i);
+    memo_link(memo, i);
+
+    const BFMemoKey* found = &memo->entries[i].key;
+    size_t results = VM_INDEX(vm) + 1;
+    for (size_t r=0; r<found->res_count; r++) {
+      BFCell result = { TYPE_VALUE, { .VALUE = found->cells[found->arg_count + r] } };
+      vm_set_cell(vm, results + r, result);
+    }
+    return NULL;
+  }
+
+  BFVM* callvm = vm_call_enter(vm, fn, site);
+  callvm->memo_key = key;
+  return callvm;
+}
+
+/*
+ * Ends a call started by memo_call() as vm_call_return() does, recording its
+ * results in the memo table unless any of them is a function. Returns the
+ * parent, to carry on running.
+ */
+BFVM* memo_return(BFVM* callvm) {
+  BFMemoKey key = callvm->memo_key;
+  callvm->memo_key.ops = NULL;
+  BFVM* vm = vm_call_return(callvm);
+
+  size_t results = VM_INDEX(vm) + 1;
+  for (size_t r=0; r<key.res_count; r++) {
+    if (VM_IS_FN(vm, results + r)) { return vm; }
+    key.cells[key.arg_count + r] = vm_get_value(vm, results + r);
+  }
+  memo_insert(vm->memo, &key);
+  return vm;
+}
+
+/*
+ * Writes the hit rate of a memo table, as a line of text
+ */
+void memo_report(const BFMemo* memo, FILE* out) {
+  double rate = (memo->calls == 0) ? 0.0 : 100.0 * (double) memo->hits / (double) memo->calls;
+  fprintf(out, "Memo: %llu of %llu calls of pure functions answered from the table (%.1f%%), %lu of %lu entries used\n",
+    (unsigned long long) memo->hits, (unsigned long long) memo->calls, rate,
+    (unsigned long) memo->length, (unsigned long) memo->capacity);
+}
+
+void memo_free(BFMemo* memo) {
+  free(memo->entries);
+  free(memo->buckets);
+  free(memo);
+}
@@ -0,0 +1,592 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bfplusplus.h"
+
+/*
+ * Profiling of a program's run (--profile), to find the loops and functions
+ * it spends its time in.
+ *
+ * The program is lowered with the source offset of each op, and run with the
+ * profiling cores (bfcore.h with VM_PROFILE), which count every op they run,
+ * and every call made as it enters the VM of the call, under the path of calls
+ * leading to it. The usual cores and the lowering without offsets are left
+ * exactly as they were, so nothing is counted (or checked) unless profiling.
+ *
+ * Counts are of source instructions: an op counts as many as were folded into
+ * it (e.g. 5 for +++++), and other ops, including idiom ops doing the work of
+ * a whole loop, as one.
+ *
+ * The report lists the hottest instructions, loops, functions and call paths
+ * by source line and column. The call paths are also written out as collapsed
+ * stacks, one line per path: its functions from the main program down,
+ * separated by ;, then the instructions run by the path itself, as read by
+ * flamegraph.pl and similar tools.
+ */
+
+/* Most entries listed in each section of the report */
+#define PROFILE_TOP 30
+
+/*
+ * Loads the code of a source file for profiling, lexed and lowered with the
+ * source offset of each op, into 'code', which should be empty. Profiled code
+ * is never cached, as the cache does not keep offsets.
+ *
+ * Returns -1 if the file is not found; otherwise 0
+ */
+int profile_load(const char* fpath, BFCode* code) {
+  BFSource source;
+  if (source_open(fpath, &source) == -1) {
+    return -1;
+  }
+
+  BFInstructions insts = { NULL, 0, NULL };
+  insts.offsets = (uint32_t*) malloc(sizeof(uint32_t));
+  if (insts.offsets == NULL) { throw_fault("not enough memory to lex program"); }
+
+  lex_memory(source.src, source.length, &insts);
+  source_close(&source);
+
+  lower_instructions(&insts, code);
+  free(insts.insts);
+  free(insts.offsets);
+  return 0;
+}
+
+/*
+ * Creates an empty profile for a run of the given code, to be set as the
+ * profile of the VM running it
+ */
+BFProfile* profile_create(const BFCode* code) {
+  BFProfile* out = (BFProfile*) calloc(1, sizeof(BFProfile));
+  if (out == NULL) { throw_fault("not enough memory to profile program"); }
+
+  out->ops = code->ops;
+  out->length = code->length;
+  out->counts = (uint64_t*) calloc(code->length + 1, sizeof(uint64_t));
+  out->weights = (uint32_t*) calloc(code->length + 1, sizeof(uint32_t));
+  if (out->counts == NULL || out->weights == NULL) { throw_fault("not enough memory to profile program"); }
+
+  for (size_t i=0; i<code->length; i++) {
+    const BFOp* op = &code->ops[i];
+
+    switch (op->code) {
+      case OP_ADD:
+      case OP_MOVE:
+      case OP_MOVE_UNCHECKED:
+      case OP_GET_CHAR:
+      case OP_PUT_CHAR:
+        out->weights[i] = (uint32_t) (op->as.arg < 0 ? -(int64_t) op->as.arg : op->as.arg);
+        break;
+
+      case OP_MUL_TERM:
+        /* Part of the OP_MUL_LOOP before it */
+        out->weights[i] = 0;
+        break;
+
+      case OP_INLINE:
+      case OP_INLINE_END:
+        /* Not in the source; the profiling core always makes the call */
+        out->weights[i] = 0;
+        break;
+
+      case OP_RANGE:
+        /* Not in the source; the profiling core always runs the original loop */
+        out->weights[i] = 0;
+        break;
+
+      default:
+        out->weights[i] = 1;
+        break;
+    }
+  }
+
+  out->root.def = PROFILE_MAIN;
+  out->current = &out->root;
+  return out;
+}
+
+/*
+ * Counts a call of a function (or the run of the main program if 'fn' is NULL)
+ * from the current call path, returning the path of the call, which becomes
+ * the current one until the call ends (profile_leave()). A call of the
+ * function of the current path from itself stays on that path.
+ */
+BFProfileNode* profile_enter(BFProfile* profile, const BFFn* fn) {
+  if (fn == NULL) {
+    profile->root.calls++;
+    return &profile->root;
+  }
+
+  /* The body of a function starts just after its { */
+  size_t def = (size_t) (fn->code.ops - profile->ops) - 1;
+  BFProfileNode* parent = profile->current;
+
+  if (parent->def == def) {
+    parent->calls++;
+    if (++parent->repeats > parent->max_repeats) { parent->max_repeats = parent->repeats; }
+    return parent;
+  }
+
+  BFProfileNode* node = parent->children;
+  while (node != NULL && node->def != def) {
+    node = node->sibling;
+  }
+
+  if (node == NULL) {
+    node = (BFProfileNode*) calloc(1, sizeof(BFProfileNode));
+    if (node == NULL) { throw_fault("not enough memory to profile program"); }
+    node->def = def;
+    node->parent = parent;
+    node->sibling = parent->children;
+    parent->children = node;
+  }
+
+  node->calls++;
+  profile->current = node;
+  return node;
+}
+
+/*
+ * Ends the call of the current call path, returning the path it returns to,
+ * which becomes the current one: the same path if the call was made by the
+ * function itself
+ */
+BFProfileNode* profile_leave(BFProfile* profile) {
+  BFProfileNode* node = profile->current;
+  if (node->repeats > 0) {
+    node->repeats--;
+  }
+  else if (node->parent != NULL) {
+    profile->current = node->parent;
+  }
+  return profile->current;
+}
+
+/*
+ * Steps through the tree of call paths in depth-first order without recursion
+ * (paths may be as deep as the calls were), from 'node' to the next path to
+ * visit. Sets 'up' to the paths left on the way, whose children have all been
+ * visited, in order: each is the parent of the one before it. Returns NULL at
+ * the end.
+ */
+static BFProfileNode* profile_next(BFProfileNode* node, BFProfileNode*** up, size_t* up_count, size_t* up_capacity) {
+  *up_count = 0;
+  if (node->children != NULL) {
+    return node->children;
+  }
+
+  while (node != NULL) {
+    if (*up_count == *up_capacity) {
+      *up_capacity = (*up_capacity == 0) ? 64 : *up_capacity * 2;
+      *up = (BFProfileNode**) realloc(*up, sizeof(BFProfileNode*) * *up_capacity);
+      if (*up == NULL) { throw_fault("not enough memory to write profile"); }
+    }
+    (*up)[(*up_count)++] = node;
+
+    if (node->sibling != NULL) {
+      return node->sibling;
+    }
+    node = node->parent;
+  }
+  return NULL;
+}
+
+/*
+ * Source line and column of each op, found in one pass over the source as the
+ * ops are in source order
+ */
+static void profile_locate(const BFSource* source, const uint32_t* offsets, size_t length, uint32_t* lines, uint32_t* cols) {
+  size_t pos = 0;
+  uint32_t line = 1;
+  size_t line_start = 0;
+
+  for (size_t i=0; i<length; i++) {
+    size_t target = offsets[i];
+    if (target < pos) {
+      pos = 0;
+      line = 1;
+      line_start = 0;
+    }
+    for (; pos < target && pos < source->length; pos++) {
+      if (source->src[pos] == '\n') {
+        line++;
+        line_start = pos + 1;
+      }
+    }
+    lines[i] = line;
+    cols[i] = (uint32_t) (target - line_start + 1);
+  }
+}
+
+/*
+ * Name of the function of a call path in the report: the main program, or
+ * the source position of the function's {
+ */
+static void profile_fn_name(char* out, size_t def, const uint32_t* lines, const uint32_t* cols) {
+  if (def == PROFILE_MAIN) {
+    strcpy(out, "main");
+  }
+  else {
+    sprintf(out, "fn@%lu:%lu", (unsigned long) lines[def], (unsigned long) cols[def]);
+  }
+}
+
+/*
+ * Short source-like text of an op for the report, e.g. +5 for +++++
+ */
+static void profile_op_text(char* out, const BFOp* op) {
+  int32_t arg = op->as.arg;
+
+  switch (op->code) {
+    case OP_ADD: sprintf(out, "%c%ld", arg < 0 ? '-' : '+', arg < 0 ? -(long) arg : (long) arg); break;
+    case OP_MOVE: sprintf(out, "%c%ld", arg < 0 ? '<' : '>', arg < 0 ? -(long) arg : (long) arg); break;
+    case OP_GET_CHAR: sprintf(out, ",%ld", (long) arg); break;
+    case OP_PUT_CHAR: sprintf(out, ".%ld", (long) arg); break;
+    case OP_OPEN_LOOP: strcpy(out, "["); break;
+    case OP_CLOSE_LOOP: strcpy(out, "]"); break;
+    case OP_OPEN_FN: strcpy(out, "{"); break;
+    case OP_CLOSE_FN: strcpy(out, "}"); break;
+    case OP_CLEAR: strcpy(out, "[-] idiom"); break;
+    case OP_MUL_LOOP: strcpy(out, "mul idiom"); break;
+    case OP_MUL_TERM: strcpy(out, "mul term"); break;
+    case OP_INLINE: strcpy(out, "inline"); break;
+    case OP_INLINE_END: strcpy(out, "inline end"); break;
+    case OP_RANGE: strcpy(out, "range check"); break;
+    case OP_MOVE_UNCHECKED: sprintf(out, "%c%ld", arg < 0 ? '<' : '>', arg < 0 ? -(long) arg : (long) arg); break;
+
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      if (op->as.call.scope == SCOPE_GLOBAL) { strcpy(out, "(@"); }
+      else if (op->as.call.scope > 0) { sprintf(out, "('%ld", (long) op->as.call.scope); }
+      else { strcpy(out, "("); }
+      sprintf(out + strlen(out), "-%u+%u)", (unsigned) op->as.call.arg_count, (unsigned) op->as.call.res_count);
+      break;
+  }
+}
+
+/*
+ * Start of the loop whose [ is at 'open': the idiom op in front of it if it
+ * has one, otherwise the [ itself
+ */
+static size_t profile_loop_start(const BFCode* code, size_t open) {
+  size_t close = open + (size_t) code->ops[open].as.arg;
+  size_t prefix = open;
+
+  while (prefix > 0 && code->ops[prefix-1].code == OP_MUL_TERM) {
+    prefix--;
+  }
+  if (prefix > 0 && (code->ops[prefix-1].code == OP_CLEAR || code->ops[prefix-1].code == OP_MUL_LOOP)
+    && prefix - 1 + (size_t) code->ops[prefix-1].as.loop.skip == close) {
+    return prefix - 1;
+  }
+  return open;
+}
+
+/* An entry of a section of the report, sorted by key, largest first */
+typedef struct {
+  uint64_t key;
+  size_t index;
+} ProfileEntry;
+
+static int profile_entry_cmp(const void* a, const void* b) {
+  const ProfileEntry* x = (const ProfileEntry*) a;
+  const ProfileEntry* y = (const ProfileEntry*) b;
+  if (x->key != y->key) { return (x->key < y->key) ? 1 : -1; }
+  return (x->index > y->index) - (x->index < y->index);
+}
+
+/* Percentage of the whole run */
+static double profile_percent(uint64_t n, uint64_t total) {
+  return (total == 0) ? 0.0 : 100.0 * (double) n / (double) total;
+}
+
+/*
+ * Writes the report of a profiled run of 'code', loaded from the source file
+ * at 'fpath', to 'out_path', and the call paths as collapsed stacks to
+ * 'out_path' with .folded appended.
+ *
+ * Returns -1 if either file cannot be written; otherwise 0
+ */
+int profile_write(const BFProfile* profile, const BFCode* code, const char* fpath, const char* out_path) {
+  BFProfileNode* root = (BFProfileNode*) &profile->root;
+  size_t length = code->length;
+  char name[64];
+  char text[64];
+
+  /* Source positions */
+  uint32_t* lines = (uint32_t*) calloc(length + 1, sizeof(uint32_t));
+  uint32_t* cols = (uint32_t*) calloc(length + 1, sizeof(uint32_t));
+  if (lines == NULL || cols == NULL) { throw_fault("not enough memory to write profile"); }
+
+  BFSource source;
+  if (code->offsets != NULL && source_open(fpath, &source) == 0) {
+    profile_locate(&source, code->offsets, length, lines, cols);
+    source_close(&source);
+  }
+
+  /* Sum up the instructions of each call path along with the calls it made */
+  BFProfileNode** up = NULL;
+  size_t up_count = 0;
+  size_t up_capacity = 0;
+  size_t node_count = 0;
+  uint64_t calls = 0;
+
+  for (BFProfileNode* node = root; node != NULL; ) {
+    node->total = 0;
+    node_count++;
+    if (node != root) { calls += node->calls; }
+
+    node = profile_next(node, &up, &up_count, &up_capacity);
+    for (size_t u=0; u<up_count; u++) {
+      up[u]->total += up[u]->self;
+      if (up[u]->parent != NULL) { up[u]->parent->total += up[u]->total; }
+    }
+  }
+  uint64_t total = root->total;
+
+  /* Instructions run by each op, summed so far for the loops */
+  uint64_t* sums = (uint64_t*) calloc(length + 1, sizeof(uint64_t));
+  ProfileEntry* entries = (ProfileEntry*) malloc(sizeof(ProfileEntry) * (length + node_count + 1));
+  if (sums == NULL || entries == NULL) { throw_fault("not enough memory to write profile"); }
+
+  uint64_t dispatched = 0;
+  for (size_t i=0; i<length; i++) {
+    sums[i+1] = sums[i] + profile->counts[i] * profile->weights[i];
+    dispatched += profile->counts[i];
+  }
+
+  FILE* out = fopen(out_path, "w");
+  if (out == NULL) {
+    free(lines);
+    free(cols);
+    free(up);
+    free(sums);
+    free(entries);
+    return -1;
+  }
+
+  fprintf(out, "Profile of %s\n", fpath);
+  fprintf(out, "  %llu instructions run, %llu ops dispatched, %llu calls\n\n",
+    (unsigned long long) total, (unsigned long long) dispatched, (unsigned long long) calls);
+
+  /* Hottest instructions */
+  size_t count = 0;
+  for (size_t i=0; i<length; i++) {
+    if (profile->counts[i] == 0) { continue; }
+    entries[count].key = profile->counts[i] * profile->weights[i];
+    entries[count].index = i;
+    count++;
+  }
+  qsort(entries, count, sizeof(ProfileEntry), profile_entry_cmp);
+
+  fprintf(out, "Instructions (by instructions run)\n");
+  fprintf(out, "  %-14s %-14s %16s %16s %7s\n", "line:col", "op", "runs", "instructions", "%");
+  for (size_t e=0; e<count && e<PROFILE_TOP; e++) {
+    size_t i = entries[e].index;
+    sprintf(name, "%lu:%lu", (unsigned long) lines[i], (unsigned long) cols[i]);
+    profile_op_text(text, &code->ops[i]);
+    fprintf(out, "  %-14s %-14s %16llu %16llu %6.2f%%\n", name, text,
+      (unsigned long long) profile->counts[i], (unsigned long long) entries[e].key,
+      profile_percent(entries[e].key, total));
+  }
+  fprintf(out, "\n");
+
+  /*
+   * Hottest loops, along with their idiom op if any: the ops within the
+   * brackets are those of the loop body (and any function defined in it)
+   */
+  count = 0;
+  for (size_t i=0; i<length; i++) {
+    if (code->ops[i].code != OP_OPEN_LOOP) { continue; }
+    size_t close = i + (size_t) code->ops[i].as.arg;
+    size_t start = profile_loop_start(code, i);
+
+    if (profile->counts[i] == 0 && profile->counts[start] == 0) { continue; }
+    entries[count].key = sums[close + 1] - sums[start];
+    entries[count].index = i;
+    count++;
+  }
+  qsort(entries, count, sizeof(ProfileEntry), profile_entry_cmp);
+
+  fprintf(out, "Loops (by instructions run within the brackets)\n");
+  fprintf(out, "  %-14s %16s %16s %16s %16s %7s\n", "line:col", "entered", "iterations", "as idiom", "instructions", "%");
+  for (size_t e=0; e<count && e<PROFILE_TOP; e++) {
+    size_t i = entries[e].index;
+    size_t close = i + (size_t) code->ops[i].as.arg;
+    size_t start = profile_loop_start(code, i);
+
+    sprintf(name, "%lu:%lu", (unsigned long) lines[i], (unsigned long) cols[i]);
+    if (start != i) { sprintf(text, "%llu", (unsigned long long) profile->counts[start]); }
+    else { strcpy(text, "-"); }
+    fprintf(out, "  %-14s %16llu %16llu %16s %16llu %6.2f%%\n", name,
+      (unsigned long long) profile->counts[i], (unsigned long long) profile->counts[close], text,
+      (unsigned long long) entries[e].key, profile_percent(entries[e].key, total));
+  }
+  fprintf(out, "\n");
+
+  /*
+   * Functions, by their { ops: inclusive counts take each outermost call of a
+   * function on a path, so recursive calls are not counted twice
+   */
+  uint64_t* fn_calls = (uint64_t*) calloc(length + 1, sizeof(uint64_t));
+  uint64_t* fn_self = (uint64_t*) calloc(length + 1, sizeof(uint64_t));
+  uint64_t* fn_total = (uint64_t*) calloc(length + 1, sizeof(uint64_t));
+  size_t* active = (size_t*) calloc(length + 1, sizeof(size_t));
+  if (fn_calls == NULL || fn_self == NULL || fn_total == NULL || active == NULL) { throw_fault("not enough memory to write profile"); }
+
+  for (BFProfileNode* node = root; node != NULL; ) {
+    if (node != root) {
+      fn_calls[node->def] += node->calls;
+      fn_self[node->def] += node->self;
+      if (active[node->def]++ == 0) { fn_total[node->def] += node->total; }
+    }
+
+    node = profile_next(node, &up, &up_count, &up_capacity);
+    for (size_t u=0; u<up_count; u++) {
+      if (up[u] != root) { active[up[u]->def]--; }
+    }
+  }
+
+  count = 0;
+  for (size_t i=0; i<length; i++) {
+    if (fn_calls[i] == 0) { continue; }
+    entries[count].key = fn_total[i];
+    entries[count].index = i;
+    count++;
+  }
+  qsort(entries, count, sizeof(ProfileEntry), profile_entry_cmp);
+
+  fprintf(out, "Functions (by inclusive instructions)\n");
+  fprintf(out, "  %-14s %16s %16s %16s %7s\n", "function", "calls", "inclusive", "exclusive", "%");
+  for (size_t e=0; e<count && e<PROFILE_TOP; e++) {
+    size_t i = entries[e].index;
+    profile_fn_name(name, i, lines, cols);
+    fprintf(out, "  %-14s %16llu %16llu %16llu %6.2f%%\n", name,
+      (unsigned long long) fn_calls[i], (unsigned long long) fn_total[i], (unsigned long long) fn_self[i],
+      profile_percent(fn_total[i], total));
+  }
+  fprintf(out, "\n");
+
+  /* Call paths, with a function calling itself shown once, by how deep it went */
+  count = 0;
+  for (BFProfileNode* node = root; node != NULL; node = profile_next(node, &up, &up_count, &up_capacity)) {
+    entries[count].key = node->total;
+    entries[count].index = count;
+    count++;
+  }
+
+  BFProfileNode** nodes = (BFProfileNode**) malloc(sizeof(BFProfileNode*) * (count + 1));
+  if (nodes == NULL) { throw_fault("not enough memory to write profile"); }
+  count = 0;
+  for (BFProfileNode* node = root; node != NULL; node = profile_next(node, &up, &up_count, &up_capacity)) {
+    nodes[count++] = node;
+  }
+  qsort(entries, count, sizeof(ProfileEntry), profile_entry_cmp);
+
+  fprintf(out, "Call paths (by inclusive instructions)\n");
+  fprintf(out, "  %16s %16s %16s  %s\n", "inclusive", "exclusive", "calls", "path");
+  for (size_t e=0; e<count && e<PROFILE_TOP; e++) {
+    BFProfileNode* node = nodes[entries[e].index];
+    fprintf(out, "  %16llu %16llu %16llu  ", (unsigned long long) node->total,
+      (unsigned long long) node->self, (unsigned long long) node->calls);
+
+    /* The path from the main program down, into 'up' in reverse */
+    up_count = 0;
+    for (BFProfileNode* p = node; p != NULL; p = p->parent) {
+      if (up_count == up_capacity) {
+        up_capacity = (up_capacity == 0) ? 64 : up_capacity * 2;
+        up = (BFProfileNode**) realloc(up, sizeof(BFProfileNode*) * up_capacity);
+        if (up == NULL) { throw_fault("not enough memory to write profile"); }
+      }
+      up[up_count++] = p;
+    }
+    for (size_t u=up_count; u>0; u--) {
+      profile_fn_name(name, up[u-1]->def, lines, cols);
+      fprintf(out, "%s%s", (u == up_count) ? "" : " > ", name);
+      if (up[u-1]->max_repeats > 0) { fprintf(out, " x%llu", (unsigned long long) up[u-1]->max_repeats + 1); }
+    }
+    fprintf(out, "\n");
+  }
+
+  int failed = (fclose(out) != 0);
+
+  /* Collapsed stacks: the path to each node is built up in 'stack' as it is visited */
+  char* folded_path = (char*) malloc(strlen(out_path) + 8);
+  if (folded_path == NULL) { throw_fault("not enough memory to write profile"); }
+  sprintf(folded_path, "%s.folded", out_path);
+
+  FILE* folded = fopen(folded_path, "w");
+  if (folded == NULL) {
+    failed = 1;
+  }
+  else {
+    char* stack = NULL;
+    size_t stack_length = 0;
+    size_t stack_capacity = 0;
+
+    for (BFProfileNode* node = root; node != NULL; ) {
+      profile_fn_name(name, node->def, lines, cols);
+      size_t name_length = strlen(name) + 1;
+      if (stack_length + name_length + 1 > stack_capacity) {
+        stack_capacity = (stack_length + name_length + 1) * 2;
+        stack = (char*) realloc(stack, stack_capacity);
+        if (stack == NULL) { throw_fault("not enough memory to write profile"); }
+      }
+      sprintf(stack + stack_length, "%s%s", (node == root) ? "" : ";", name);
+      stack_length += name_length - (node == root);
+
+      if (node->self > 0) {
+        fprintf(folded, "%s %llu\n", stack, (unsigned long long) node->self);
+      }
+
+      node = profile_next(node, &up, &up_count, &up_capacity);
+      for (size_t u=0; u<up_count; u++) {
+        profile_fn_name(name, up[u]->def, lines, cols);
+        stack_length -= strlen(name) + (up[u] != root);
+      }
+    }
+
+    free(stack);
+    failed = (fclose(folded) != 0) || failed;
+  }
+
+  free(folded_path);
+  free(nodes);
+  free(fn_calls);
+  free(fn_self);
+  free(fn_total);
+  free(active);
+  free(lines);
+  free(cols);
+  free(up);
+  free(sums);
+  free(entries);
+  return failed ? -1 : 0;
+}
+
+/*
+ * Frees a profile and its tree of call paths
+ */
+void profile_free(BFProfile* profile) {
+  BFProfileNode* root = &profile->root;
+  BFProfileNode* node = root->children;
+
+  /* Free each path once all its children have been freed */
+  while (node != NULL) {
+    if (node->children != NULL) {
+      node = node->children;
+      continue;
+    }
+    BFProfileNode* parent = node->parent;
+    parent->children = node->sibling;
+    free(node);
+    node = (parent == root) ? root->children : parent;
+  }
+
+  free(profile->counts);
+  free(profile->weights);
+  free(profile);
+}
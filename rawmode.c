@@ -2,17 +2,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "rawmode.h"
+
+#ifdef _WIN32
+
+#include <io.h>
 #include <windows.h>
 
 static HWND console;
 static DWORD old_console_mode;
 static DWORD target_mode = ENABLE_INSERT_MODE | ENABLE_MOUSE_INPUT | ENABLE_PROCESSED_INPUT | ENABLE_PROCESSED_OUTPUT;
 static int mode_changed = 0;
+static int restore_registered = 0;
+
+static void restore_mode(void) {
+  exit_raw_mode();
+}
 
 int enter_raw_mode() {
   BOOL success;
   DWORD last_error;
 
+  /* Input from a pipe or file is not a console, so there is nothing to set */
+  if (!_isatty(_fileno(stdin))) {
+    return 0;
+  }
+
   console = GetStdHandle(STD_INPUT_HANDLE);
   if (console == INVALID_HANDLE_VALUE) {
     last_error = GetLastError();
@@ -34,6 +49,11 @@ int enter_raw_mode() {
     return 1;
   }
 
+  /* Put the console back however the process exits, e.g. on a fault */
+  if (!restore_registered) {
+    atexit(restore_mode);
+    restore_registered = 1;
+  }
   mode_changed = 1;
 
   return 0;
@@ -51,8 +71,75 @@ int exit_raw_mode() {
       printf("Error with GetConsoleMode %08lX\n", last_error);
       return 1;
     }
+    mode_changed = 0;
+
+  }
+
+  return 0;
+}
+
+#else
+
+#include <unistd.h>
+#include <termios.h>
+
+static struct termios old_termios;
+static int mode_changed = 0;
+static int restore_registered = 0;
+
+static void restore_mode(void) {
+  exit_raw_mode();
+}
+
+/*
+ * The same mode as on Windows for a terminal: no line editing or echo, but
+ * signals such as Ctrl-C still work
+ */
+int enter_raw_mode() {
+  struct termios raw;
+
+  /* Input from a pipe or file is not a terminal, so there is nothing to set */
+  if (!isatty(STDIN_FILENO)) {
+    return 0;
+  }
+
+  if (tcgetattr(STDIN_FILENO, &old_termios) != 0) {
+    printf("Error with tcgetattr\n");
+    return 1;
+  }
+
+  raw = old_termios;
+  raw.c_lflag &= ~(ICANON | ECHO);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != 0) {
+    printf("Error with tcsetattr\n");
+    return 1;
+  }
+
+  /* Put the terminal back however the process exits, e.g. on a fault */
+  if (!restore_registered) {
+    atexit(restore_mode);
+    restore_registered = 1;
+  }
+  mode_changed = 1;
+
+  return 0;
+}
+
+int exit_raw_mode() {
+  if (mode_changed) {
+
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &old_termios) != 0) {
+      printf("Error with tcsetattr\n");
+      return 1;
+    }
+    mode_changed = 0;
 
   }
 
   return 0;
 }
+
+#endif
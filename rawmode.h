@@ -1,6 +1,7 @@
 /*
- * A very crude implementation of a raw mode-like terminal for windows,
- * although not perfect
+ * A very crude implementation of a raw mode-like terminal for windows (and
+ * with termios elsewhere), although not perfect. Nothing is changed when stdin
+ * is not a terminal.
  *
  * implemented in rawmode.c
  */
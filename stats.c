@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "bfplusplus.h"
+
+#ifdef BF_STATS
+
+/*
+ * Statistics of a run (--stats), to tell what a program spends its time on:
+ * running ops, looping, calling, growing tapes, copying cells between frames
+ * or allocating.
+ *
+ * The counting core (bfcore.h) counts the ops run and the loops and calls
+ * made, and the runtime the rest (see VM_STAT()), into the BFStats shared by
+ * every VM of the run. The other cores count nothing, and the runtime only
+ * tests whether a VM has stats where it grows a tape, copies a cell between
+ * frames or allocates, so a run without --stats costs no more than before;
+ * with BF_NO_STATS defined, none of it is built. The counts are reported when
+ * the run ends, or faults, and whenever the process gets SIGUSR1, at the next
+ * ] or call.
+ */
+
+/* Names of the opcodes, as reported */
+static const char* const op_names[OP_CODE_COUNT] = {
+  [OP_ADD] = "add",
+  [OP_MOVE] = "move",
+  [OP_OPEN_LOOP] = "open_loop",
+  [OP_CLOSE_LOOP] = "close_loop",
+  [OP_OPEN_FN] = "open_fn",
+  [OP_CLOSE_FN] = "close_fn",
+  [OP_CALL] = "call",
+  [OP_TAIL_CALL] = "tail_call",
+  [OP_GET_CHAR] = "get_char",
+  [OP_PUT_CHAR] = "put_char",
+  [OP_CLEAR] = "clear",
+  [OP_MUL_LOOP] = "mul_loop",
+  [OP_MUL_TERM] = "mul_term",
+  [OP_INLINE] = "inline",
+  [OP_INLINE_END] = "inline_end",
+  [OP_RANGE] = "range",
+  [OP_MOVE_UNCHECKED] = "move_unchecked",
+};
+
+/* The stats SIGUSR1 asks to report */
+static BFStats* signalled = NULL;
+
+#ifdef SIGUSR1
+static void stats_signal(int sig) {
+  (void) sig;
+  if (signalled != NULL) { signalled->requested = 1; }
+}
+#endif
+
+/*
+ * Creates the stats of a run with the given tape config, to be reported as
+ * JSON if 'json' is set or as text otherwise, and whenever the process gets
+ * SIGUSR1
+ */
+BFStats* stats_create(const BFTapeConfig* config, int json) {
+  BFStats* stats = (BFStats*) calloc(1, sizeof(BFStats));
+  if (stats == NULL) { throw_fault("not enough memory for stats"); }
+
+  stats->main_peak = config->initial_length;
+  stats->call_peak = config->initial_length;
+  stats->cell_size = config->cell_size;
+  stats->json = json;
+
+  signalled = stats;
+#ifdef SIGUSR1
+  signal(SIGUSR1, stats_signal);
+#endif
+  return stats;
+}
+
+/*
+ * Writes the counts of a run so far, as lines of text or a line of JSON
+ */
+void stats_report(const BFStats* stats, FILE* out) {
+  unsigned long long total = 0;
+  for (int op=0; op<OP_CODE_COUNT; op++) {
+    total += stats->ops[op];
+  }
+
+  /* A function cell is copied as a reference to the function, a value in full */
+  unsigned long long bytes = (stats->cells_copied - stats->fns_copied) * stats->cell_size
+    + stats->fns_copied * sizeof(BFFn*);
+  unsigned long long call_peak = (stats->calls > 0) ? stats->call_peak : 0;
+
+  if (stats->json) {
+    fprintf(out, "{\"ops\":{");
+    for (int op=0; op<OP_CODE_COUNT; op++) {
+      fprintf(out, "%s\"%s\":%llu", (op > 0) ? "," : "", op_names[op], (unsigned long long) stats->ops[op]);
+    }
+    fprintf(out, "},\"ops_total\":%llu,\"loops\":%llu,\"iterations\":%llu,"
+      "\"calls\":%llu,\"frames_reused\":%llu,\"inlined\":%llu,\"max_depth\":%llu,"
+      "\"tape_grows\":%llu,\"main_tape_peak\":%llu,\"call_tape_peak\":%llu,"
+      "\"cells_copied\":%llu,\"fns_copied\":%llu,\"bytes_copied\":%llu,\"allocs\":%llu}\n",
+      total, (unsigned long long) stats->loops, (unsigned long long) stats->iterations,
+      (unsigned long long) stats->calls, (unsigned long long) stats->frames_reused,
+      (unsigned long long) stats->inlined, (unsigned long long) stats->max_depth,
+      (unsigned long long) stats->grows, (unsigned long long) stats->main_peak, call_peak,
+      (unsigned long long) stats->cells_copied, (unsigned long long) stats->fns_copied, bytes,
+      (unsigned long long) stats->allocs);
+    return;
+  }
+
+  fprintf(out, "Stats: %llu ops run, of which\n", total);
+  for (int op=0; op<OP_CODE_COUNT; op++) {
+    if (stats->ops[op] > 0) {
+      fprintf(out, "    %-16s %llu (%.1f%%)\n", op_names[op], (unsigned long long) stats->ops[op],
+        100.0 * (double) stats->ops[op] / (double) total);
+    }
+  }
+  fprintf(out, "  %llu loops entered, running %llu iterations\n",
+    (unsigned long long) stats->loops, (unsigned long long) stats->iterations);
+  fprintf(out, "  %llu calls, %llu of them in a reused frame, %llu inlined, nested at most %llu deep\n",
+    (unsigned long long) stats->calls, (unsigned long long) stats->frames_reused,
+    (unsigned long long) stats->inlined, (unsigned long long) stats->max_depth);
+  fprintf(out, "  %llu tape growths, to at most %llu cells for the main program and %llu for a call\n",
+    (unsigned long long) stats->grows, (unsigned long long) stats->main_peak, call_peak);
+  fprintf(out, "  %llu cells copied between frames, %llu of them functions, %llu bytes\n",
+    (unsigned long long) stats->cells_copied, (unsigned long long) stats->fns_copied, bytes);
+  fprintf(out, "  %llu allocations\n", (unsigned long long) stats->allocs);
+}
+
+void stats_free(BFStats* stats) {
+#ifdef SIGUSR1
+  signal(SIGUSR1, SIG_DFL);
+#endif
+  signalled = NULL;
+  free(stats);
+}
+
+#endif /* BF_STATS */
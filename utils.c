@@ -3,26 +3,70 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <io.h>
+#define read _read
+#define write _write
+#define isatty _isatty
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include "bfplusplus.h"
 
+/*
+ * Where faults on this thread unwind to, if anywhere (see fault_catch()), and
+ * the message of the last such fault
+ */
+static BF_THREAD_LOCAL jmp_buf* fault_target = NULL;
+static BF_THREAD_LOCAL const char* fault_last = NULL;
+
 /*
  * Exits with an error message.
  *
  * Quite a poor way of handling exceptions as it does not free/cleanup allocated
- * memory, but we assume the OS would do this.
+ * memory, but we assume the OS would do this. Where a target has been set by
+ * fault_catch(), it instead unwinds there with longjmp(), for the caller to
+ * clean up (see libbfpp.c).
  */
 void throw_fault(const char* msg) {
+  if (fault_target != NULL) {
+    fault_last = msg;
+    longjmp(*fault_target, 1);
+  }
+
+  io_flush();
   fprintf(stderr, "%s\n", msg);
   exit(1);
 }
 
 /*
- * Safely destroy a cell, by destroying the fn object associated if it is a
+ * Sets where faults on this thread unwind to, a jmp_buf filled by setjmp() in a
+ * function that is still running, or NULL to exit on faults again. Returns the
+ * previous target, to be set back afterwards.
+ */
+jmp_buf* fault_catch(jmp_buf* target) {
+  jmp_buf* previous = fault_target;
+  fault_target = target;
+  return previous;
+}
+
+/*
+ * The message of the last fault unwound on this thread
+ */
+const char* fault_message() {
+  return fault_last;
+}
+
+/*
+ * Safely destroy a cell, by releasing the fn object associated if it is a
  * function, otherwise does nothing.
  */
 void cell_destroy(BFCell cell) {
   if (cell.type == TYPE_FN) {
-    fn_destroy(cell.as.FN);
+    fn_release(cell.as.FN);
   }
 }
 
@@ -30,83 +74,205 @@ void cell_destroy(BFCell cell) {
  * Prints the current state of the cells to the console.
  */
 void cells_dump(BFVM* vm) {
-  for (int i=0; i<vm->tape_length; i++) {
-    if (vm->tape[i].type == TYPE_FN) {
-      printf("Cell %d is FN with %I64d instructions\n", i, vm->tape[i].as.FN->length);
+  for (size_t i=0; i<vm->tape_length; i++) {
+    if (VM_IS_FN(vm, i)) {
+      printf("Cell %zu is FN with %zu ops\n", i, vm_get_fn(vm, i)->code.length);
     }
     else {
-      printf("Cell %d is VALUE %d\n", i, vm->tape[i].as.VALUE);
+      printf("Cell %zu is VALUE %lu\n", i, (unsigned long) vm_get_value(vm, i));
+    }
+  }
+}
+
+/*----*/
+
+/*
+ * The program's input and output, bypassing stdio so that , and . cost little
+ * more than a byte copy.
+ *
+ * Input is read in blocks of IO_BUFFER_SIZE, or where stdin is a regular file
+ * mapped into memory whole by io_init(). Output is gathered into a buffer that
+ * is written when it fills, before blocking on input (so that prompts are seen),
+ * by io_flush() on exit or on a fault, and at each newline when stdout is a
+ * terminal, as stdio would. The bytes read by , and written by . are counted,
+ * for checkpoints to record how far the run has got (checkpoint.c).
+ */
+#define IO_BUFFER_SIZE (1 << 16)
+
+static struct {
+  const unsigned char* in;
+  size_t in_length;
+  int in_eof;
+  unsigned char in_buffer[IO_BUFFER_SIZE];
+
+  unsigned char out_buffer[IO_BUFFER_SIZE];
+  size_t out_length;
+  int out_tty;
+
+  uint64_t read;
+  uint64_t written;
+} io;
+
+/*
+ * Sets up the I/O for a run, mapping stdin if it is a regular file. Should be
+ * called before anything is read from stdin.
+ */
+void io_init() {
+  io.out_tty = isatty(1);
+
+#ifndef _WIN32
+  struct stat st;
+  off_t offset = lseek(0, 0, SEEK_CUR);
+  if (fstat(0, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0 && st.st_size > offset) {
+    void* map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, 0, 0);
+    if (map != MAP_FAILED) {
+      io.in = (const unsigned char*) map + offset;
+      io.in_length = (size_t) (st.st_size - offset);
+      io.in_eof = 1;
     }
   }
+#endif
 }
 
 /*
- * Wrapper for getchar() that returns correct type and ensures correct handling
- * of EOF
+ * Writes out everything put so far, along with anything printed through stdio
  */
-size_bf b_getchar() {
-  int c = getchar();
+void io_flush() {
+  fflush(stdout);
 
-  if (c == EOF || c == 0) {
-    return 0;
+  size_t done = 0;
+  while (done < io.out_length) {
+    int n = (int) write(1, io.out_buffer + done, (unsigned) (io.out_length - done));
+    if (n <= 0) { break; }
+    done += (size_t) n;
   }
-  else {
-    unsigned char uc = (unsigned char) c;
-    size_bf out = (size_bf) uc;
-    return out;
+  io.out_length = 0;
+}
+
+/*
+ * Reads the next byte of input, returning EOF once there is none left
+ */
+int io_getc() {
+  if (io.in_length == 0) {
+    if (io.in_eof) { return EOF; }
+
+    io_flush();
+    int n = (int) read(0, io.in_buffer, IO_BUFFER_SIZE);
+    if (n <= 0) {
+      io.in_eof = 1;
+      return EOF;
+    }
+    io.in = io.in_buffer;
+    io.in_length = (size_t) n;
+  }
+
+  io.in_length--;
+  return *io.in++;
+}
+
+/*
+ * The numbers of bytes of input read by , and of output written by . so far
+ */
+void io_counts(uint64_t* read, uint64_t* written) {
+  *read = io.read;
+  *written = io.written;
+}
+
+/*
+ * Carries on the I/O of a run resumed from a checkpoint, which had read and
+ * written the given numbers of bytes: the input it read is skipped, the same
+ * input being given again, and the counts carry on from there
+ */
+void io_resume(uint64_t read, uint64_t written) {
+  for (uint64_t i=0; i<read && io_getc() != EOF; i++) {}
+  io.read = read;
+  io.written = written;
+}
+
+/*
+ * Reads a byte for the , operator of a VM, giving 0 at EOF
+ */
+size_bf b_getchar(BFVM* vm) {
+  if (vm->io != NULL) {
+    int c = vm->io->get(vm->io->ctx);
+    return (c == EOF) ? 0 : (size_bf) (unsigned char) c;
   }
 
+  int c = io_getc();
+  if (c == EOF) { return 0; }
+  io.read++;
+  return (size_bf) (unsigned char) c;
 }
 
 /*
- * Wrapper for putchar() that actually does very little, but performs correct
- * type casts
+ * Writes the low byte of a cell for the . operator of a VM
  */
-void b_putchar(size_bf c) {
+void b_putchar(BFVM* vm, size_bf c) {
+  if (vm->io != NULL) {
+    vm->io->put(vm->io->ctx, (uint8_t) c);
+    return;
+  }
+
+  if (io.out_length == IO_BUFFER_SIZE) { io_flush(); }
+
   unsigned char out = (unsigned char) c;
-  putchar(out);
+  io.out_buffer[io.out_length++] = out;
+  io.written++;
+
+  if (out == '\n' && io.out_tty) { io_flush(); }
 }
 
 /*----*/
 
 /*
- * Constructor and destructor for BFFn structure
+ * Constructor for BFFn structure, sharing the given code (a slice of the loaded
+ * program) rather than copying it, with a single reference held by the caller.
+ * It is put on the live list of the frame stack's function table.
  */
-BFFn* fn_create() {
+BFFn* fn_create(const BFCode* code, BFFnTable* fns) {
   BFFn* out = (BFFn*) malloc(sizeof(BFFn));
-  out->length = 0;
-  out->insts = NULL;
+  if (out == NULL) { throw_fault("not enough memory to define function"); }
+  out->code = *code;
+  out->refs = 1;
+
+  out->next = fns->live;
+  out->link = &fns->live;
+  if (fns->live != NULL) { fns->live->link = &out->next; }
+  fns->live = out;
   return out;
 }
-void fn_destroy(BFFn* fn) {
-  free(fn->insts);
-  free(fn);
+
+/*
+ * Take another reference to a function, returning it
+ */
+BFFn* fn_retain(BFFn* fn) {
+  fn->refs++;
+  return fn;
 }
 
 /*
- * Memcopy the instructions from one place to another, ie for loading a VM for
- * a function call
+ * Drop a reference to a function, freeing it with the last one. The code is
+ * not freed, being part of the loaded program.
  */
-void instructions_copy(BFInstructions* dest, BFInstructions* src) {
-  dest->length = src->length;
-  dest->insts = (BFInst*) malloc(dest->length * sizeof(BFInst));
-  memcpy(dest->insts, src->insts, dest->length);
+void fn_release(BFFn* fn) {
+  if (--fn->refs == 0) {
+    *fn->link = fn->next;
+    if (fn->next != NULL) { fn->next->link = fn->link; }
+    free(fn);
+  }
 }
 
 /*
  * Copy a cell (e.g for arguments and return values), simply returning a new
  * BFCell structure with the value if a value.
- * For function definitions (functions are first class), they are deep copied
+ * For function definitions (functions are first class), the copy shares the
+ * same immutable function, taking another reference to it
  */
 BFCell cell_copy(BFCell c) {
   BFCell out;
   if (c.type == TYPE_FN) {
     out.type = TYPE_FN;
-    out.as.FN = fn_create();
-
-    out.as.FN->length = c.as.FN->length;
-    out.as.FN->insts = (BFInst*) malloc(sizeof(BFInst) * out.as.FN->length);
-    memcpy(out.as.FN->insts, c.as.FN->insts, sizeof(BFInst) * out.as.FN->length);
+    out.as.FN = fn_retain(c.as.FN);
   }
   else {
     out.type = TYPE_VALUE;
@@ -114,3 +280,159 @@ BFCell cell_copy(BFCell c) {
   }
   return out;
 }
+
+/*----*/
+
+/*
+ * Reads the value of the cell at an index of a VM's tape, of any width
+ */
+size_bf vm_get_value(const BFVM* vm, size_t index) {
+  switch (vm->config.cell_size) {
+    case 1: return ((const uint8_t*) vm->tape)[index];
+    case 2: return ((const uint16_t*) vm->tape)[index];
+    default: return ((const uint32_t*) vm->tape)[index];
+  }
+}
+
+/*
+ * Sets the value of the cell at an index of a VM's tape, wrapping it to the
+ * width of the cell. Does not change whether the cell is a function.
+ */
+void vm_set_value(BFVM* vm, size_t index, size_bf value) {
+  switch (vm->config.cell_size) {
+    case 1: ((uint8_t*) vm->tape)[index] = (uint8_t) value; break;
+    case 2: ((uint16_t*) vm->tape)[index] = (uint16_t) value; break;
+    default: ((uint32_t*) vm->tape)[index] = (uint32_t) value; break;
+  }
+}
+
+/*
+ * Hash table position of a key, being the address of a cell
+ */
+static size_t fn_table_hash(const BFFnTable* table, const uint8_t* key) {
+  return (size_t) (((uint64_t) (uintptr_t) key * 0x9E3779B97F4A7C15ull) >> 32) & (table->capacity - 1);
+}
+
+/*
+ * Position of a key in the table, or of the empty entry where it would go
+ */
+static size_t fn_table_find(const BFFnTable* table, const uint8_t* key) {
+  size_t i = fn_table_hash(table, key);
+  while (table->keys[i] != NULL && table->keys[i] != key) {
+    i = (i + 1) & (table->capacity - 1);
+  }
+  return i;
+}
+
+/*
+ * Adds the function of a cell to the table, doubling its capacity to keep it
+ * at most half full
+ */
+static void fn_table_put(BFFnTable* table, const uint8_t* key, BFFn* fn) {
+  if ((table->length + 1) * 2 > table->capacity) {
+    BFFnTable old = *table;
+
+    table->capacity = (old.capacity == 0) ? 64 : old.capacity * 2;
+    table->keys = (const uint8_t**) calloc(table->capacity, sizeof(uint8_t*));
+    table->fns = (BFFn**) malloc(sizeof(BFFn*) * table->capacity);
+    if (table->keys == NULL || table->fns == NULL) {
+      throw_fault("not enough memory for function cells");
+    }
+
+    for (size_t i=0; i<old.capacity; i++) {
+      if (old.keys[i] != NULL) {
+        size_t j = fn_table_find(table, old.keys[i]);
+        table->keys[j] = old.keys[i];
+        table->fns[j] = old.fns[i];
+      }
+    }
+    free(old.keys);
+    free(old.fns);
+  }
+
+  size_t i = fn_table_find(table, key);
+  table->keys[i] = key;
+  table->fns[i] = fn;
+  table->length++;
+}
+
+/*
+ * Removes the function of a cell from the table, returning it. The entries
+ * after it are shifted back, so that lookups never need to skip removed ones.
+ */
+static BFFn* fn_table_remove(BFFnTable* table, const uint8_t* key) {
+  size_t mask = table->capacity - 1;
+  size_t i = fn_table_find(table, key);
+  BFFn* fn = table->fns[i];
+
+  size_t j = i;
+  for (;;) {
+    j = (j + 1) & mask;
+    if (table->keys[j] == NULL) { break; }
+
+    /* An entry may fill the gap only if its home position is not after it */
+    size_t home = fn_table_hash(table, table->keys[j]);
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      table->keys[i] = table->keys[j];
+      table->fns[i] = table->fns[j];
+      i = j;
+    }
+  }
+  table->keys[i] = NULL;
+  table->length--;
+
+  return fn;
+}
+
+/*
+ * The function in the cell at an index of a VM's tape, which must be one
+ */
+BFFn* vm_get_fn(const BFVM* vm, size_t index) {
+  return vm->fns->fns[fn_table_find(vm->fns, vm->tape + index * vm->config.cell_size)];
+}
+
+/*
+ * Reads the cell at an index of a VM's tape, as a BFCell. This does not take
+ * a reference to any function, so should be passed to cell_copy() to keep.
+ */
+BFCell vm_get_cell(const BFVM* vm, size_t index) {
+  BFCell out;
+  if (VM_IS_FN(vm, index)) {
+    out.type = TYPE_FN;
+    out.as.FN = vm_get_fn(vm, index);
+  }
+  else {
+    out.type = TYPE_VALUE;
+    out.as.VALUE = vm_get_value(vm, index);
+  }
+  return out;
+}
+
+/*
+ * Sets the cell at an index of a VM's tape, which takes over the reference to
+ * any function held by the given cell. Any function previously in the cell is
+ * released. The value of a function cell is left as 0.
+ */
+void vm_set_cell(BFVM* vm, size_t index, BFCell cell) {
+  const uint8_t* key = vm->tape + index * vm->config.cell_size;
+
+  if (VM_IS_FN(vm, index)) {
+    fn_release(fn_table_remove(vm->fns, key));
+  }
+
+  if (cell.type == TYPE_FN) {
+#ifdef BF_STATS
+    size_t capacity = vm->fns->capacity;
+    fn_table_put(vm->fns, key, cell.as.FN);
+    if (vm->fns->capacity != capacity) { VM_STAT(vm, allocs, 2); }
+#else
+    fn_table_put(vm->fns, key, cell.as.FN);
+#endif
+    vm_set_value(vm, index, 0);
+    vm->fn_bits[index >> 3] |= (uint8_t) (1 << (index & 7));
+  }
+  else {
+    vm_set_value(vm, index, cell.as.VALUE);
+    vm->fn_bits[index >> 3] &= (uint8_t) ~(1 << (index & 7));
+  }
+}